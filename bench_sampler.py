@@ -0,0 +1,29 @@
+import argparse
+import re
+import subprocess
+
+def run(binary, model, input_file, k, sampler, iteration, worker, extra):
+    cmd = [binary, model, input_file, '-K', str(k), '-I', str(iteration), '--update', str(iteration),
+        '--oi', '0', '-w', str(worker), '-S', '1', '-V', '1', '--words', '0', '--sampler', sampler] + extra
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, check=True).stdout.decode('utf-8')
+    throughput = float(re.search(r'Throughput: ([0-9.e+]+) tokens/sec', out).group(1))
+    perp = float(re.search(r'Elapsed: [0-9.e+]+ ms, Perp: ([0-9.e+]+)', out).group(1))
+    return throughput, perp
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Benchmark tokens/sec of each sampler versus the number of topics')
+    parser.add_argument('input')
+    parser.add_argument('--binary', default='./gdmr')
+    parser.add_argument('--model', default='lda')
+    parser.add_argument('--topics', default='10,50,100,500,1000,2000')
+    parser.add_argument('--samplers', default='dense,sparse')
+    parser.add_argument('--iteration', type=int, default=50)
+    parser.add_argument('--worker', type=int, default=1)
+    # unknown arguments are passed to the binary (ex. -F 1 for dmr)
+    args, extra = parser.parse_known_args()
+
+    samplers = args.samplers.split(',')
+    print('K\t' + '\t'.join('{} (tokens/sec, perp.)'.format(s) for s in samplers))
+    for k in map(int, args.topics.split(',')):
+        res = [run(args.binary, args.model, args.input, k, s, args.iteration, args.worker, extra) for s in samplers]
+        print('{}\t'.format(k) + '\t'.join('{:.4g}, {:.4g}'.format(*r) for r in res))
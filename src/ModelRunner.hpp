@@ -1,7 +1,9 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <deque>
 #include <tuple>
+#include <cstring>
 #include <chrono>
 #include <iostream>
 #include <fstream>
@@ -25,10 +27,15 @@ struct ModelRunnerBase
 	struct Args
 	{
 		string modelType, load, save, bestSave, inference, stopword;
+		string saveCorpus, loadCorpus;
 		vector<string> input;
 		string saveTopicAssign, bestSaveTopicAssign, saveParameters, saveWordDist, saveTopicDistByDoc;
 		tomoto::TermWeight weight = tomoto::TermWeight::one;
+		tomoto::Sampler sampler = tomoto::Sampler::dense;
 		size_t saveFullModel = 0;
+		size_t mappedModel = 0;
+		size_t inferenceCorpus = 0;
+		size_t sparseTopicWord = 0;
 		size_t worker = 0;
 		size_t K = 1;
 		double alpha = 0, eta = 0.01, gamma = 0.1, sigma = 1.0, lambda = 0.1;
@@ -40,14 +47,22 @@ struct ModelRunnerBase
 		int verbose = 2;
 		size_t repeat = 1;
 		size_t optimInterval = -1, bi = 0, optimRepeat = 5;
+		int optimWarmStart = 0;
+		tomoto::LambdaOptimizer lambdaOptimizer = tomoto::LambdaOptimizer::lbfgs;
+		size_t optimBatchSize = 1024, optimSteps = 20;
+		size_t optimStaleness = 0;
+		double optimLearningRate = 0.05, optimDecay = 0.5;
 		size_t dirichletEstIteration = -1;
 		size_t update = 10;
 		size_t iteration = 1000;
+		size_t newIteration = 0; // iterations on docs appended to a loaded model only, before those on all docs
 		size_t numMaxLine = -1, numMaxLength = -1;
 		size_t numTopWords = 25, numTopWordsSaving = -1;
 		size_t saveUpdateInterval = 100;
 		vector<float> mdMin, mdMax;
 		int fa = 0, minCount = 0, fI = 100, rm = 0;
+		size_t online = 0; // docs per batch of online training, 0 for batch training
+		double onlineTau = 1, onlineKappa = 0.7;
 		size_t clDevice = 0;
 		size_t clGroup = 32, clLocal = 128, clUpdate = 10;
 	};
@@ -107,11 +122,11 @@ struct ModelRunner : public ModelRunnerBase
 	static ModelRunnerBase* factory() { return new _Derived; }
 	Args args;
 	shared_ptr<_Model> model;
-	unordered_set<string> stopwordSet;
+	tomoto::Dictionary stopwordSet;
 	vector<size_t> loadedDocId;
-	bool filterSentDelim(const string& str)
+	bool filterSentDelim(tomoto::StringView str)
 	{
-		return !stopwordSet.count(str);
+		return stopwordSet.toWid(str) == (tomoto::VID)-1;
 	}
 
 	void loadStopwordSet()
@@ -122,7 +137,7 @@ struct ModelRunner : public ModelRunnerBase
 		while (getline(ifs, line))
 		{
 			while (!line.empty() && isspace(line.back()))  line.pop_back();
-			stopwordSet.emplace(line);
+			stopwordSet.add(line);
 		}
 	}
 
@@ -141,6 +156,12 @@ struct ModelRunner : public ModelRunnerBase
 	}
 #endif
 
+	void saveModel(ostream& os)
+	{
+		if (args.mappedModel) model->saveMappedModel(os, !!args.saveFullModel);
+		else model->saveModel(os, !!args.saveFullModel);
+	}
+
 	void trainModel(string path_suffix, double& perp, double& elapsed)
 	{
 		auto saveResult = [&]()
@@ -184,6 +205,13 @@ struct ModelRunner : public ModelRunnerBase
 		{
 			static_cast<_Derived*>(this)->printTopics();
 		}
+		for (size_t n = 0; n < args.newIteration; n += args.update)
+		{
+			model->trainNewDocs(args.update, args.worker, tomoto::ParallelScheme::partition);
+			double llpw = model->getLLPerWord();
+			if (args.verbose) printf("(new %03zd) Perp : %e (%g)\n", n + args.update, exp(-llpw), llpw);
+			fflush(stdout);
+		}
 		double bestPerp = INFINITY;
 		for (size_t n = 0; n < args.iteration; n += args.update)
 		{
@@ -215,8 +243,8 @@ struct ModelRunner : public ModelRunnerBase
 				bestPerp = perp;
 				if (!args.bestSave.empty())
 				{
-					ofstream ofs{ args.bestSave + path_suffix };
-					model->saveModel(ofs, !!args.saveFullModel);
+					ofstream ofs{ args.bestSave + path_suffix, ios_base::binary };
+					saveModel(ofs);
 				}
 				if (!args.bestSaveTopicAssign.empty())
 				{
@@ -235,21 +263,109 @@ struct ModelRunner : public ModelRunnerBase
 		perp = model->getPerplexity();
 		elapsed = timer.getElapsed();
 		printf("Elapsed: %g ms, Perp: %e\n", elapsed, perp);
+		if (args.iteration) printf("Throughput: %g tokens/sec\n", (double)model->getN() * args.iteration / elapsed * 1000);
 		fflush(stdout);
 		if (!args.save.empty())
 		{
 			ofstream ofs{ args.save + path_suffix, ios_base::binary };
-			model->saveModel(ofs, !!args.saveFullModel);
+			saveModel(ofs);
 		}
 		saveResult();
 	}
 
+	/*
+	trains online over batches of args.online docs, streamed from the input files args.iteration times.
+	the vocabulary has been counted by scan(), and docs are dropped after their batch is trained.
+	*/
+	void trainModelOnline(string path_suffix, double& perp, double& elapsed)
+	{
+		if (!args.saveTopicAssign.empty() || !args.bestSaveTopicAssign.empty() || !args.bestSave.empty())
+		{
+			printf("Topic assignments and the best model are not kept in online training.\n");
+		}
+		model->setOnlineStepSize(args.onlineTau, args.onlineKappa);
+		if (args.verbose) printf("Training online in batches of %zd docs (%zd vocabs)...\n", args.online, model->getV());
+
+		Timer timer;
+		vector<unique_ptr<tomoto::DocumentBase>> batch;
+		vector<tomoto::DocumentBase*> pbatch;
+		unique_ptr<ofstream> dist; // topic distributions of docs are written in the last pass
+		double ll = 0;
+		size_t numWords = 0, numBatches = 0, totWords = 0;
+		auto trainBatch = [&]()
+		{
+			pbatch.clear();
+			size_t n = 0;
+			for (auto& d : batch)
+			{
+				if (d->words.empty()) continue;
+				pbatch.emplace_back(d.get());
+				n += count_if(d->words.begin(), d->words.end(), [&](tomoto::VID w) { return w < model->getV(); });
+			}
+			if (!pbatch.empty())
+			{
+				double llpw = model->trainOnline(pbatch, args.worker);
+				ll += llpw * n;
+				numWords += n;
+				// --update 0 prints no progress of batches
+				if (args.verbose && args.update && ++numBatches % args.update == 0) printf("(%05zd) Perp : %e (%g)\n", numBatches, exp(-llpw), llpw);
+			}
+			if (dist)
+			{
+				for (auto& d : batch)
+				{
+					if (d->words.empty()) *dist << "-";
+					else static_cast<_Derived*>(this)->writeTopicDist(*dist, *static_cast<const typename Model::DefaultDocType*>(d.get()));
+					*dist << endl;
+				}
+			}
+			batch.clear();
+		};
+
+		for (size_t pass = 0; pass < args.iteration; ++pass)
+		{
+			ll = 0;
+			numWords = 0;
+			if (pass + 1 == args.iteration && !args.saveTopicDistByDoc.empty()) dist.reset(new ofstream{ args.saveTopicDistByDoc + path_suffix });
+			// an input which can't be opened any more ends the passes
+			if (readInputs([&](const vector<tomoto::VID>& words, const vector<string>& features)
+			{
+				batch.emplace_back(static_cast<_Derived*>(this)->makeLoadedDoc(words, features));
+				if (batch.size() >= args.online) trainBatch();
+				return !words.empty();
+			}) < 0) break;
+			trainBatch();
+			totWords += numWords;
+			if (args.verbose) printf("[Pass %zd] Perp : %e (%g)\n", pass + 1, exp(-ll / numWords), ll / numWords);
+			fflush(stdout);
+		}
+		dist.reset();
+
+		printf("\n=== Result ===\n");
+		perp = exp(-ll / numWords);
+		elapsed = timer.getElapsed();
+		printf("Elapsed: %g ms, Perp: %e\n", elapsed, perp);
+		if (args.iteration) printf("Throughput: %g tokens/sec\n", (double)totWords / elapsed * 1000);
+		fflush(stdout);
+		if (!args.save.empty())
+		{
+			ofstream ofs{ args.save + path_suffix, ios_base::binary };
+			saveModel(ofs);
+		}
+		if (!args.saveWordDist.empty())
+		{
+			ofstream ofs{ args.saveWordDist + path_suffix };
+			static_cast<_Derived*>(this)->writeWordDist(ofs);
+		}
+	}
+
 	int run(Args _args) override
 	{
 		args = _args;
+		const string inputDesc = args.loadCorpus.empty() ? tomoto::text::join(args.input.begin(), args.input.end()) : args.loadCorpus;
 		if (args.load.empty())
 		{
-			printf("Input file = %s, ", tomoto::text::join(args.input.begin(), args.input.end()).c_str());
+			printf("Input file = %s, ", inputDesc.c_str());
 		}
 		else
 		{
@@ -282,15 +398,26 @@ struct ModelRunner : public ModelRunnerBase
 					{
 						puts(static_cast<_Derived*>(this)->getParameterDesc().c_str());
 						printf("Term Weighting: %s\n", twMsg[(int)args.weight]);
+						printf("Sampler: %s\n", tomoto::toString(args.sampler));
+						printf("Instruction Set: %s\n", tomoto::toString(tomoto::getArch()));
 					}
-					if (args.verbose) printf("Loading '%s'...\n", tomoto::text::join(args.input.begin(), args.input.end()).c_str());
-					int numLine = load();
-					if (!numLine)
+					if (args.verbose) printf("Loading '%s'...\n", inputDesc.c_str());
+					int numLine = args.online ? scan() : (args.loadCorpus.empty() ? load() : loadCompiledCorpus());
+					if (numLine <= 0)
 					{
-						printf("Wrong Input '%s'\n", tomoto::text::join(args.input.begin(), args.input.end()).c_str());
+						printf("Wrong Input '%s'\n", inputDesc.c_str());
 						return -1;
 					}
-					model->prepare(true, args.minCount, args.rm);
+					if (i == 0 && !args.saveCorpus.empty())
+					{
+						if (args.verbose) printf("Saving corpus to '%s'...\n", args.saveCorpus.c_str());
+						ofstream ofs{ args.saveCorpus, ios_base::binary };
+						model->saveCorpus(ofs);
+						tomoto::serializer::writeMany(ofs, loadedDocId);
+					}
+					// the original order of words is needed only to write topic assignments in it
+					model->setKeepWordOrder(!args.saveTopicAssign.empty() || !args.bestSaveTopicAssign.empty());
+					model->prepare(true, args.minCount, args.rm, args.worker);
 					if (args.verbose && args.minCount) printf("Min Count of Words: %d\n", args.minCount);
 					if (args.verbose && args.numMaxLength != (size_t)-1) printf("Max Length of Document: %zd\n", args.numMaxLength);
 					if (args.verbose && args.rm)
@@ -303,14 +430,22 @@ struct ModelRunner : public ModelRunnerBase
 						}
 						printf("\n");
 					}
-					trainModel(path_suffix, perp[i], elapsed[i]);
+					if (args.online) trainModelOnline(path_suffix, perp[i], elapsed[i]);
+					else trainModel(path_suffix, perp[i], elapsed[i]);
 				}
 				else
 				{
 					try
 					{
-						ifstream ifs{ args.load, ios_base::binary };
-						model->loadModel(ifs);
+						if (args.mappedModel)
+						{
+							model->loadMappedModel(args.load);
+						}
+						else
+						{
+							ifstream ifs{ args.load, ios_base::binary };
+							model->loadModel(ifs);
+						}
 						static_cast<_Derived*>(this)->onModelLoaded();
 					}
 					catch (const tomoto::serializer::UnfitException& e)
@@ -321,6 +456,20 @@ struct ModelRunner : public ModelRunnerBase
 					}
 					loadedDocId.resize(model->getNumDocs());
 					iota(loadedDocId.begin(), loadedDocId.end(), 0);
+					if (!args.input.empty())
+					{
+						// docs of the input files are appended to the model, and training goes on from its state
+						const size_t numDocs = model->getNumDocs();
+						if (args.verbose) printf("Appending '%s'...\n", inputDesc.c_str());
+						if (load() < 0)
+						{
+							printf("Wrong Input '%s'\n", inputDesc.c_str());
+							return -1;
+						}
+						model->setKeepWordOrder(!args.saveTopicAssign.empty() || !args.bestSaveTopicAssign.empty());
+						size_t numNewWords = model->prepareNewDocs(args.minCount, args.worker);
+						if (args.verbose) printf("%zd docs and %zd vocabs are appended.\n", model->getNumDocs() - numDocs, numNewWords);
+					}
 					puts(static_cast<_Derived*>(this)->getParameterDesc().c_str());
 					printf("Term Weighting: %s\n", twMsg[(int)model->getTermWeight()]);
 					trainModel(path_suffix, perp[i], elapsed[i]);
@@ -354,45 +503,194 @@ struct ModelRunner : public ModelRunnerBase
 
 		if (args.inference.empty()) return 0;
 		printf("Inference unseen document file '%s'...\n", args.inference.c_str());
-		ifstream inf{ args.inference };
 		string line;
 		size_t numLine = 0;
 
 		vector<unique_ptr<tomoto::DocumentBase>> docs;
 		vector<tomoto::DocumentBase*> pdocs;
-		while (getline(inf, line))
+		if (args.inferenceCorpus)
 		{
-			unique_ptr<tomoto::DocumentBase> doc;
-			if (static_cast<_Derived*>(this)->loadLine(line, &doc))
+			ifstream inf{ args.inference, ios_base::binary };
+			for (auto& doc : model->makeDocsFromCorpus(inf))
 			{
+				if (doc->words.empty()) continue;
 				numLine++;
 				docs.emplace_back(move(doc));
 				pdocs.emplace_back(docs.back().get());
 			}
 		}
+		else
+		{
+			ifstream inf{ args.inference };
+			while (getline(inf, line))
+			{
+				unique_ptr<tomoto::DocumentBase> doc;
+				if (static_cast<_Derived*>(this)->loadLine(line, &doc))
+				{
+					numLine++;
+					docs.emplace_back(move(doc));
+					pdocs.emplace_back(docs.back().get());
+				}
+			}
+		}
 		static_cast<_Derived*>(this)->infer(pdocs, args.fa);
 		return 0;
 	}
 
+	// reads a corpus written with --csave, which has loadedDocId after the docs
+	int loadCompiledCorpus()
+	{
+		ifstream ifs{ args.loadCorpus, ios_base::binary };
+		if (!ifs) return 0;
+		try
+		{
+			model->loadCorpus(ifs);
+		}
+		catch (const tomoto::serializer::UnfitException& e)
+		{
+			printf("%s\n", e.what());
+			return 0;
+		}
+		tomoto::serializer::readMany(ifs, loadedDocId);
+		return model->getNumDocs();
+	}
+
+	// lines of an input file tokenized by a worker, with vids of its own vocabulary
+	struct LoadedChunk
+	{
+		tomoto::Dictionary dict;
+		vector<tomoto::VID> words;
+		vector<size_t> docEnds;
+		vector<vector<string>> features; // empty if there are no metadata fields
+	};
+
+	LoadedChunk tokenizeChunk(const char* first, const char* last)
+	{
+		LoadedChunk ret;
+		while (first != last)
+		{
+			const char* eol = (const char*)memchr(first, '\n', last - first);
+			if (!eol) eol = last;
+			vector<string> features;
+			size_t numWords = 0;
+			tomoto::text::forEachToken(first, eol, [&](const char* b, const char* e)
+			{
+				const tomoto::StringView word{ b, (size_t)(e - b) };
+				if (features.size() < args.numMDFields)
+				{
+					features.emplace_back(b, e);
+					return true;
+				}
+				if (filterSentDelim(word))
+				{
+					ret.words.emplace_back(ret.dict.add(word));
+					++numWords;
+				}
+				return numWords < args.numMaxLength;
+			});
+			ret.docEnds.emplace_back(ret.words.size());
+			if (args.numMDFields) ret.features.emplace_back(move(features));
+			first = eol == last ? last : eol + 1;
+		}
+		return ret;
+	}
+
+	// gives docs of the chunk to addDoc(words, features) in order, returns false once numMaxLine docs are taken
+	template<typename _Fn>
+	bool addChunk(const LoadedChunk& chunk, size_t& numLine, _Fn& addDoc)
+	{
+		static const vector<string> noFeatures;
+		vector<tomoto::VID> vids(chunk.dict.size(), (tomoto::VID)-1), words;
+		size_t b = 0;
+		for (size_t i = 0; i < chunk.docEnds.size(); ++i)
+		{
+			if (numLine >= args.numMaxLine) return false;
+			words.clear();
+			for (size_t j = b; j < chunk.docEnds[i]; ++j)
+			{
+				// words are added into the vocabulary in the order of their first occurrences, as they are by a single reader
+				auto& v = vids[chunk.words[j]];
+				if (v == (tomoto::VID)-1) v = model->addWord(chunk.dict.toWord(chunk.words[j]));
+				words.emplace_back(v);
+			}
+			b = chunk.docEnds[i];
+			if (addDoc(words, chunk.features.empty() ? noFeatures : chunk.features[i])) ++numLine;
+		}
+		return true;
+	}
+
 	int load()
+	{
+		return readInputs([this](const vector<tomoto::VID>& words, const vector<string>& features)
+		{
+			size_t docId = static_cast<_Derived*>(this)->addLoadedDoc(words, features);
+			loadedDocId.emplace_back(docId);
+			return docId != (size_t)-1;
+		});
+	}
+
+	// counts the vocabulary of the inputs for online training, without keeping docs
+	int scan()
+	{
+		return readInputs([this](const vector<tomoto::VID>& words, const vector<string>& features)
+		{
+			if (words.empty()) return false;
+			static_cast<_Derived*>(this)->scanLoadedDoc(words, features);
+			return true;
+		});
+	}
+
+	/*
+	input files are mapped and split into chunks at line boundaries, which are tokenized by workers.
+	chunks are given to addDoc in the order of the files, so docs get the same ids as reading them line by line.
+	returns the number of docs added, or -1 if an input can't be opened.
+	*/
+	template<typename _Fn>
+	int readInputs(_Fn addDoc)
 	{
 		loadStopwordSet();
-		string line;
+		// hardware_concurrency() may be 0 where it isn't known
+		const size_t numWorkers = max(args.worker ? args.worker : (size_t)thread::hardware_concurrency(), (size_t)1);
+		tomoto::ThreadPool pool{ numWorkers };
 		size_t numLine = 0;
+		bool full = false;
 		for (auto& p : args.input)
 		{
-			ifstream f{ p };
-			while (getline(f, line) && numLine < args.numMaxLine)
+			unique_ptr<tomoto::MappedFile> file;
+			try
 			{
-				if (static_cast<_Derived*>(this)->loadLine(line))
-				{
-					loadedDocId.emplace_back(numLine++);
-				}
-				else
+				file.reset(new tomoto::MappedFile{ p });
+			}
+			catch (const ios_base::failure&)
+			{
+				printf("Cannot open input '%s'\n", p.c_str());
+				return -1;
+			}
+			const char* first = file->data();
+			const char* last = first + file->size();
+			const size_t chunkSize = max(min(file->size() / (numWorkers * 4), (size_t)1 << 23), (size_t)1 << 16);
+			deque<future<LoadedChunk>> pending;
+			while (!full && (first != last || !pending.empty()))
+			{
+				// keeps a bounded number of chunks in flight, since a tokenized chunk is about as large as its text
+				while (first != last && pending.size() < numWorkers * 2)
 				{
-					loadedDocId.emplace_back(-1);
+					const char* end = nullptr;
+					if ((size_t)(last - first) > chunkSize) end = (const char*)memchr(first + chunkSize, '\n', last - first - chunkSize);
+					end = end ? end + 1 : last;
+					pending.emplace_back(pool.enqueue([this, first, end](size_t)
+					{
+						return tokenizeChunk(first, end);
+					}));
+					first = end;
 				}
+				auto chunk = pending.front().get();
+				pending.pop_front();
+				full = !addChunk(chunk, numLine, addDoc);
 			}
+			// remaining chunks still read the file
+			for (auto& f : pending) f.wait();
+			if (full) break;
 		}
 		return numLine;
 	}
@@ -429,7 +727,7 @@ struct LDARunner : public ModelRunner<
 			return ret;
 		}
 #endif
-		return Model::create(this->args.weight, this->args.K, (tomoto::FLOAT)this->args.alpha, (tomoto::FLOAT)this->args.eta, tomoto::RandGen{seed});
+		return Model::create(this->args.weight, this->args.K, (tomoto::FLOAT)this->args.alpha, (tomoto::FLOAT)this->args.eta, tomoto::RandGen{seed}, !!this->args.sparseTopicWord);
 
 	}
 
@@ -437,9 +735,11 @@ struct LDARunner : public ModelRunner<
 	{
 		if (this->args.optimInterval != (size_t)-1) this->model->setOptimInterval(this->args.optimInterval);
 		this->model->setBurnInIteration(this->args.bi);
+		this->model->setOptimStaleness(this->args.optimStaleness);
+		this->model->setSampler(this->args.sampler);
 	}
 
-	int loadLine(const string& line, unique_ptr<tomoto::DocumentBase>* doc = nullptr)
+	int loadLine(const string& line, unique_ptr<tomoto::DocumentBase>* doc)
 	{
 		istringstream iss{ line };
 		auto begin = istream_iterator<string>{ iss }, end = istream_iterator<string>{};
@@ -454,16 +754,23 @@ struct LDARunner : public ModelRunner<
 			if (this->filterSentDelim(*begin)) words.emplace_back(*begin);
 			if (words.size() >= this->args.numMaxLength) break;
 		}
-		if (!doc)
-		{
-			this->model->addDoc(words);
-			return words.size();
-		}
-		else
-		{
-			*doc = this->model->makeDoc(words);
-			return (*doc)->words.size();
-		}
+		*doc = this->model->makeDoc(words);
+		return (*doc)->words.size();
+	}
+
+	size_t addLoadedDoc(const vector<tomoto::VID>& words, const vector<string>&)
+	{
+		return this->model->addDoc(words);
+	}
+
+	void scanLoadedDoc(const vector<tomoto::VID>& words, const vector<string>&)
+	{
+		this->model->scanDoc(words);
+	}
+
+	unique_ptr<tomoto::DocumentBase> makeLoadedDoc(const vector<tomoto::VID>& words, const vector<string>&)
+	{
+		return this->model->makeDoc(words);
 	}
 
 	string getParameterDesc()
@@ -519,7 +826,8 @@ struct LDARunner : public ModelRunner<
 		for (size_t w = 0; w < doc.words.size(); ++w)
 		{
 			size_t t = doc.wOrder.empty() ? w : doc.wOrder[w];
-			out << this->model->getVocabDict().toWord(doc.words[t]) << '/' << (int)doc.Zs[t] << ' ';
+			auto word = this->model->getVocabDict().toWordView(doc.words[t]);
+			out.write(word.data(), word.size()) << '/' << (int)doc.Zs[t] << ' ';
 		}
 	}
 
@@ -560,17 +868,25 @@ struct DMRRunner : public LDARunner<
 				(tomoto::FLOAT)this->args.alphaEps, tomoto::RandGen{ seed });
 			this->initCL(ret);
 			ret->setOptimRepeat(this->args.optimRepeat);
+			ret->setOptimWarmStart(!!this->args.optimWarmStart);
+			ret->setLambdaOptimizer(this->args.lambdaOptimizer);
+			ret->setOptimBatch(this->args.optimBatchSize, this->args.optimSteps);
+			ret->setOptimLearningRate((tomoto::FLOAT)this->args.optimLearningRate, (tomoto::FLOAT)this->args.optimDecay);
 			return ret;
 		}
 #endif
 		auto ret = Model::create( this->args.weight, this->args.K, 
 			(tomoto::FLOAT)this->args.alpha, (tomoto::FLOAT)this->args.sigma, (tomoto::FLOAT)this->args.eta, 
-			this->args.alphaEps, tomoto::RandGen{ seed } );
+			this->args.alphaEps, tomoto::RandGen{ seed }, !!this->args.sparseTopicWord);
 		ret->setOptimRepeat(this->args.optimRepeat);
+		ret->setOptimWarmStart(!!this->args.optimWarmStart);
+		ret->setLambdaOptimizer(this->args.lambdaOptimizer);
+		ret->setOptimBatch(this->args.optimBatchSize, this->args.optimSteps);
+		ret->setOptimLearningRate((tomoto::FLOAT)this->args.optimLearningRate, (tomoto::FLOAT)this->args.optimDecay);
 		return ret;
 	}
 
-	int loadLine(const string& line, unique_ptr<tomoto::DocumentBase>* doc = nullptr)
+	int loadLine(const string& line, unique_ptr<tomoto::DocumentBase>* doc)
 	{
 		istringstream iss{ line };
 		auto begin = istream_iterator<string>{ iss }, end = istream_iterator<string>{};
@@ -586,15 +902,23 @@ struct DMRRunner : public LDARunner<
 			if (this->filterSentDelim(*begin)) words.emplace_back(*begin);
 			if (words.size() >= this->args.numMaxLength) break;
 		}
-		if (!doc)
-		{
-			return this->model->addDoc(words, features);
-		}
-		else
-		{
-			*doc = this->model->makeDoc(words, features);
-			return (*doc)->words.size();
-		}
+		*doc = this->model->makeDoc(words, features);
+		return (*doc)->words.size();
+	}
+
+	size_t addLoadedDoc(const vector<tomoto::VID>& words, const vector<string>& features)
+	{
+		return this->model->addDoc(words, features);
+	}
+
+	void scanLoadedDoc(const vector<tomoto::VID>& words, const vector<string>& features)
+	{
+		this->model->scanDoc(words, features);
+	}
+
+	unique_ptr<tomoto::DocumentBase> makeLoadedDoc(const vector<tomoto::VID>& words, const vector<string>& features)
+	{
+		return this->model->makeDoc(words, features);
 	}
 
 	string getParameterDesc()
@@ -661,15 +985,23 @@ template<typename _Derived = void,
 			this->initCL(ret);
 			ret->setMdRange(this->args.mdMin, this->args.mdMax);
 			ret->setOptimRepeat(this->args.optimRepeat);
+			ret->setOptimWarmStart(!!this->args.optimWarmStart);
+			ret->setLambdaOptimizer(this->args.lambdaOptimizer);
+			ret->setOptimBatch(this->args.optimBatchSize, this->args.optimSteps);
+			ret->setOptimLearningRate((tomoto::FLOAT)this->args.optimLearningRate, (tomoto::FLOAT)this->args.optimDecay);
 			ret->setSigma0(this->args.sigma0);
 			return ret;
 		}
 #endif
 		auto ret = Model::create(this->args.weight, this->args.K, this->args.degrees,
 			(tomoto::FLOAT)this->args.alpha, (tomoto::FLOAT)this->args.sigma, (tomoto::FLOAT)this->args.eta,
-			this->args.alphaEps, tomoto::RandGen{ seed });
+			this->args.alphaEps, tomoto::RandGen{ seed }, !!this->args.sparseTopicWord);
 		ret->setMdRange(this->args.mdMin, this->args.mdMax);
 		ret->setOptimRepeat(this->args.optimRepeat);
+		ret->setOptimWarmStart(!!this->args.optimWarmStart);
+		ret->setLambdaOptimizer(this->args.lambdaOptimizer);
+		ret->setOptimBatch(this->args.optimBatchSize, this->args.optimSteps);
+		ret->setOptimLearningRate((tomoto::FLOAT)this->args.optimLearningRate, (tomoto::FLOAT)this->args.optimDecay);
 		ret->setSigma0(this->args.sigma0);
 		return ret;
 	}
@@ -88,7 +88,14 @@ namespace tomoto
 				static_cast<DerivedClass*>(this)->sendLambdas(queue, this->lambda.data());
 			}
 
-			FLOAT evaluateLambdaObj(Eigen::Ref<Eigen::Matrix<FLOAT, -1, 1>> x, Eigen::Matrix<FLOAT, -1, 1>& g, ThreadPool& pool, _ModelState* localData) const
+			// the objective shares the OpenCL buffers, so restarts are run one by one
+			size_t getNumConcurrentRestarts(ThreadPool& pool) const
+			{
+				return 1;
+			}
+
+			// evaluated on all docs in the device, so groups are not used
+			FLOAT evaluateLambdaObj(Eigen::Ref<Eigen::Matrix<FLOAT, -1, 1>> x, Eigen::Matrix<FLOAT, -1, 1>& g, ThreadPool& pool, const LambdaObjGroups& groups) const
 			{
 				if ((x.array() > this->maxLambda).any()) return INFINITY;
 
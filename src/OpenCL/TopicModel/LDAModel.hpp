@@ -51,6 +51,27 @@ namespace tomoto
 			std::vector<uint32_t> vChunkOffset;
 			std::vector<uint32_t> chunkOffsetByDoc;
 
+			// kernels read and write Zs of all docs as a plain array in the order of words
+			std::vector<TID> gatherZs() const
+			{
+				std::vector<TID> ret;
+				ret.reserve(this->words.size());
+				for (auto& doc : this->docs)
+				{
+					for (size_t i = 0; i < doc.Zs.size(); ++i) ret.emplace_back(doc.Zs[i]);
+				}
+				return ret;
+			}
+
+			void scatterZs(const std::vector<TID>& zs)
+			{
+				auto it = zs.begin();
+				for (auto& doc : this->docs)
+				{
+					for (size_t i = 0; i < doc.Zs.size(); ++i) doc.Zs.set(i, *it++);
+				}
+			}
+
 			void initializeBuffer()
 			{
 				const size_t V = this->realV;
@@ -84,7 +105,8 @@ namespace tomoto
 				queue.enqueueWriteBuffer(clBufWs, true, 0, sizeof(VID) * this->words.size(), &this->words[0]);
 				queue.enqueueWriteBuffer(clBufWsOffset, true, 0, sizeof(uint32_t) * this->wOffsetByDoc.size(), &this->wOffsetByDoc[0]);
 				queue.enqueueWriteBuffer(clBufVPartition, true, 0, sizeof(uint32_t) * (numGroup + 1), &vChunkOffset[0]);
-				queue.enqueueWriteBuffer(clBufZs, true, 0, sizeof(TID) * this->sharedZs.size(), &this->sharedZs[0]);
+				auto zs = gatherZs();
+				queue.enqueueWriteBuffer(clBufZs, true, 0, sizeof(TID) * zs.size(), zs.data());
 				queue.enqueueWriteBuffer(clBufNumByTopicDoc, true, 0, sizeof(uint32_t) * this->numByTopicDoc.size(), this->numByTopicDoc.data());
 				queue.enqueueWriteBuffer(clBufVDOffset, true, 0, sizeof(uint32_t) * chunkOffsetByDoc.size(), &chunkOffsetByDoc[0]);
 				queue.enqueueWriteBuffer(clBufNumByWordTopic, true, 0, sizeof(uint32_t) * this->K * V, this->globalState.numByTopicWord.data());
@@ -110,16 +132,29 @@ namespace tomoto
 				initializeBuffer();
 			}
 
+			// buffers are made again for the new docs and vocabulary. kernels sample all docs, so trainNewDocs() does as train() does.
+			size_t _prepareNewDocs(size_t firstDoc, size_t minWordCnt)
+			{
+				size_t ret = BaseClass::_prepareNewDocs(firstDoc, minWordCnt);
+				vChunkOffset.clear();
+				chunkOffsetByDoc.clear();
+				static_cast<DerivedClass*>(this)->prepareCL();
+				return ret;
+			}
+
 			void receiveSamplingResult(cl::CommandQueue& queue)
 			{
 				const size_t V = this->realV;
 				const auto K = this->K;
 				try
 				{
-					queue.enqueueReadBuffer(clBufZs, true, 0, sizeof(TID) * this->sharedZs.size(), &this->sharedZs[0]);
+					std::vector<TID> zs(this->words.size());
+					queue.enqueueReadBuffer(clBufZs, true, 0, sizeof(TID) * zs.size(), zs.data());
+					scatterZs(zs);
 					queue.enqueueReadBuffer(clBufNumByTopicDoc, true, 0, sizeof(uint32_t) * this->numByTopicDoc.size(), this->numByTopicDoc.data());
 					queue.enqueueReadBuffer(clBufNumByWordTopic, true, 0, sizeof(uint32_t) * K * V, this->globalState.numByTopicWord.data());
 					queue.enqueueReadBuffer(clBufNumByTopic, true, 0, sizeof(uint32_t) * K, this->globalState.numByTopic.data());
+					this->invalidateCachedLL();
 				}
 				catch (const cl::Error& e)
 				{
@@ -157,9 +192,9 @@ namespace tomoto
 				this->clUpdate = _clUpdate; 
 			}
 
-			void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0) override
+			void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0, size_t numWorkers = 0) override
 			{
-				BaseClass::prepare(initDocs, minWordCnt, removeTopN);
+				BaseClass::prepare(initDocs, minWordCnt, removeTopN, numWorkers);
 				static_cast<DerivedClass*>(this)->prepareCL();
 			}
 
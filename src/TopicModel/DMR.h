@@ -3,6 +3,18 @@
 
 namespace tomoto
 {
+	enum class LambdaOptimizer { lbfgs, adam, size };
+
+	inline const char* toString(LambdaOptimizer o)
+	{
+		switch (o)
+		{
+		case LambdaOptimizer::lbfgs: return "lbfgs";
+		case LambdaOptimizer::adam: return "adam";
+		default: return "unknown";
+		}
+	}
+
 	template<TermWeight _TW, size_t _Flags = 0>
 	struct DocumentDMR : public DocumentLDA<_TW, _Flags>
 	{
@@ -18,15 +30,35 @@ namespace tomoto
 		using DefaultDocType = DocumentDMR<TermWeight::one>;
 		static IDMRModel* create(TermWeight _weight, size_t _K = 1,
 			FLOAT defaultAlpha = 1.0, FLOAT _sigma = 1.0, FLOAT _eta = 0.01, FLOAT _alphaEps = 1e-10,
-			const RandGen& _rg = RandGen{ std::random_device{}() });
+			const RandGen& _rg = RandGen{ std::random_device{}() }, bool sparseTopicWord = false);
 
 		virtual size_t addDoc(const std::vector<std::string>& words, const std::vector<std::string>& metadata) = 0;
+		virtual size_t addDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) = 0;
 		virtual std::unique_ptr<DocumentBase> makeDoc(const std::vector<std::string>& words, const std::vector<std::string>& metadata) const = 0;
+		virtual std::unique_ptr<DocumentBase> makeDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) const = 0;
+		// registers the metadata too, for ILDAModel::trainOnline()
+		virtual void scanDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) = 0;
 		
 		virtual void setAlphaEps(FLOAT _alphaEps) = 0;
 		virtual FLOAT getAlphaEps() const = 0;
 		virtual void setOptimRepeat(size_t repeat) = 0;
 		virtual size_t getOptimRepeat() const = 0;
+		// starts optimizing lambda from its last optimum, falling back to random restarts only when the objective gets worse than that of the last optimum on the current counts
+		virtual void setOptimWarmStart(bool warmStart) = 0;
+		virtual bool getOptimWarmStart() const = 0;
+		/*
+		LambdaOptimizer::lbfgs evaluates the objective on all docs, while LambdaOptimizer::adam estimates it from mini-batches of docs,
+		taking steps of optimSteps batches of batchSize docs per optimizing, so that its cost doesn't depend on the number of docs.
+		the step size at the t-th optimizing is learningRate * t^-decay.
+		*/
+		virtual void setLambdaOptimizer(LambdaOptimizer optimizer) = 0;
+		virtual LambdaOptimizer getLambdaOptimizer() const = 0;
+		virtual void setOptimBatch(size_t batchSize, size_t optimSteps) = 0;
+		virtual size_t getOptimBatchSize() const = 0;
+		virtual size_t getOptimSteps() const = 0;
+		virtual void setOptimLearningRate(FLOAT learningRate, FLOAT decay) = 0;
+		virtual FLOAT getOptimLearningRate() const = 0;
+		virtual FLOAT getOptimDecay() const = 0;
 		virtual size_t getF() const = 0;
 		virtual FLOAT getSigma() const = 0;
 		virtual const Dictionary& getMetadataDict() const = 0;
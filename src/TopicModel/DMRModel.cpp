@@ -5,9 +5,11 @@ namespace tomoto
 	template class DMRModel<TermWeight::one>;
 	template class DMRModel<TermWeight::idf>;
 	template class DMRModel<TermWeight::pmi>;
+	template class DMRModel<TermWeight::one, flags::partitioned_multisampling | flags::sparse_topic_word>;
 
-	IDMRModel* IDMRModel::create(TermWeight _weight, size_t _K, FLOAT _defaultAlpha, FLOAT _sigma, FLOAT _eta, FLOAT _alphaEps, const RandGen& _rg)
+	IDMRModel* IDMRModel::create(TermWeight _weight, size_t _K, FLOAT _defaultAlpha, FLOAT _sigma, FLOAT _eta, FLOAT _alphaEps, const RandGen& _rg, bool sparseTopicWord)
 	{
+		if (sparseTopicWord) SWITCH_TW_FLAGS(_weight, flags::partitioned_multisampling | flags::sparse_topic_word, DMRModel, _K, _defaultAlpha, _sigma, _eta, _alphaEps, _rg);
 		SWITCH_TW(_weight, DMRModel, _K, _defaultAlpha, _sigma, _eta, _alphaEps, _rg);
 	}
 }
\ No newline at end of file
@@ -10,34 +10,64 @@ Implementation of DMR using Gibbs sampling by bab2min
 
 namespace tomoto
 {
-	template<TermWeight _TW>
-	struct ModelStateDMR : public ModelStateLDA<_TW>
+	template<TermWeight _TW, bool _sparseTopicWord = false>
+	struct ModelStateDMR : public ModelStateLDA<_TW, _sparseTopicWord>
 	{
-		Eigen::Matrix<FLOAT, -1, 1> tmpK;
+	};
+
+	/*
+	docs grouped by the column of alphas they share, which is doc.metadata in DMR and a unique metadata vector in GDMR.
+	built once per prepareOptimizer(), so that each evaluation of the objective gets alphas and scatters gradients
+	per column by blocked matrix products, not per doc.
+	topics of zero count add nothing to the objective nor its gradient, so only non-zero counts of each doc are kept.
+	*/
+	struct LambdaObjGroups
+	{
+		std::vector<size_t> cols; // key of each column, given by getLambdaObjKeys()
+		std::vector<size_t> offsets; // docs of column u are docs[offsets[u], offsets[u + 1])
+		std::vector<uint32_t> docs; // docs ordered by their column, as offsets from the first doc
+		Eigen::Matrix<FLOAT, -1, -1> terms; // (F, numCols), terms of the metadata of each column, used by GDMR only
+		std::vector<size_t> topicOffsets; // non-zero topics of docs[i] are topics[topicOffsets[i], topicOffsets[i + 1])
+		std::vector<TID> topics;
+		std::vector<FLOAT> counts; // numByTopic of each of topics
+		std::vector<FLOAT> sums; // getSumWordWeight() of each of docs
+
+		size_t numCols() const { return cols.size(); }
 	};
 
 	template<TermWeight _TW, size_t _Flags = flags::partitioned_multisampling,
 		typename _Interface = IDMRModel,
 		typename _Derived = void,
 		typename _DocType = DocumentDMR<_TW>,
-		typename _ModelState = ModelStateDMR<_TW>>
+		typename _ModelState = ModelStateDMR<_TW, !!(_Flags & flags::sparse_topic_word)>>
 	class DMRModel : public LDAModel<_TW, _Flags, _Interface,
 		typename std::conditional<std::is_same<_Derived, void>::value, DMRModel<_TW, _Flags>, _Derived>::type,
 		_DocType, _ModelState>
 	{
 		static constexpr const char* TMID = "DMR";
 	protected:
-		using DerivedClass = typename std::conditional<std::is_same<_Derived, void>::value, DMRModel<_TW>, _Derived>::type;
+		using DerivedClass = typename std::conditional<std::is_same<_Derived, void>::value, DMRModel<_TW, _Flags>, _Derived>::type;
 		using BaseClass = LDAModel<_TW, _Flags, _Interface, DerivedClass, _DocType, _ModelState>;
 		friend BaseClass;
 		friend typename BaseClass::BaseClass;
 		using WeightType = typename BaseClass::WeightType;
+		using ParameterApplier = typename BaseClass::ParameterApplier;
+		using ParameterOptimizer = typename BaseClass::ParameterOptimizer;
 
 		Eigen::Matrix<FLOAT, -1, -1> lambda;
 		Eigen::Matrix<FLOAT, -1, -1> expLambda;
 		FLOAT sigma;
 		size_t F = 0;
 		size_t optimRepeat = 5;
+		bool optimWarmStart = false;
+		FLOAT lastLambdaFx = INFINITY; // the objective at the last optimum of L-BFGS, INFINITY when lambda isn't one
+		std::vector<std::unique_ptr<ThreadPool>> restartPools; // pools of the restarts run at once, see getRestartPools()
+		LambdaOptimizer lambdaOptimizer = LambdaOptimizer::lbfgs;
+		size_t optimBatchSize = 1024, optimSteps = 20;
+		FLOAT optimLearningRate = 0.05, optimDecay = 0.5;
+		// state of LambdaOptimizer::adam: moments of the gradient, and the numbers of optimizings and steps done
+		Eigen::Matrix<FLOAT, -1, -1> adamM, adamV;
+		size_t adamIterated = 0, adamSteps = 0;
 		FLOAT alphaEps = 1e-10;
 		FLOAT temperatureScale = 0;
 		static constexpr FLOAT maxLambda = 10;
@@ -52,48 +82,160 @@ namespace tomoto
 			return (x.array() - log(this->alpha)).pow(2).sum() / 2 / pow(sigma, 2);
 		}
 
-		FLOAT evaluateLambdaObj(Eigen::Ref<Eigen::Matrix<FLOAT, -1, 1>> x, Eigen::Matrix<FLOAT, -1, 1>& g, ThreadPool& pool, _ModelState* localData) const
+		static constexpr size_t lambdaObjBlock = 64;
+
+		// the objective which L-BFGS minimizes, which doesn't touch the state of samplers
+		FLOAT evaluateLambdaObj(Eigen::Ref<Eigen::Matrix<FLOAT, -1, 1>> x, Eigen::Matrix<FLOAT, -1, 1>& g, ThreadPool& pool, const LambdaObjGroups& groups) const
+		{
+			return static_cast<const DerivedClass*>(this)->evaluateLambdaObjOfDocs(x, g, pool, nullptr, groups);
+		}
+
+		// the column key of each doc in [first, last)
+		template<typename _DocIter>
+		void getLambdaObjKeys(_DocIter first, _DocIter last, std::vector<size_t>& keys) const
+		{
+			keys.clear();
+			for (; first != last; ++first) keys.emplace_back((*first).metadata);
+		}
+
+		template<typename _DocIter>
+		void fillLambdaObjTerms(LambdaObjGroups& groups, _DocIter first) const
+		{
+		}
+
+		template<typename _DocIter>
+		LambdaObjGroups makeLambdaObjGroups(_DocIter first, _DocIter last) const
+		{
+			LambdaObjGroups groups;
+			std::vector<size_t> keys;
+			static_cast<const DerivedClass*>(this)->getLambdaObjKeys(first, last, keys);
+			groups.docs.resize(keys.size());
+			std::iota(groups.docs.begin(), groups.docs.end(), 0);
+			std::stable_sort(groups.docs.begin(), groups.docs.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+			for (size_t i = 0; i < groups.docs.size(); ++i)
+			{
+				const size_t key = keys[groups.docs[i]];
+				if (groups.cols.empty() || groups.cols.back() != key)
+				{
+					groups.cols.emplace_back(key);
+					groups.offsets.emplace_back(i);
+				}
+			}
+			groups.offsets.emplace_back(groups.docs.size());
+			for (auto d : groups.docs)
+			{
+				const auto& doc = first[d];
+				groups.topicOffsets.emplace_back(groups.topics.size());
+				for (TID k = 0; k < this->K; ++k)
+				{
+					if (!doc.numByTopic[k]) continue;
+					groups.topics.emplace_back(k);
+					groups.counts.emplace_back(doc.numByTopic[k]);
+				}
+				groups.sums.emplace_back(doc.getSumWordWeight());
+			}
+			groups.topicOffsets.emplace_back(groups.topics.size());
+			static_cast<const DerivedClass*>(this)->fillLambdaObjTerms(groups, first);
+			return groups;
+		}
+
+		// alphas (K, num) of columns [firstCol, firstCol + num)
+		void getLambdaObjAlphas(const Eigen::Map<const Eigen::Matrix<FLOAT, -1, -1>>& mappedX, const LambdaObjGroups& groups,
+			size_t firstCol, size_t num, Eigen::Matrix<FLOAT, -1, -1>& out) const
+		{
+			out.resize(this->K, num);
+			for (size_t j = 0; j < num; ++j) out.col(j) = mappedX.col(groups.cols[firstCol + j]).array().exp() + alphaEps;
+		}
+
+		// adds the gradient of columns [firstCol, firstCol + num), whose derivatives by their alphas times alphas are coefs
+		void addLambdaObjGrad(Eigen::Map<Eigen::Matrix<FLOAT, -1, -1>>& mappedG, const LambdaObjGroups& groups,
+			size_t firstCol, size_t num, const Eigen::Matrix<FLOAT, -1, -1>& coefs) const
+		{
+			for (size_t j = 0; j < num; ++j) mappedG.col(groups.cols[firstCol + j]) += coefs.col(j);
+		}
+
+		// the objective of lambda on docs grouped by groups, with its prior
+		FLOAT evaluateLambdaObjOfDocs(Eigen::Ref<Eigen::Matrix<FLOAT, -1, 1>> x, Eigen::Matrix<FLOAT, -1, 1>& g, ThreadPool& pool, _ModelState* localData,
+			const LambdaObjGroups& groups) const
 		{
 			// if one of x is greater than maxLambda, return +inf for preventing searching more
 			if ((x.array() > maxLambda).any()) return INFINITY;
 
 			const auto K = this->K;
-
+			const auto F = this->F;
+			auto mappedX = Eigen::Map<const Eigen::Matrix<FLOAT, -1, -1>>{ x.data(), (Eigen::Index)K, (Eigen::Index)F };
 			FLOAT fx = - static_cast<const DerivedClass*>(this)->getNegativeLambdaLL(x, g);
-			auto alphas = (x.array().exp() + alphaEps).eval();
+
+			// chunks of columns having about the same number of docs
+			const size_t numCols = groups.numCols(), numDocs = groups.docs.size();
+			// no docs, e.g. of an empty corpus, leave only the prior
+			if (!numCols) return -fx;
+			const size_t numChunks = std::min(numCols, pool.getNumWorkers() * 8);
+			std::vector<size_t> colBounds;
+			for (size_t c = 0; c <= numChunks; ++c)
+			{
+				colBounds.emplace_back(std::lower_bound(groups.offsets.begin(), groups.offsets.end() - 1, numDocs * c / numChunks) - groups.offsets.begin());
+			}
+			colBounds.back() = numCols;
 
 			std::vector<std::future<Eigen::Matrix<FLOAT, -1, 1>>> res;
-			const size_t chStride = pool.getNumWorkers() * 8;
-			for (size_t ch = 0; ch < chStride; ++ch)
+			for (size_t ch = 0; ch < numChunks; ++ch)
 			{
-				res.emplace_back(pool.enqueue([&](size_t threadId)
+				if (colBounds[ch] == colBounds[ch + 1]) continue;
+				res.emplace_back(pool.enqueue([&, ch](size_t threadId)
 				{
-					auto& tmpK = localData[threadId].tmpK;
-					if (!tmpK.size()) tmpK.resize(this->K);
-					Eigen::Matrix<FLOAT, -1, 1> val = Eigen::Matrix<FLOAT, -1, 1>::Zero(K * F + 1);
-					for (size_t docId = ch; docId < this->docs.size(); docId += chStride)
+					Eigen::Matrix<FLOAT, -1, 1> ret = Eigen::Matrix<FLOAT, -1, 1>::Zero(K * F + 1);
+					auto mappedG = Eigen::Map<Eigen::Matrix<FLOAT, -1, -1>>{ ret.data(), (Eigen::Index)K, (Eigen::Index)F };
+					Eigen::Matrix<FLOAT, -1, -1> alphas, coefs;
+					Eigen::Array<FLOAT, -1, 1> digammaAlpha{ K };
+					std::vector<FLOAT> alphaOfPairs, digammaOfPairs;
+					for (size_t u0 = colBounds[ch]; u0 < colBounds[ch + 1]; u0 += lambdaObjBlock)
 					{
-						const auto& doc = this->docs[docId];
-						auto alphaDoc = alphas.segment(doc.metadata * K, K);
-						FLOAT alphaSum = alphaDoc.sum();
-						for (TID k = 0; k < K; ++k)
-						{
-							val[K * F] -= math::lgammaT(alphaDoc[k]) - math::lgammaT(doc.numByTopic[k] + alphaDoc[k]);
-							if (!std::isfinite(alphaDoc[k]) && alphaDoc[k] > 0) tmpK[k] = 0;
-							else tmpK[k] = -(math::digammaT(alphaDoc[k]) - math::digammaT(doc.numByTopic[k] + alphaDoc[k]));
-						}
-						//val[K * F] = -(lgammaApprox(alphaDoc.array()) - lgammaApprox(doc.numByTopic.array().cast<FLOAT>() + alphaDoc.array())).sum();
-						//tmpK = -(digammaApprox(alphaDoc.array()) - digammaApprox(doc.numByTopic.array().cast<FLOAT>() + alphaDoc.array()));
-						val[K * F] += math::lgammaT(alphaSum) - math::lgammaT(doc.getSumWordWeight() + alphaSum);
-						FLOAT t = math::digammaT(alphaSum) - math::digammaT(doc.getSumWordWeight() + alphaSum);
-						if (!std::isfinite(alphaSum) && alphaSum > 0)
+						const size_t num = std::min(lambdaObjBlock, colBounds[ch + 1] - u0);
+						static_cast<const DerivedClass*>(this)->getLambdaObjAlphas(mappedX, groups, u0, num, alphas);
+						coefs = Eigen::Matrix<FLOAT, -1, -1>::Zero(K, num);
+						for (size_t j = 0; j < num; ++j)
 						{
-							val[K * F] = -INFINITY;
-							t = 0;
+							auto alphaDoc = alphas.col(j);
+							const FLOAT alphaSum = alphaDoc.sum();
+							// pairs of (doc, topic) of all docs of the column are contiguous, so that the kernels take them at once
+							const size_t firstDoc = groups.offsets[u0 + j], numColDocs = groups.offsets[u0 + j + 1] - firstDoc;
+							const size_t firstPair = groups.topicOffsets[firstDoc], numPairs = groups.topicOffsets[firstDoc + numColDocs] - firstPair;
+							const FLOAT* counts = &groups.counts[firstPair];
+							alphaOfPairs.resize(numPairs);
+							digammaOfPairs.resize(numPairs);
+							for (size_t p = 0; p < numPairs; ++p) alphaOfPairs[p] = alphaDoc[groups.topics[firstPair + p]];
+
+							ret[K * F] += math::lgammaSubtSum(alphaOfPairs.data(), counts, numPairs);
+							for (size_t p = 0; p < numPairs; ++p) alphaOfPairs[p] += counts[p];
+							math::digammaEach(alphaOfPairs.data(), digammaOfPairs.data(), numPairs);
+							math::digammaEach(alphaDoc.data(), digammaAlpha.data(), K);
+							for (size_t p = 0; p < numPairs; ++p)
+							{
+								const TID k = groups.topics[firstPair + p];
+								if (std::isfinite(alphaDoc[k]) || !(alphaDoc[k] > 0))
+								{
+									coefs(k, j) += digammaAlpha[k] - digammaOfPairs[p];
+								}
+							}
+
+							// the term of alphaSum is the same for all topics, so it is subtracted from coefs once per column
+							FLOAT sumT = 0;
+							if (!std::isfinite(alphaSum) && alphaSum > 0)
+							{
+								ret[K * F] = -INFINITY;
+							}
+							else
+							{
+								ret[K * F] -= math::lgammaSubtSum(alphaSum, &groups.sums[firstDoc], numColDocs);
+								sumT = numColDocs * (FLOAT)math::digammaApprox(alphaSum) - math::digammaSum(&groups.sums[firstDoc], alphaSum, numColDocs);
+							}
+							coefs.col(j).array() -= sumT;
+							coefs.col(j).array() *= alphaDoc.array();
 						}
-						val.segment(doc.metadata * K, K).array() -= alphaDoc.array() * (tmpK.array() + t);
+						static_cast<const DerivedClass*>(this)->addLambdaObjGrad(mappedG, groups, u0, num, coefs);
 					}
-					return val;
+					return ret;
 				}));
 			}
 			for (auto& r : res)
@@ -108,67 +250,248 @@ namespace tomoto
 			return -fx;
 		}
 
-		void initParameters()
+		void updateExpLambda()
+		{
+			expLambda = lambda.array().exp() + alphaEps;
+		}
+
+		// draws a random starting point of L-BFGS into out
+		void initParameters(Eigen::Matrix<FLOAT, -1, -1>& out, RandGen& rg) const
 		{
 			auto dist = std::normal_distribution<FLOAT>(log(this->alpha), sigma);
+			out.resize(this->K, F);
 			for (size_t i = 0; i < this->K; ++i) for (size_t j = 0; j < F; ++j)
 			{
-				lambda(i, j) = dist(this->rg);
+				out(i, j) = dist(rg);
 			}
 		}
 
-		void optimizeParameters(ThreadPool& pool, _ModelState* localData, RandGen* rgs)
+		// runs L-BFGS from point on docs grouped by groups, leaving the optimum in point and the objective at it in fx
+		void minimizeLambdaObj(ThreadPool& pool, const LambdaObjGroups& groups, Eigen::Matrix<FLOAT, -1, -1>& point, FLOAT& fx) const
 		{
-			Eigen::Matrix<FLOAT, -1, -1> bLambda;
-			FLOAT fx = 0, bestFx = INFINITY;
-			for (size_t i = 0; i < optimRepeat; ++i)
+			auto localSolver = solver;
+			localSolver.minimize([this, &pool, &groups](Eigen::Ref<Eigen::Matrix<FLOAT, -1, 1>> x, Eigen::Matrix<FLOAT, -1, 1>& g)
 			{
-				static_cast<DerivedClass*>(this)->initParameters();
-				int ret = solver.minimize([this, &pool, localData](Eigen::Ref<Eigen::Matrix<FLOAT, -1, 1>> x, Eigen::Matrix<FLOAT, -1, 1>& g)
+				return static_cast<const DerivedClass*>(this)->evaluateLambdaObj(x, g, pool, groups);
+			}, Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>(point.data(), point.size()), fx);
+		}
+
+		// the number of restarts which can be run at once, each on its own pool
+		size_t getNumConcurrentRestarts(ThreadPool& pool) const
+		{
+			return std::max(std::min(optimRepeat, pool.getNumWorkers()), (size_t)1);
+		}
+
+		// numGroups pools splitting numWorkers workers, kept between optimizings since at most one optimizer runs at a time
+		std::vector<std::unique_ptr<ThreadPool>>& getRestartPools(size_t numWorkers, size_t numGroups)
+		{
+			size_t total = 0;
+			for (auto& p : restartPools) total += p->getNumWorkers();
+			if (restartPools.size() != numGroups || total != numWorkers)
+			{
+				restartPools.clear();
+				for (size_t gr = 0; gr < numGroups; ++gr)
 				{
-					return static_cast<DerivedClass*>(this)->evaluateLambdaObj(x, g, pool, localData);
-				}, Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>(lambda.data(), lambda.size()), fx);
+					restartPools.emplace_back(make_unique<ThreadPool>(numWorkers / numGroups + (gr < numWorkers % numGroups ? 1 : 0)));
+				}
+			}
+			return restartPools;
+		}
+
+		/*
+		with optimWarmStart, L-BFGS starts from the current lambda first, and random restarts are tried
+		only when it fails, or ends worse than the current lambda, which is the last optimum, re-evaluated on the current counts.
+		the objective kept from the last optimizing isn't compared, since it was evaluated on the counts of its time.
+		restarts are run concurrently, splitting the workers of pool into groups.
+		*/
+		ParameterOptimizer prepareOptimizer(ThreadPool& pool, _ModelState* localData, RandGen* rgs)
+		{
+			if (lambdaOptimizer == LambdaOptimizer::adam) return static_cast<DerivedClass*>(this)->prepareAdamOptimizer();
 
-				if (fx < bestFx)
+			auto groups = std::make_shared<LambdaObjGroups>(static_cast<const DerivedClass*>(this)->makeLambdaObjGroups(this->docs.begin(), this->docs.end()));
+			const bool warmStart = optimWarmStart && std::isfinite(lastLambdaFx);
+			Eigen::Matrix<FLOAT, -1, -1> startLambda = lambda;
+			RandGen startRg{ this->rg() };
+			return [this, groups, warmStart, startLambda, startRg](ThreadPool& pool) mutable -> ParameterApplier
+			{
+				Eigen::Matrix<FLOAT, -1, -1> bLambda;
+				FLOAT bestFx = INFINITY, startFx = INFINITY;
+				if (warmStart)
 				{
-					bLambda = lambda;
-					bestFx = fx;
-					//printf("\t(%d) %e\n", ret, fx);
+					bLambda = startLambda;
+					Eigen::Matrix<FLOAT, -1, 1> x = Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>(bLambda.data(), bLambda.size()), g(bLambda.size());
+					startFx = static_cast<const DerivedClass*>(this)->evaluateLambdaObj(x, g, pool, *groups);
+					minimizeLambdaObj(pool, *groups, bLambda, bestFx);
 				}
+
+				if (!std::isfinite(bestFx) || bestFx > startFx)
+				{
+					// starting points are drawn in order, so that they don't depend on the number of groups
+					std::vector<Eigen::Matrix<FLOAT, -1, -1>> starts(optimRepeat);
+					for (auto& st : starts) static_cast<const DerivedClass*>(this)->initParameters(st, startRg);
+					std::vector<FLOAT> fxs(optimRepeat, INFINITY);
+					const size_t numGroups = static_cast<const DerivedClass*>(this)->getNumConcurrentRestarts(pool);
+					if (numGroups <= 1)
+					{
+						for (size_t i = 0; i < optimRepeat; ++i) minimizeLambdaObj(pool, *groups, starts[i], fxs[i]);
+					}
+					else
+					{
+						auto& groupPools = getRestartPools(pool.getNumWorkers(), numGroups);
+						std::vector<std::future<void>> res;
+						for (size_t gr = 0; gr < numGroups; ++gr)
+						{
+							res.emplace_back(pool.enqueue([&, gr](size_t threadId)
+							{
+								for (size_t i = gr; i < optimRepeat; i += numGroups) minimizeLambdaObj(*groupPools[gr], *groups, starts[i], fxs[i]);
+							}));
+						}
+						for (auto& r : res) r.get();
+					}
+
+					for (size_t i = 0; i < optimRepeat; ++i)
+					{
+						if (fxs[i] < bestFx)
+						{
+							bLambda = std::move(starts[i]);
+							bestFx = fxs[i];
+						}
+					}
+				}
+
+				if (!std::isfinite(bestFx))
+				{
+					throw exception::TrainingError{ "optimizing parameters has been failed!" };
+				}
+				return [this, bLambda, bestFx]()
+				{
+					lambda = bLambda;
+					lastLambdaFx = bestFx;
+					static_cast<DerivedClass*>(this)->updateExpLambda();
+				};
+			};
+		}
+
+		void resetAdamState()
+		{
+			adamM = Eigen::Matrix<FLOAT, -1, -1>::Zero(this->K, F);
+			adamV = Eigen::Matrix<FLOAT, -1, -1>::Zero(this->K, F);
+			adamIterated = adamSteps = 0;
+		}
+
+		/*
+		optimSteps steps of Adam on the objective per doc, whose gradient is estimated from batches of optimBatchSize docs
+		drawn uniformly with replacement. the prior is shared by all docs, as in updatePriorOnline().
+		batches are drawn and grouped while preparing, so that optimizing doesn't touch the docs.
+		*/
+		ParameterOptimizer prepareAdamOptimizer()
+		{
+			if (this->docs.empty()) return [](ThreadPool&) { return ParameterApplier{ []() {} }; };
+			if ((size_t)adamM.cols() != F) static_cast<DerivedClass*>(this)->resetAdamState();
+			++adamIterated;
+			const FLOAT lr = optimLearningRate * std::pow((FLOAT)adamIterated, -optimDecay);
+			const size_t batchSize = std::max(optimBatchSize, (size_t)1);
+			const FLOAT numDocs = this->docs.size();
+			auto batches = std::make_shared<std::vector<LambdaObjGroups>>();
+			std::vector<size_t> batch(batchSize);
+			auto tx = [this](size_t i)->const _DocType& { return this->docs[i]; };
+			std::uniform_int_distribution<size_t> dist{ 0, this->docs.size() - 1 };
+			for (size_t s = 0; s < optimSteps; ++s)
+			{
+				for (auto& i : batch) i = dist(this->rg);
+				// sorted for the locality of docs
+				std::sort(batch.begin(), batch.end());
+				batches->emplace_back(static_cast<const DerivedClass*>(this)->makeLambdaObjGroups(
+					makeTransformIter(batch.begin(), tx), makeTransformIter(batch.end(), tx)));
 			}
-			if (!std::isfinite(bestFx))
+
+			Eigen::Matrix<FLOAT, -1, -1> newLambda = lambda, m = adamM, v = adamV;
+			size_t steps = adamSteps;
+			return [this, batches, lr, batchSize, numDocs, newLambda, m, v, steps](ThreadPool& pool) mutable -> ParameterApplier
 			{
-				throw exception::TrainingError{ "optimizing parameters has been failed!" };
+				static constexpr FLOAT beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8;
+				auto mappedLambda = Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>(newLambda.data(), newLambda.size());
+				auto mappedM = Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>(m.data(), m.size());
+				auto mappedV = Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>(v.data(), v.size());
+				Eigen::Matrix<FLOAT, -1, 1> x, g(newLambda.size()), gPrior(newLambda.size());
+				for (auto& groups : *batches)
+				{
+					x = mappedLambda;
+					if (!std::isfinite(static_cast<const DerivedClass*>(this)->evaluateLambdaObjOfDocs(x, g, pool, nullptr, groups))) continue;
+					static_cast<const DerivedClass*>(this)->getNegativeLambdaLL(x, gPrior);
+					g = gPrior / numDocs + (g - gPrior) / batchSize;
+					++steps;
+					mappedM = beta1 * mappedM + (1 - beta1) * g;
+					mappedV = beta2 * mappedV + (1 - beta2) * g.cwiseAbs2();
+					const FLOAT corr1 = 1 - std::pow(beta1, (FLOAT)steps), corr2 = 1 - std::pow(beta2, (FLOAT)steps);
+					mappedLambda = (x.array() - lr * (mappedM.array() / corr1) / ((mappedV.array() / corr2).sqrt() + epsilon)).min(maxLambda);
+				}
+				if (!mappedLambda.allFinite())
+				{
+					throw exception::TrainingError{ "optimizing parameters has been failed!" };
+				}
+				return [this, newLambda, m, v, steps]()
+				{
+					lambda = newLambda;
+					adamM = m;
+					adamV = v;
+					adamSteps = steps;
+					// the objective depends on the counts, which move between optimizings, so it isn't comparable for warm starts
+					lastLambdaFx = INFINITY;
+					static_cast<DerivedClass*>(this)->updateExpLambda();
+				};
+			};
+		}
+
+		/*
+		a step of stochastic gradient descent on the objective per doc, whose gradient is estimated from the docs of a batch.
+		the prior is shared by numDocs docs.
+		*/
+		template<typename _DocIter>
+		void updatePriorOnline(ThreadPool& pool, _ModelState* localData, _DocIter first, _DocIter last, FLOAT rho, FLOAT numDocs)
+		{
+			Eigen::Matrix<FLOAT, -1, 1> x = Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>(lambda.data(), lambda.size()), g, gPrior;
+			g.resize(x.size());
+			gPrior.resize(x.size());
+			const auto groups = static_cast<const DerivedClass*>(this)->makeLambdaObjGroups(first, last);
+			if (!std::isfinite(static_cast<DerivedClass*>(this)->evaluateLambdaObjOfDocs(x, g, pool, localData, groups))) return;
+			static_cast<DerivedClass*>(this)->getNegativeLambdaLL(x, gPrior);
+			x -= rho * (gPrior / numDocs + (g - gPrior) / std::distance(first, last));
+			Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>(lambda.data(), lambda.size()) = x.cwiseMin(maxLambda);
+			static_cast<DerivedClass*>(this)->updateExpLambda();
+		}
+
+		// metadata first seen in the new docs get lambda of the default alpha, as they do in initGlobalState()
+		void extendParameters(size_t firstDoc)
+		{
+			const size_t oldF = F;
+			F = metadataDict.size();
+			if (F == oldF) return;
+			lastLambdaFx = INFINITY;
+			lambda.conservativeResizeLike(Eigen::Matrix<FLOAT, -1, -1>::Constant(this->K, F, log(this->alpha)));
+			if (adamM.size())
+			{
+				adamM.conservativeResizeLike(Eigen::Matrix<FLOAT, -1, -1>::Zero(this->K, F));
+				adamV.conservativeResizeLike(Eigen::Matrix<FLOAT, -1, -1>::Zero(this->K, F));
 			}
-			lambda = bLambda;
-			//std::cerr << fx << std::endl;
-			expLambda = lambda.array().exp() + alphaEps;
+			static_cast<DerivedClass*>(this)->updateExpLambda();
 		}
 
 		int restoreFromTrainingError(const exception::TrainingError& e, ThreadPool& pool, _ModelState* localData, RandGen* rgs)
 		{
 			std::cerr << "Failed to optimize! Reset prior and retry!" << std::endl;
 			lambda.setZero();
-			expLambda = lambda.array().exp() + alphaEps;
+			lastLambdaFx = INFINITY;
+			static_cast<DerivedClass*>(this)->resetAdamState();
+			static_cast<DerivedClass*>(this)->updateExpLambda();
 			return 0;
 		}
 
-		template<bool _asymEta>
-		FLOAT* getZLikelihoods(_ModelState& ld, const _DocType& doc, size_t docId, size_t vid) const
+		const FLOAT* getAlphasOfDoc(const _ModelState& ld, const _DocType& doc) const
 		{
-			const size_t V = this->realV;
-			assert(vid < V);
-			auto etaHelper = this->template getEtaHelper<_asymEta>();
-			auto& zLikelihood = ld.zLikelihood;
-			zLikelihood = (doc.numByTopic.array().template cast<FLOAT>() + this->expLambda.col(doc.metadata).array())
-				* (ld.numByTopicWord.col(vid).array().template cast<FLOAT>() + etaHelper.getEta(vid))
-				/ (ld.numByTopic.array().template cast<FLOAT>() + etaHelper.getEtaSum());
-
-			sample::prefixSum(zLikelihood.data(), this->K);
-			return &zLikelihood[0];
+			return expLambda.col(doc.metadata).data();
 		}
 
-		
 		double getLLDocTopic(const _DocType& doc) const
 		{
 			const size_t V = this->realV;
@@ -191,57 +514,42 @@ namespace tomoto
 		template<typename _DocIter>
 		double getLLDocs(_DocIter _first, _DocIter _last) const
 		{
-			const auto K = this->K;
-
-			double ll = 0;
-			for (; _first != _last; ++_first)
+			return this->sumInChunks(std::distance(_first, _last), [&](size_t b, size_t e)
 			{
-				auto& doc = *_first;
-				auto alphaDoc = expLambda.col(doc.metadata);
-				FLOAT alphaSum = alphaDoc.sum();
-
-				for (TID k = 0; k < K; ++k)
+				double ll = 0;
+				for (size_t i = b; i < e; ++i)
 				{
-					ll += math::lgammaT(doc.numByTopic[k] + alphaDoc[k]) - math::lgammaT(alphaDoc[k]);
+					auto& doc = _first[i];
+					auto alphaDoc = expLambda.col(doc.metadata);
+					FLOAT alphaSum = alphaDoc.sum();
+
+					ll += math::lgammaSubtSum(alphaDoc.data(), doc.numByTopic.data(), this->K);
+					ll -= math::lgammaT(doc.getSumWordWeight() + alphaSum) - math::lgammaT(alphaSum);
 				}
-				ll -= math::lgammaT(doc.getSumWordWeight() + alphaSum) - math::lgammaT(alphaSum);
-			}
-			return ll;
+				return ll;
+			});
 		}
 
 		double getLLRest(const _ModelState& ld) const
 		{
-			const auto K = this->K;
 			const auto alpha = this->alpha;
-			const auto eta = this->eta;
-			const size_t V = this->realV;
 
 			double ll = -(lambda.array() - log(alpha)).pow(2).sum() / 2 / pow(sigma, 2);
 			// topic-word distribution
-			auto lgammaEta = math::lgammaT(eta);
-			ll += math::lgammaT(V*eta) * K;
-			for (TID k = 0; k < K; ++k)
-			{
-				ll -= math::lgammaT(ld.numByTopic[k] + V * eta);
-				for (VID v = 0; v < V; ++v)
-				{
-					if (!ld.numByTopicWord(k, v)) continue;
-					ll += math::lgammaT(ld.numByTopicWord(k, v) + eta) - lgammaEta;
-				}
-			}
+			ll += this->getLLTopicWord(ld);
 			return ll;
 		}
 
 		void initGlobalState(bool initDocs)
 		{
 			BaseClass::initGlobalState(initDocs);
-			this->globalState.tmpK = Eigen::Matrix<FLOAT, -1, 1>::Zero(this->K);
 			F = metadataDict.size();
 			if (initDocs)
 			{
 				lambda = Eigen::Matrix<FLOAT, -1, -1>::Constant(this->K, F, log(this->alpha));
 			}
 			if (_Flags & flags::continuous_doc_data) this->numByTopicDoc = Eigen::Matrix<WeightType, -1, -1>::Zero(this->K, this->docs.size());
+			// alphaEps is added from the first optimizing on, as it always has been
 			expLambda = lambda.array().exp();
 			LBFGSpp::LBFGSParam<FLOAT> param;
 			param.max_iterations = maxBFGSIteration;
@@ -250,6 +558,45 @@ namespace tomoto
 
 		DEFINE_SERIALIZER_AFTER_BASE(BaseClass, sigma, alphaEps, metadataDict, lambda);
 
+		void writeCorpusMetadata(std::ostream& writer) const
+		{
+			std::vector<uint32_t> metadata;
+			for (auto& doc : this->docs) metadata.emplace_back(doc.metadata);
+			serializer::writeMany(writer, metadataDict, metadata);
+		}
+
+		static void checkCorpusMetadata(const std::vector<uint32_t>& metadata, size_t numDocs, size_t numMetadata)
+		{
+			if (metadata.size() != numDocs) throw serializer::UnfitException("metadata of the corpus don't match its docs");
+			for (auto x : metadata)
+			{
+				if (x >= numMetadata) throw serializer::UnfitException("metadata id of the corpus is out of its dictionary");
+			}
+		}
+
+		void readCorpusMetadata(std::istream& reader, std::vector<_DocType>& corpusDocs)
+		{
+			std::vector<uint32_t> metadata;
+			serializer::readMany(reader, metadataDict, metadata);
+			checkCorpusMetadata(metadata, corpusDocs.size(), metadataDict.size());
+			for (size_t i = 0; i < corpusDocs.size(); ++i) corpusDocs[i].metadata = metadata[i];
+		}
+
+		void readCorpusMetadataWithinModel(std::istream& reader, std::vector<_DocType>& corpusDocs) const
+		{
+			Dictionary corpusDict;
+			std::vector<uint32_t> metadata;
+			serializer::readMany(reader, corpusDict, metadata);
+			checkCorpusMetadata(metadata, corpusDocs.size(), corpusDict.size());
+			std::vector<VID> xids(corpusDict.size());
+			for (size_t x = 0; x < xids.size(); ++x) xids[x] = metadataDict.toWid(corpusDict.toWordView(x));
+			for (size_t i = 0; i < corpusDocs.size(); ++i)
+			{
+				if (xids[metadata[i]] == (VID)-1) throw std::invalid_argument("unknown metadata");
+				corpusDocs[i].metadata = xids[metadata[i]];
+			}
+		}
+
 	public:
 		DMRModel(size_t _K = 1, FLOAT defaultAlpha = 1.0, FLOAT _sigma = 1.0, FLOAT _eta = 0.01, 
 			FLOAT _alphaEps = 0, const RandGen& _rg = RandGen{ std::random_device{}() })
@@ -258,6 +605,12 @@ namespace tomoto
 			if (_sigma <= 0) THROW_ERROR_WITH_INFO(std::runtime_error, text::format("wrong sigma value (sigma = %f)", _sigma));
 		}
 
+		~DMRModel()
+		{
+			// an optimizer left running reads the members of this class, which are destroyed before those of its bases
+			this->discardPendingOptimizer();
+		}
+
 		size_t addDoc(const std::vector<std::string>& words, const std::vector<std::string>& metadata) override
 		{
 			std::string metadataJoined = text::join(metadata.begin(), metadata.end(), "_");
@@ -267,6 +620,15 @@ namespace tomoto
 			return this->_addDoc(doc);
 		}
 
+		size_t addDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) override
+		{
+			std::string metadataJoined = text::join(metadata.begin(), metadata.end(), "_");
+			VID xid = metadataDict.add(metadataJoined);
+			auto doc = this->_makeDoc(words);
+			doc.metadata = xid;
+			return this->_addDoc(doc);
+		}
+
 		std::unique_ptr<DocumentBase> makeDoc(const std::vector<std::string>& words, const std::vector<std::string>& metadata) const override
 		{
 			std::string metadataJoined = text::join(metadata.begin(), metadata.end(), "_");
@@ -277,10 +639,32 @@ namespace tomoto
 			return make_unique<_DocType>(doc);
 		}
 
+		std::unique_ptr<DocumentBase> makeDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) const override
+		{
+			std::string metadataJoined = text::join(metadata.begin(), metadata.end(), "_");
+			VID xid = metadataDict.toWid(metadataJoined);
+			if (xid == (VID)-1) throw std::invalid_argument("unknown metadata");
+			auto doc = this->_makeDocWithinVocab(words);
+			doc.metadata = xid;
+			return make_unique<_DocType>(doc);
+		}
+
+		void scanDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) override
+		{
+			this->_scanDoc(words);
+			metadataDict.add(text::join(metadata.begin(), metadata.end(), "_"));
+		}
+
 		GETTER(F, size_t, F);
 		GETTER(Sigma, FLOAT, sigma);
 		GETTER(AlphaEps, FLOAT, alphaEps);
 		GETTER(OptimRepeat, size_t, optimRepeat);
+		GETTER(OptimWarmStart, bool, optimWarmStart);
+		GETTER(LambdaOptimizer, LambdaOptimizer, lambdaOptimizer);
+		GETTER(OptimBatchSize, size_t, optimBatchSize);
+		GETTER(OptimSteps, size_t, optimSteps);
+		GETTER(OptimLearningRate, FLOAT, optimLearningRate);
+		GETTER(OptimDecay, FLOAT, optimDecay);
 
 		void setAlphaEps(FLOAT _alphaEps) override
 		{
@@ -292,6 +676,28 @@ namespace tomoto
 			optimRepeat = _optimRepeat;
 		}
 
+		void setOptimWarmStart(bool _optimWarmStart) override
+		{
+			optimWarmStart = _optimWarmStart;
+		}
+
+		void setLambdaOptimizer(LambdaOptimizer _lambdaOptimizer) override
+		{
+			lambdaOptimizer = _lambdaOptimizer;
+		}
+
+		void setOptimBatch(size_t _optimBatchSize, size_t _optimSteps) override
+		{
+			optimBatchSize = _optimBatchSize;
+			optimSteps = _optimSteps;
+		}
+
+		void setOptimLearningRate(FLOAT _optimLearningRate, FLOAT _optimDecay) override
+		{
+			optimLearningRate = _optimLearningRate;
+			optimDecay = _optimDecay;
+		}
+
 		std::vector<FLOAT> getTopicsByDoc(const _DocType& doc) const
 		{
 			std::vector<FLOAT> ret(this->K);
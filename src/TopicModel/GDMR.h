@@ -18,7 +18,7 @@ namespace tomoto
 		using DefaultDocType = DocumentDMR<TermWeight::one>;
 		static IGDMRModel* create(TermWeight _weight, size_t _K = 1, const std::vector<size_t>& _degreeByF = {},
 			FLOAT defaultAlpha = 1.0, FLOAT _sigma = 1.0, FLOAT _eta = 0.01, FLOAT _alphaEps = 1e-10,
-			const RandGen& _rg = RandGen{ std::random_device{}() });
+			const RandGen& _rg = RandGen{ std::random_device{}() }, bool sparseTopicWord = false);
 
 		virtual FLOAT getSigma0() const = 0;
 		virtual void setSigma0(FLOAT) = 0;
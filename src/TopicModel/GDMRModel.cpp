@@ -5,9 +5,11 @@ namespace tomoto
 	template class GDMRModel<TermWeight::one>;
 	template class GDMRModel<TermWeight::idf>;
 	template class GDMRModel<TermWeight::pmi>;
+	template class GDMRModel<TermWeight::one, flags::partitioned_multisampling | flags::sparse_topic_word>;
 
-    IGDMRModel* IGDMRModel::create(TermWeight _weight, size_t _K, const std::vector<size_t>& degreeByF, FLOAT _defaultAlpha, FLOAT _sigma, FLOAT _eta, FLOAT _alphaEps, const RandGen& _rg)
+    IGDMRModel* IGDMRModel::create(TermWeight _weight, size_t _K, const std::vector<size_t>& degreeByF, FLOAT _defaultAlpha, FLOAT _sigma, FLOAT _eta, FLOAT _alphaEps, const RandGen& _rg, bool sparseTopicWord)
 	{
+		if (sparseTopicWord) SWITCH_TW_FLAGS(_weight, flags::partitioned_multisampling | flags::sparse_topic_word, GDMRModel, _K, degreeByF, _defaultAlpha, _sigma, _eta, _alphaEps, _rg);
 		SWITCH_TW(_weight, GDMRModel, _K, degreeByF, _defaultAlpha, _sigma, _eta, _alphaEps, _rg);
 	}
 }
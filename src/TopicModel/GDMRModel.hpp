@@ -1,15 +1,16 @@
 #pragma once
+#include <map>
 #include "DMRModel.hpp"
 #include "../Utils/slp.hpp"
 #include "GDMR.h"
 
 namespace tomoto
 {
-	template<TermWeight _TW>
-	struct ModelStateGDMR : public ModelStateDMR<_TW>
+	template<TermWeight _TW, bool _sparseTopicWord = false>
+	struct ModelStateGDMR : public ModelStateDMR<_TW, _sparseTopicWord>
 	{
-		/*Eigen::Matrix<FLOAT, -1, 1> alphas;
-		Eigen::Matrix<FLOAT, -1, 1> terms;
+		Eigen::Matrix<FLOAT, -1, 1> alphas; // alpha of the document being sampled whose metadata is not cached
+		/*Eigen::Matrix<FLOAT, -1, 1> terms;
 		std::vector<std::vector<FLOAT>> slpCache;
 		std::vector<size_t> ndimCnt;*/
 	};
@@ -18,13 +19,13 @@ namespace tomoto
 		typename _Interface = IGDMRModel,
 		typename _Derived = void,
 		typename _DocType = DocumentGDMR<_TW, _Flags>,
-		typename _ModelState = ModelStateGDMR<_TW>>
+		typename _ModelState = ModelStateGDMR<_TW, !!(_Flags & flags::sparse_topic_word)>>
 	class GDMRModel : public DMRModel<_TW, _Flags, _Interface,
-		typename std::conditional<std::is_same<_Derived, void>::value, GDMRModel<_TW>, _Derived>::type,
+		typename std::conditional<std::is_same<_Derived, void>::value, GDMRModel<_TW, _Flags>, _Derived>::type,
 		_DocType, _ModelState>
 	{
 	protected:
-		using DerivedClass = typename std::conditional<std::is_same<_Derived, void>::value, GDMRModel<_TW>, _Derived>::type;
+		using DerivedClass = typename std::conditional<std::is_same<_Derived, void>::value, GDMRModel<_TW, _Flags>, _Derived>::type;
 		using BaseClass = DMRModel<_TW, _Flags, _Interface, DerivedClass, _DocType, _ModelState>;
 		friend BaseClass;
 		friend typename BaseClass::BaseClass;
@@ -35,6 +36,14 @@ namespace tomoto
 		std::vector<FLOAT> mdCoefs, mdIntercepts;
 		std::vector<size_t> degreeByF;
 
+		/*
+		alphas are cached per unique metadata as columns of expLambda (K, numUniqueMd),
+		so doc.metadata is the index of the document's metadata in mdIdMap.
+		Documents whose metadata is unseen at prepare() have doc.metadata == -1.
+		*/
+		std::map<std::vector<FLOAT>, size_t> mdIdMap;
+		Eigen::Matrix<FLOAT, -1, -1> termsByMd; // (F, numUniqueMd)
+
 		FLOAT getIntegratedLambdaSq(const Eigen::Ref<const Eigen::Matrix<FLOAT, -1, 1>, 0, Eigen::InnerStride<>>& lambdas) const
 		{
 			FLOAT ret = pow(lambdas[0] - log(this->alpha), 2) / 2 / pow(this->sigma0, 2);
@@ -55,19 +64,20 @@ namespace tomoto
 			}
 		}
 
-		void initParameters()
+		void initParameters(Eigen::Matrix<FLOAT, -1, -1>& out, RandGen& rg) const
 		{
 			auto dist0 = std::normal_distribution<FLOAT>(log(this->alpha), sigma0);
 			auto dist = std::normal_distribution<FLOAT>(0, this->sigma);
+			out.resize(this->K, this->F);
 			for (size_t i = 0; i < this->K; ++i) for (size_t j = 0; j < this->F; ++j)
 			{
 				if (j == 0)
 				{
-					this->lambda(i, j) = dist0(this->rg);
+					out(i, j) = dist0(rg);
 				}
 				else
 				{
-					this->lambda(i, j) = dist(this->rg);
+					out(i, j) = dist(rg);
 				}
 			}
 		}
@@ -86,64 +96,42 @@ namespace tomoto
 			return fx;
 		}
 
-		FLOAT evaluateLambdaObj(Eigen::Ref<Eigen::Matrix<FLOAT, -1, 1>> x, Eigen::Matrix<FLOAT, -1, 1>& g, ThreadPool& pool, _ModelState* localData) const
+		// docs with metadata out of mdIdMap get columns keyed after those of termsByMd, one per unique metadata
+		template<typename _DocIter>
+		void getLambdaObjKeys(_DocIter first, _DocIter last, std::vector<size_t>& keys) const
 		{
-			// if one of x is greater than maxLambda, return +inf for preventing search more
-			if ((x.array() > this->maxLambda).any()) return INFINITY;
-
-			const auto K = this->K;
-			const auto F = this->F;
-
-			auto mappedX = Eigen::Map<Eigen::Matrix<FLOAT, -1, -1>>(x.data(), K, F);
-			FLOAT fx = -static_cast<const DerivedClass*>(this)->getNegativeLambdaLL(x, g);
-
-			std::vector<std::future<Eigen::Matrix<FLOAT, -1, 1>>> res;
-			const size_t chStride = pool.getNumWorkers() * 8;
-			for (size_t ch = 0; ch < chStride; ++ch)
+			std::map<std::vector<FLOAT>, size_t> extraKeys;
+			keys.clear();
+			for (auto it = first; it != last; ++it)
 			{
-				res.emplace_back(pool.enqueue([&, this](size_t threadId)
-				{
-					auto& ld = localData[threadId];
-					thread_local Eigen::Matrix<FLOAT, -1, 1> alphas{ K }, tmpK{ K }, terms{ F };
-					Eigen::Matrix<FLOAT, -1, 1> ret = Eigen::Matrix<FLOAT, -1, 1>::Zero(F * K + 1);
-					for (size_t docId = ch; docId < this->docs.size(); docId += chStride)
-					{
-						const auto& doc = this->docs[docId];
-						const auto& vx = doc.metadataC;
-						getTermsFromMd(&vx[0], terms.data());
-						for (TID k = 0; k < K; ++k)
-						{
-							alphas[k] = exp(mappedX.row(k) * terms) + this->alphaEps;
-							ret[K * F] -= math::lgammaT(alphas[k]) - math::lgammaT(doc.numByTopic[k] + alphas[k]);
-							if (!std::isfinite(alphas[k]) && alphas[k] > 0) tmpK[k] = 0;
-							else tmpK[k] = -(math::digammaT(alphas[k]) - math::digammaT(doc.numByTopic[k] + alphas[k]));
-						}
-						FLOAT alphaSum = alphas.sum();
-						ret[K * F] += math::lgammaT(alphaSum) - math::lgammaT(doc.getSumWordWeight() + alphaSum);
-						FLOAT t = math::digammaT(alphaSum) - math::digammaT(doc.getSumWordWeight() + alphaSum);
-						if (!std::isfinite(alphaSum) && alphaSum > 0)
-						{
-							ret[K * F] = -INFINITY;
-							t = 0;
-						}
-						for (size_t f = 0; f < F; ++f)
-						{
-							ret.segment(f * K, K).array() -= ((tmpK.array() + t) * alphas.array()) * terms[f];
-						}
-					}
-					return ret;
-				}));
+				if ((*it).metadata < (size_t)termsByMd.cols()) keys.emplace_back((*it).metadata);
+				else keys.emplace_back(extraKeys.emplace((*it).metadataC, termsByMd.cols() + (it - first)).first->second);
 			}
-			for (auto& r : res)
+		}
+
+		template<typename _DocIter>
+		void fillLambdaObjTerms(LambdaObjGroups& groups, _DocIter first) const
+		{
+			groups.terms.resize(this->F, groups.numCols());
+			for (size_t u = 0; u < groups.numCols(); ++u)
 			{
-				auto ret = r.get();
-				fx += ret[K * F];
-				g += ret.head(K * F);
+				const size_t key = groups.cols[u];
+				if (key < (size_t)termsByMd.cols()) groups.terms.col(u) = termsByMd.col(key);
+				else getTermsFromMd(&first[key - termsByMd.cols()].metadataC[0], groups.terms.col(u).data());
 			}
+		}
 
-			// positive fx is an error from limited precision of float.
-			if (fx > 0) return INFINITY;
-			return -fx;
+		void getLambdaObjAlphas(const Eigen::Map<const Eigen::Matrix<FLOAT, -1, -1>>& mappedX, const LambdaObjGroups& groups,
+			size_t firstCol, size_t num, Eigen::Matrix<FLOAT, -1, -1>& out) const
+		{
+			out.noalias() = mappedX * groups.terms.middleCols(firstCol, num);
+			out = out.array().exp() + this->alphaEps;
+		}
+
+		void addLambdaObjGrad(Eigen::Map<Eigen::Matrix<FLOAT, -1, -1>>& mappedG, const LambdaObjGroups& groups,
+			size_t firstCol, size_t num, const Eigen::Matrix<FLOAT, -1, -1>& coefs) const
+		{
+			mappedG.noalias() += coefs * groups.terms.middleCols(firstCol, num).transpose();
 		}
 
 		void getTermsFromMd(const FLOAT* vx, FLOAT* out) const
@@ -186,55 +174,66 @@ namespace tomoto
 			}
 		}
 
-		template<bool _asymEta>
-		FLOAT* getZLikelihoods(_ModelState& ld, const _DocType& doc, size_t docId, size_t vid) const
+		void updateExpLambda()
+		{
+			this->expLambda = (this->lambda * termsByMd).array().exp() + this->alphaEps;
+		}
+
+		void getAlphasFromMd(const FLOAT* vx, Eigen::Matrix<FLOAT, -1, 1>& out) const
 		{
-			const size_t V = this->realV;
-			assert(vid < V);
-			auto etaHelper = this->template getEtaHelper<_asymEta>();
-			auto& zLikelihood = ld.zLikelihood;
 			thread_local Eigen::Matrix<FLOAT, -1, 1> terms{ this->F };
-			getTermsFromMd(&doc.metadataC[0], terms.data());
-			zLikelihood = (doc.numByTopic.array().template cast<FLOAT>() + (this->lambda * terms).array().exp() + this->alphaEps)
-				* (ld.numByTopicWord.col(vid).array().template cast<FLOAT>() + etaHelper.getEta(vid))
-				/ (ld.numByTopic.array().template cast<FLOAT>() + etaHelper.getEtaSum());
+			getTermsFromMd(vx, terms.data());
+			out = (this->lambda * terms).array().exp() + this->alphaEps;
+		}
+
+		Eigen::Map<const Eigen::Matrix<FLOAT, -1, 1>> getCachedAlphas(const _DocType& doc, Eigen::Matrix<FLOAT, -1, 1>& buf) const
+		{
+			using MapType = Eigen::Map<const Eigen::Matrix<FLOAT, -1, 1>>;
+			if (doc.metadata < (size_t)this->expLambda.cols()) return MapType{ this->expLambda.col(doc.metadata).data(), this->K };
+			getAlphasFromMd(&doc.metadataC[0], buf);
+			return MapType{ buf.data(), this->K };
+		}
+
+		const FLOAT* getAlphasOfDoc(const _ModelState& ld, const _DocType& doc) const
+		{
+			return doc.metadata < (size_t)this->expLambda.cols() ? this->expLambda.col(doc.metadata).data() : ld.alphas.data();
+		}
+
+		// alphas for uncached metadata are calculated once per document, not per word
+		void prepareAlphasOfDoc(_ModelState& ld, const _DocType& doc) const
+		{
+			if (doc.metadata >= (size_t)this->expLambda.cols()) getAlphasFromMd(&doc.metadataC[0], ld.alphas);
+		}
 
-			sample::prefixSum(zLikelihood.data(), this->K);
-			return &zLikelihood[0];
+		template<ParallelScheme _ps, bool _infer, typename _ExtraDocData>
+		void sampleDocument(_DocType& doc, const _ExtraDocData& edd, size_t docId, _ModelState& ld, RandGen& rgs, size_t iterationCnt, size_t partitionId = 0) const
+		{
+			prepareAlphasOfDoc(ld, doc);
+			BaseClass::template sampleDocument<_ps, _infer>(doc, edd, docId, ld, rgs, iterationCnt, partitionId);
 		}
 
 		template<typename _DocIter>
 		double getLLDocs(_DocIter _first, _DocIter _last) const
 		{
-			const auto K = this->K;
-			double ll = 0;
-
-			Eigen::Matrix<FLOAT, -1, 1> alphas(K);
-			for (; _first != _last; ++_first)
+			return this->sumInChunks(std::distance(_first, _last), [&](size_t b, size_t e)
 			{
-				auto& doc = *_first;
-				thread_local Eigen::Matrix<FLOAT, -1, 1> terms{ this->F };
-				getTermsFromMd(&doc.metadataC[0], terms.data());
-				for (TID k = 0; k < K; ++k)
-				{
-					alphas[k] = exp(this->lambda.row(k) * terms) + this->alphaEps;
-				}
-				FLOAT alphaSum = alphas.sum();
-				for (TID k = 0; k < K; ++k)
+				double ll = 0;
+				Eigen::Matrix<FLOAT, -1, 1> buf;
+				for (size_t i = b; i < e; ++i)
 				{
-					if (!doc.numByTopic[k]) continue;
-					ll += math::lgammaT(doc.numByTopic[k] + alphas[k]) - math::lgammaT(alphas[k]);
+					auto& doc = _first[i];
+					auto alphas = getCachedAlphas(doc, buf);
+					FLOAT alphaSum = alphas.sum();
+					ll += math::lgammaSubtSum(alphas.data(), doc.numByTopic.data(), this->K);
+					ll -= math::lgammaT(doc.getSumWordWeight() + alphaSum) - math::lgammaT(alphaSum);
 				}
-				ll -= math::lgammaT(doc.getSumWordWeight() + alphaSum) - math::lgammaT(alphaSum);
-			}
-			return ll;
+				return ll;
+			});
 		}
 
 		double getLLRest(const _ModelState& ld) const
 		{
-			const size_t V = this->realV;
 			const auto K = this->K;
-			const auto eta = this->eta;
 			double ll = 0;
 			for (size_t k = 0; k < K; ++k)
 			{
@@ -242,18 +241,25 @@ namespace tomoto
 			}
 			ll /= -2 * pow(this->sigma, 2);
 
-			auto lgammaEta = math::lgammaT(eta);
-			ll += math::lgammaT(V*eta) * K;
-			for (TID k = 0; k < K; ++k)
+			ll += this->getLLTopicWord(ld);
+			return ll;
+		}
+
+		// widens the range of metadata, kept in mdIntercepts and mdCoefs as minimums and maximums until normalizeMetadata()
+		void extendMdRange(const std::vector<FLOAT>& metadataC)
+		{
+			size_t s = degreeByF.size();
+			if (mdIntercepts.size() < s || mdCoefs.size() < s)
 			{
-				ll -= math::lgammaT(ld.numByTopic[k] + V * eta);
-				for (VID v = 0; v < V; ++v)
-				{
-					if (!ld.numByTopicWord(k, v)) continue;
-					ll += math::lgammaT(ld.numByTopicWord(k, v) + eta) - lgammaEta;
-				}
+				mdIntercepts.resize(s, FLT_MAX);
+				mdCoefs.resize(s, FLT_MIN);
+			}
+
+			for (size_t i = 0; i < s; ++i)
+			{
+				mdIntercepts[i] = std::min(mdIntercepts[i], metadataC[i]);
+				mdCoefs[i] = std::max(mdCoefs[i], metadataC[i]);
 			}
-			return ll;
 		}
 
 		void normalizeMetadata()
@@ -265,34 +271,93 @@ namespace tomoto
 				mdCoefs.resize(s, FLT_MIN);
 			}
 
-			for (auto& doc : this->docs)
+			for (auto& doc : this->docs) extendMdRange(doc.metadataC);
+			for (size_t i = 0; i < s; ++i)
+			{
+				mdCoefs[i] -= mdIntercepts[i];
+				if (mdCoefs[i] == 0) mdCoefs[i] = 1;
+			}
+		}
+
+		/*
+		widens the range of metadata to cover the docs from firstDoc, whose metadata are not normalized yet,
+		and normalizes those of the docs before firstDoc again in the new range.
+		lambda is left as it is, and fitted to the new range by the next optimizeParameters().
+		*/
+		void extendParameters(size_t firstDoc)
+		{
+			const size_t s = degreeByF.size();
+			std::vector<FLOAT> vMin(s), vMax(s);
+			for (size_t i = 0; i < s; ++i)
 			{
+				vMin[i] = mdIntercepts[i];
+				vMax[i] = mdIntercepts[i] + mdCoefs[i];
+			}
+			bool extended = false;
+			for (size_t d = firstDoc; d < this->docs.size(); ++d)
+			{
+				auto& md = this->docs[d].metadataC;
 				for (size_t i = 0; i < s; ++i)
 				{
-					mdIntercepts[i] = std::min(mdIntercepts[i], doc.metadataC[i]);
-					mdCoefs[i] = std::max(mdCoefs[i], doc.metadataC[i]);
+					if (md[i] >= vMin[i] && md[i] <= vMax[i]) continue;
+					vMin[i] = std::min(vMin[i], md[i]);
+					vMax[i] = std::max(vMax[i], md[i]);
+					extended = true;
 				}
 			}
+			if (!extended) return;
+
 			for (size_t i = 0; i < s; ++i)
 			{
-				mdCoefs[i] -= mdIntercepts[i];
-				if (mdCoefs[i] == 0) mdCoefs[i] = 1;
+				const FLOAT coef = vMax[i] - vMin[i] ? vMax[i] - vMin[i] : 1;
+				for (size_t d = 0; d < firstDoc; ++d)
+				{
+					auto& md = this->docs[d].metadataC;
+					md[i] = (md[i] * mdCoefs[i] + mdIntercepts[i] - vMin[i]) / coef;
+				}
+				mdIntercepts[i] = vMin[i];
+				mdCoefs[i] = coef;
 			}
 		}
 
+		size_t _prepareNewDocs(size_t firstDoc, size_t minWordCnt)
+		{
+			size_t ret = BaseClass::_prepareNewDocs(firstDoc, minWordCnt);
+			static_cast<DerivedClass*>(this)->prepareMdCache();
+			return ret;
+		}
+
 		void prepareDoc(_DocType& doc, WeightType* topicDocPtr, size_t wordSize) const
 		{
 			BaseClass::prepareDoc(doc, topicDocPtr, wordSize);
 			for (size_t i = 0; i < degreeByF.size(); ++i) doc.metadataC[i] = mdCoefs[i] ? (doc.metadataC[i] - mdIntercepts[i]) / mdCoefs[i] : 0;
+			auto it = mdIdMap.find(doc.metadataC);
+			doc.metadata = it != mdIdMap.end() ? it->second : (size_t)-1;
+		}
+
+		void prepareMdCache()
+		{
+			mdIdMap.clear();
+			for (auto& doc : this->docs)
+			{
+				doc.metadata = mdIdMap.emplace(doc.metadataC, mdIdMap.size()).first->second;
+			}
+			termsByMd.resize(this->F, mdIdMap.size());
+			for (auto& p : mdIdMap)
+			{
+				getTermsFromMd(&p.first[0], termsByMd.col(p.second).data());
+			}
+			updateExpLambda();
 		}
 
 		void initGlobalState(bool initDocs)
 		{
 			BaseClass::BaseClass::initGlobalState(initDocs);
-			normalizeMetadata();
 			
 			if (initDocs)
 			{
+				// metadata of a loaded model are normalized already
+				normalizeMetadata();
 				this->lambda = Eigen::Matrix<FLOAT, -1, -1>::Zero(this->K, this->F);
 				this->lambda.col(0).fill(log(this->alpha));
 			}
@@ -302,6 +367,30 @@ namespace tomoto
 		}
 
 		DEFINE_SERIALIZER_AFTER_BASE(BaseClass, sigma0, degreeByF, mdCoefs, mdIntercepts);
+
+		void writeCorpusMetadata(std::ostream& writer) const
+		{
+			std::vector<std::vector<FLOAT>> metadata;
+			for (auto& doc : this->docs) metadata.emplace_back(doc.metadataC);
+			serializer::writeMany(writer, metadata);
+		}
+
+		void readCorpusMetadata(std::istream& reader, std::vector<_DocType>& corpusDocs) const
+		{
+			std::vector<std::vector<FLOAT>> metadata;
+			serializer::readMany(reader, metadata);
+			if (metadata.size() != corpusDocs.size()) throw serializer::UnfitException("metadata of the corpus don't match its docs");
+			for (auto& md : metadata)
+			{
+				if (md.size() != degreeByF.size()) throw serializer::UnfitException("metadata of the corpus don't match the fields of the model");
+			}
+			for (size_t i = 0; i < corpusDocs.size(); ++i) corpusDocs[i].metadataC = std::move(metadata[i]);
+		}
+
+		void readCorpusMetadataWithinModel(std::istream& reader, std::vector<_DocType>& corpusDocs) const
+		{
+			readCorpusMetadata(reader, corpusDocs);
+		}
 	public:
 		GDMRModel(size_t _K = 1, const std::vector<size_t>& _degreeByF = {}, FLOAT defaultAlpha = 1.0, FLOAT _sigma = 1.0, FLOAT _eta = 0.01,
 			FLOAT _alphaEps = 1e-10, const RandGen& _rg = RandGen{ std::random_device{}() })
@@ -310,6 +399,12 @@ namespace tomoto
 			this->F = accumulate(degreeByF.begin(), degreeByF.end(), 1, [](size_t a, size_t b) {return a * (b + 1); });
 		}
 
+		~GDMRModel()
+		{
+			// an optimizer left running reads the members of this class, which are destroyed before those of its bases
+			this->discardPendingOptimizer();
+		}
+
 		GETTER(Fs, const std::vector<size_t>&, degreeByF);
 		GETTER(Sigma0, FLOAT, sigma0);
 
@@ -318,6 +413,12 @@ namespace tomoto
 			this->sigma0 = _sigma0;
 		}
 
+		void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0, size_t numWorkers = 0) override
+		{
+			BaseClass::prepare(initDocs, minWordCnt, removeTopN, numWorkers);
+			static_cast<DerivedClass*>(this)->prepareMdCache();
+		}
+
 		size_t addDoc(const std::vector<std::string>& words, const std::vector<std::string>& metadata) override
 		{
 			auto doc = this->_makeDoc(words);
@@ -328,6 +429,16 @@ namespace tomoto
 			return this->_addDoc(doc);
 		}
 
+		size_t addDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) override
+		{
+			auto doc = this->_makeDoc(words);
+			transform(metadata.begin(), metadata.end(), back_inserter(doc.metadataC), [](const std::string& s)
+			{
+				return stof(s);
+			});
+			return this->_addDoc(doc);
+		}
+
 		std::unique_ptr<DocumentBase> makeDoc(const std::vector<std::string>& words, const std::vector<std::string>& metadata) const override
 		{
 			auto doc = this->_makeDocWithinVocab(words);
@@ -338,15 +449,31 @@ namespace tomoto
 			return make_unique<_DocType>(doc);
 		}
 
-		std::vector<FLOAT> getTopicsByDoc(const _DocType& doc) const
+		std::unique_ptr<DocumentBase> makeDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) const override
 		{
-			Eigen::Matrix<FLOAT, -1, 1> alphas(this->K);
-			thread_local Eigen::Matrix<FLOAT, -1, 1> terms{ this->F };
-			getTermsFromMd(&doc.metadataC[0], terms.data());
-			for (TID k = 0; k < this->K; ++k)
+			auto doc = this->_makeDocWithinVocab(words);
+			std::transform(metadata.begin(), metadata.end(), back_inserter(doc.metadataC), [](const std::string& s)
 			{
-				alphas[k] = exp(this->lambda.row(k) * terms) + this->alphaEps;
-			}
+				return stof(s);
+			});
+			return make_unique<_DocType>(doc);
+		}
+
+		void scanDoc(const std::vector<VID>& words, const std::vector<std::string>& metadata) override
+		{
+			this->_scanDoc(words);
+			std::vector<FLOAT> metadataC;
+			std::transform(metadata.begin(), metadata.end(), back_inserter(metadataC), [](const std::string& s)
+			{
+				return stof(s);
+			});
+			extendMdRange(metadataC);
+		}
+
+		std::vector<FLOAT> getTopicsByDoc(const _DocType& doc) const
+		{
+			Eigen::Matrix<FLOAT, -1, 1> buf;
+			auto alphas = getCachedAlphas(doc, buf);
 			std::vector<FLOAT> ret(this->K);
 			FLOAT sum = doc.getSumWordWeight() + alphas.sum();
 			for (size_t k = 0; k < this->K; ++k)
@@ -1,20 +1,81 @@
 #pragma once
 #include "TopicModel.hpp"
+#include "../Utils/PackedVector.hpp"
+#include "../Utils/SparseCountMatrix.hpp"
 
 namespace tomoto
 {
     enum class TermWeight { one, idf, pmi, idf_one, size };
 
+	enum class Sampler { dense, sparse, size };
+
+	inline const char* toString(Sampler s)
+	{
+		switch (s)
+		{
+		case Sampler::dense: return "dense";
+		case Sampler::sparse: return "sparse";
+		default: return "unknown";
+		}
+	}
+
+	/*
+	vector which is either owning or a view of a part of another array, like tvector.
+	copies of an owning vector own a copy of its data, and those of a view are views of the same data.
+	*/
 	template<typename _Scalar>
 	struct ShareableVector : Eigen::Map<Eigen::Matrix<_Scalar, -1, 1>>
 	{
+		using BaseType = Eigen::Map<Eigen::Matrix<_Scalar, -1, 1>>;
 		Eigen::Matrix<_Scalar, -1, 1> ownData;
 		ShareableVector(_Scalar* ptr = nullptr, Eigen::Index len = 0) 
-			: Eigen::Map<Eigen::Matrix<_Scalar, -1, 1>>(nullptr, 0)
+			: BaseType(nullptr, 0)
 		{
 			init(ptr, len);
 		}
 
+		ShareableVector(const ShareableVector& o) : BaseType(nullptr, 0)
+		{
+			*this = o;
+		}
+
+		ShareableVector(ShareableVector&& o) : BaseType(nullptr, 0)
+		{
+			*this = std::move(o);
+		}
+
+		bool isOwner() const
+		{
+			return ownData.data() == this->data();
+		}
+
+		ShareableVector& operator=(const ShareableVector& o)
+		{
+			if (this == &o) return *this;
+			if (o.isOwner())
+			{
+				ownData = o.ownData;
+				init(ownData.data(), ownData.size());
+			}
+			else
+			{
+				ownData.resize(0);
+				init(o.m_data, o.size());
+			}
+			return *this;
+		}
+
+		ShareableVector& operator=(ShareableVector&& o)
+		{
+			const bool owner = o.isOwner();
+			ownData = std::move(o.ownData);
+			if (owner) init(ownData.data(), ownData.size());
+			else init(o.m_data, o.size());
+			o.ownData.resize(0);
+			o.init(nullptr, 0);
+			return *this;
+		}
+
 		void init(_Scalar* ptr, Eigen::Index len)
 		{
 			if (!ptr && len)
@@ -43,6 +104,125 @@ namespace tomoto
 		}
 	};
 
+	/*
+	dense matrix which is either owning or a view of a mapped model.
+	copies always own their data, and assignments of a different size make it owning.
+	*/
+	template<typename _Scalar>
+	struct ShareableMatrix : Eigen::Map<Eigen::Matrix<_Scalar, -1, -1>>
+	{
+		using BaseType = Eigen::Map<Eigen::Matrix<_Scalar, -1, -1>>;
+		Eigen::Matrix<_Scalar, -1, -1> ownData;
+
+		ShareableMatrix() : BaseType(nullptr, 0, 0)
+		{
+		}
+
+		ShareableMatrix(const ShareableMatrix& o) : BaseType(nullptr, 0, 0), ownData(o)
+		{
+			init(ownData.data(), ownData.rows(), ownData.cols());
+		}
+
+		ShareableMatrix(ShareableMatrix&& o) : BaseType(nullptr, 0, 0)
+		{
+			*this = std::move(o);
+		}
+
+		template<typename _Derived>
+		ShareableMatrix(const Eigen::MatrixBase<_Derived>& o) : BaseType(nullptr, 0, 0), ownData(o)
+		{
+			init(ownData.data(), ownData.rows(), ownData.cols());
+		}
+
+		void init(_Scalar* ptr, Eigen::Index rows, Eigen::Index cols)
+		{
+			new (static_cast<BaseType*>(this)) BaseType(ptr, rows, cols);
+		}
+
+		bool isOwner() const
+		{
+			return ownData.data() == this->data();
+		}
+
+		ShareableMatrix& operator=(const ShareableMatrix& o)
+		{
+			if (this != &o) *this = static_cast<const BaseType&>(o);
+			return *this;
+		}
+
+		ShareableMatrix& operator=(ShareableMatrix&& o)
+		{
+			const bool owner = o.isOwner();
+			ownData = std::move(o.ownData);
+			if (owner) init(ownData.data(), ownData.rows(), ownData.cols());
+			else init(o.data(), o.rows(), o.cols());
+			o.ownData.resize(0, 0);
+			o.init(nullptr, 0, 0);
+			return *this;
+		}
+
+		template<typename _Derived>
+		ShareableMatrix& operator=(const Eigen::MatrixBase<_Derived>& o)
+		{
+			if (o.rows() == this->rows() && o.cols() == this->cols())
+			{
+				BaseType::operator=(o);
+			}
+			else
+			{
+				ownData = Eigen::Matrix<_Scalar, -1, -1>(o);
+				init(ownData.data(), ownData.rows(), ownData.cols());
+			}
+			return *this;
+		}
+
+		// keeps the common part and fills the rest with zeros, which makes it owning
+		void conservativeResize(Eigen::Index rows, Eigen::Index cols)
+		{
+			if (!isOwner()) ownData = static_cast<const BaseType&>(*this);
+			ownData.conservativeResizeLike(Eigen::Matrix<_Scalar, -1, -1>::Zero(rows, cols));
+			init(ownData.data(), rows, cols);
+		}
+
+		void serializerWrite(std::ostream& ostr) const
+		{
+			serializer::writeToStream<uint32_t>(ostr, this->rows());
+			serializer::writeToStream<uint32_t>(ostr, this->cols());
+			serializer::writePadding(ostr, 64);
+			if (!ostr.write((const char*)this->data(), sizeof(_Scalar) * this->size()))
+				throw std::ios_base::failure(std::string("writing type '") + typeid(_Scalar).name() + std::string("' is failed"));
+		}
+
+		// a matrix read from memory becomes a view of it. the sparse form written by SparseCountMatrix is read into an owning one.
+		void serializerRead(std::istream& istr)
+		{
+			uint32_t rows = serializer::readFromStream<uint32_t>(istr);
+			uint32_t cols = serializer::readFromStream<uint32_t>(istr);
+			if (rows & serializer::sparseMatrixTag)
+			{
+				rows &= ~serializer::sparseMatrixTag;
+				ownData = Eigen::Matrix<_Scalar, -1, -1>::Zero(rows, cols);
+				init(ownData.data(), rows, cols);
+				SparseCountMatrix<_Scalar>::readSparseForm(istr, rows, cols, [&](Eigen::Index v, const uint32_t* rowIds, const _Scalar* counts, size_t n)
+				{
+					for (size_t i = 0; i < n; ++i) ownData(rowIds[i], v) = counts[i];
+				});
+				return;
+			}
+			serializer::skipPadding(istr, 64);
+			if (const char* p = serializer::mapBytes(istr, sizeof(_Scalar) * rows * cols))
+			{
+				ownData.resize(0, 0);
+				init((_Scalar*)p, rows, cols);
+				return;
+			}
+			ownData = Eigen::Matrix<_Scalar, -1, -1>::Zero(rows, cols);
+			init(ownData.data(), rows, cols);
+			if (!istr.read((char*)ownData.data(), sizeof(_Scalar) * rows * cols))
+				throw std::ios_base::failure(std::string("reading type '") + typeid(_Scalar).name() + std::string("' is failed"));
+		}
+	};
+
 	template<typename _Base, TermWeight _TW>
 	struct SumWordWeight
 	{
@@ -83,7 +263,7 @@ namespace tomoto
 		using DocumentBase::DocumentBase;
 		using WeightType = typename std::conditional<_TW == TermWeight::one, int32_t, float>::type;
 
-		tvector<TID> Zs;
+		PackedVector<TID> Zs; // in the fewest bits which can hold topics less than K
 		tvector<FLOAT> wordWeights;
 		ShareableVector<WeightType> numByTopic;
 
@@ -101,16 +281,41 @@ namespace tomoto
 	{
 	public:
 		using DefaultDocType = DocumentLDA<TermWeight::one>;
-		static ILDAModel* create(TermWeight _weight, size_t _K = 1, FLOAT _alpha = 0.1, FLOAT _eta = 0.01, const RandGen& _rg = RandGen{ std::random_device{}() });
+		static ILDAModel* create(TermWeight _weight, size_t _K = 1, FLOAT _alpha = 0.1, FLOAT _eta = 0.01, const RandGen& _rg = RandGen{ std::random_device{}() }, bool sparseTopicWord = false);
+
+		using ITopicModel::train;
+		// trains with the given sampler, which remains the sampler of the model afterwards
+		virtual int train(size_t iteration, size_t numWorkers, Sampler sampler, ParallelScheme ps = ParallelScheme::default_) = 0;
 
 		virtual size_t addDoc(const std::vector<std::string>& words) = 0;
+		// words are vids given by addWord()
+		virtual size_t addDoc(const std::vector<VID>& words) = 0;
 		virtual std::unique_ptr<DocumentBase> makeDoc(const std::vector<std::string>& words) const = 0;
+		// words are vids given by addWord(), those out of the vocabulary are dropped
+		virtual std::unique_ptr<DocumentBase> makeDoc(const std::vector<VID>& words) const = 0;
+
+		/*
+		online training by SCVB0 over batches of docs made by makeDoc(), which the model doesn't keep,
+		so that memory stays fixed however long the stream is.
+		the vocabulary should be fixed beforehand: docs of the whole stream are counted by scanDoc(), then prepare() is called without docs.
+		docs of a batch are prepared by trainOnline() and get their topic distributions, so each of them should be given once.
+		returns the log likelihood per word of the batch.
+		*/
+		virtual void scanDoc(const std::vector<VID>& words) = 0;
+		virtual double trainOnline(const std::vector<DocumentBase*>& batch, size_t numWorkers = 0, size_t docIteration = 5) = 0;
+		// the step size of the global state at the t-th batch is (tau + t)^-kappa
+		virtual void setOnlineStepSize(FLOAT tau, FLOAT kappa) = 0;
 
 		virtual TermWeight getTermWeight() const = 0;
 		virtual size_t getOptimInterval() const = 0;
 		virtual void setOptimInterval(size_t) = 0;
 		virtual size_t getBurnInIteration() const = 0;
 		virtual void setBurnInIteration(size_t) = 0;
+		// iterations that sampling may go on with the previous hyperparameters while new ones are optimized in the background, 0 for optimizing synchronously
+		virtual size_t getOptimStaleness() const = 0;
+		virtual void setOptimStaleness(size_t) = 0;
+		virtual Sampler getSampler() const = 0;
+		virtual void setSampler(Sampler) = 0;
 		virtual std::vector<size_t> getCountByTopic() const = 0;
 		virtual size_t getK() const = 0;
 		virtual FLOAT getAlpha() const = 0;
@@ -5,9 +5,11 @@ namespace tomoto
 	template class LDAModel<TermWeight::one>;
 	template class LDAModel<TermWeight::idf>;
 	template class LDAModel<TermWeight::pmi>;
+	template class LDAModel<TermWeight::one, flags::partitioned_multisampling | flags::sparse_topic_word>;
 
-    ILDAModel* ILDAModel::create(TermWeight _weight, size_t _K, FLOAT _alpha, FLOAT _eta, const RandGen& _rg)
+    ILDAModel* ILDAModel::create(TermWeight _weight, size_t _K, FLOAT _alpha, FLOAT _eta, const RandGen& _rg, bool sparseTopicWord)
     {
+        if (sparseTopicWord) SWITCH_TW_FLAGS(_weight, flags::partitioned_multisampling | flags::sparse_topic_word, LDAModel, _K, _alpha, _eta, _rg);
         SWITCH_TW(_weight, LDAModel, _K, _alpha, _eta, _rg);
     }
 }
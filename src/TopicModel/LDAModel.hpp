@@ -1,11 +1,13 @@
 #pragma once
-#include <unordered_set>
+#include <unordered_map>
 #include <numeric>
 #include "TopicModel.hpp"
 #include "../Utils/EigenAddonOps.hpp"
+#include "../Utils/GammaKernels.hpp"
 #include "../Utils/Utils.hpp"
 #include "../Utils/math.h"
 #include "../Utils/sample.hpp"
+#include "../Utils/SparseCountMatrix.hpp"
 #include "LDA.h"
 
 /*
@@ -32,18 +34,51 @@ Term Weighting Scheme is based on following paper:
 		}\
 		return nullptr; } while(0)
 
+#define SWITCH_TW_FLAGS(TW, FLAGS, MDL, ...) do{ switch (TW)\
+		{\
+		case TermWeight::one:\
+			return new MDL<TermWeight::one, FLAGS>(__VA_ARGS__);\
+		case TermWeight::idf:\
+			return new MDL<TermWeight::idf, FLAGS>(__VA_ARGS__);\
+		case TermWeight::pmi:\
+			return new MDL<TermWeight::pmi, FLAGS>(__VA_ARGS__);\
+		case TermWeight::idf_one:\
+			return new MDL<TermWeight::idf_one, FLAGS>(__VA_ARGS__);\
+		}\
+		return nullptr; } while(0)
+
 #define GETTER(name, type, field) type get##name() const override { return field; }
 
 namespace tomoto
 {
-	template<TermWeight _TW>
+	template<TermWeight _TW, bool _sparseTopicWord = false>
 	struct ModelStateLDA
 	{
 		using WeightType = typename std::conditional<_TW == TermWeight::one, int32_t, float>::type;
+		using TopicWordMatrix = typename std::conditional<_sparseTopicWord,
+			SparseCountMatrix<WeightType>, ShareableMatrix<WeightType>>::type;
 
 		Eigen::Matrix<FLOAT, -1, 1> zLikelihood;
 		Eigen::Matrix<WeightType, -1, 1> numByTopic; // Dim: (Topic, 1)
-		Eigen::Matrix<WeightType, -1, -1> numByTopicWord; // Dim: (Topic, Vocabs)
+		TopicWordMatrix numByTopicWord; // Dim: (Topic, Vocabs)
+
+		// used by Sampler::sparse only, empty lists mean they should be rebuilt from numByTopicWord
+		std::vector<std::vector<TID>> topicsByWord; // topics having non-zero count in numByTopicWord.col(vid)
+		std::vector<TID> topicsOfDoc; // topics having non-zero count in the current document
+		Eigen::Matrix<FLOAT, -1, 1> sparseCoef; // (alpha_k + n_dk) / (n_k + etaSum) of the current document
+
+		// used by ParallelScheme::copy_merge only, changes of numByTopicWord made by this replica since the last merge,
+		// bucketed by vid % deltasByChunk.size(). empty means changes are not recorded.
+		struct TopicWordDelta
+		{
+			VID vid;
+			TID tid;
+			WeightType delta;
+		};
+		std::vector<std::vector<TopicWordDelta>> deltasByChunk;
+
+		// changes of the log likelihood made by this state since the last merge, tracked while sampling for training
+		double llDocTopicDelta = 0, llTopicWordDelta = 0;
 		DEFINE_SERIALIZER(numByTopic, numByTopicWord);
 	};
 
@@ -52,7 +87,8 @@ namespace tomoto
 		enum
 		{
 			generator_by_doc = end_flag_of_TopicModel,
-			end_flag_of_LDAModel = generator_by_doc << 1,
+			sparse_topic_word = generator_by_doc << 1, // stores numByTopicWord in SparseCountMatrix
+			end_flag_of_LDAModel = sparse_topic_word << 1,
 		};
 	}
 
@@ -61,8 +97,9 @@ namespace tomoto
 	class EtaHelper
 	{
 		const _Model* _this;
+		FLOAT etaSum;
 	public:
-		EtaHelper(const _Model* p) : _this(p) {}
+		EtaHelper(const _Model* p) : _this(p), etaSum(p->eta * p->realV) {}
 
 		FLOAT getEta(size_t vid) const
 		{
@@ -71,7 +108,18 @@ namespace tomoto
 
 		FLOAT getEtaSum() const
 		{
-			return _this->eta * _this->realV;
+			return etaSum;
+		}
+
+		// the values as arrays for sample::LikelihoodTerms, a single value shared by all topics
+		const FLOAT* getEtaData(size_t vid) const
+		{
+			return &_this->eta;
+		}
+
+		const FLOAT* getEtaSumData() const
+		{
+			return &etaSum;
 		}
 	};
 
@@ -93,13 +141,23 @@ namespace tomoto
 		{
 			return _this->etaSumByTopic.array();
 		}
+
+		const FLOAT* getEtaData(size_t vid) const
+		{
+			return _this->etaByTopicWord.col(vid).data();
+		}
+
+		const FLOAT* getEtaSumData() const
+		{
+			return _this->etaSumByTopic.data();
+		}
 	};
 
 	template<TermWeight _TW, size_t _Flags = flags::partitioned_multisampling,
 		typename _Interface = ILDAModel,
 		typename _Derived = void, 
 		typename _DocType = DocumentLDA<_TW, _Flags>,
-		typename _ModelState = ModelStateLDA<_TW>>
+		typename _ModelState = ModelStateLDA<_TW, !!(_Flags & flags::sparse_topic_word)>>
 	class LDAModel : public TopicModel<_Flags, _Interface,
 		typename std::conditional<std::is_same<_Derived, void>::value, LDAModel<_TW, _Flags>, _Derived>::type, 
 		_DocType, _ModelState>
@@ -117,8 +175,12 @@ namespace tomoto
 
 		enum { m_flags = _Flags };
 
+		// see prepareOptimizer()
+		using ParameterApplier = std::function<void()>;
+		using ParameterOptimizer = std::function<ParameterApplier(ThreadPool&)>;
+
 		std::vector<FLOAT> vocabWeights;
-		std::vector<TID> sharedZs;
+		std::vector<uint64_t> sharedZs; // packed Zs of all docs
 		std::vector<FLOAT> sharedWordWeights;
 		TID K;
 		FLOAT alpha, eta;
@@ -127,7 +189,36 @@ namespace tomoto
 		Eigen::Matrix<FLOAT, -1, -1> etaByTopicWord; // (K, V)
 		Eigen::Matrix<FLOAT, -1, 1> etaSumByTopic; // (K, )
 		size_t optimInterval = 10, burnIn = 0;
+		Sampler sampler = Sampler::dense;
 		Eigen::Matrix<WeightType, -1, -1> numByTopicDoc;
+		math::LgammaCountTable etaCountTable; // lgamma(n + eta) - lgamma(eta), built in initGlobalState for TermWeight::one
+
+		// parts of getLL() of globalState maintained incrementally while training, NAN means they are recomputed on every call
+		double cachedLLDocs = NAN, cachedLLTopicWord = NAN;
+
+		/*
+		iterations that sampling may go on with the previous hyperparameters while new ones are optimized in the background,
+		0 for optimizing synchronously. the optimizer is launched this many iterations ahead of where the synchronous one runs,
+		and its result is swapped in at the first iteration boundary after it's ready, at the latest where the synchronous one runs.
+		it is kept running across calls of train(), and flushed by flushDeferred() before the model is read otherwise.
+		*/
+		size_t optimStaleness = 0;
+		std::future<ParameterApplier> pendingOptimizer;
+		size_t pendingOptimizerIterated = 0; // iterated when pendingOptimizer was launched
+		std::unique_ptr<ThreadPool> optimizerPool;
+
+		/*
+		state of trainOnline(): expected topic-word counts are onlineScale * onlineTopicWord, so that decaying them is O(1)
+		and a batch touches only the columns of its words. globalState holds them rounded, synced by flushDeferred().
+		*/
+		Eigen::Matrix<FLOAT, -1, -1> onlineTopicWord; // (K, V)
+		Eigen::Matrix<FLOAT, -1, 1> onlineTopicSum; // (K), row sums of onlineTopicWord
+		FLOAT onlineScale = 1;
+		bool onlineStale = false; // globalState lags behind onlineTopicWord
+		mutable std::mutex deferredMutex;
+		size_t onlineIterated = 0; // number of batches trained
+		size_t onlineNumWords = 0; // words of the whole stream, counted by scanDoc()
+		FLOAT onlineTau = 1, onlineKappa = 0.7;
 		
 		struct ExtraDocData
 		{
@@ -138,29 +229,82 @@ namespace tomoto
 		ExtraDocData eddTrain;
 
 
-		template<typename _List>
-		static FLOAT calcDigammaSum(_List list, size_t len, FLOAT alpha)
+		// sum of digamma(list[i] + alpha) - digamma(alpha) over i
+		static FLOAT calcDigammaSum(const std::vector<FLOAT>& list, FLOAT alpha)
 		{
-			auto listExpr = Eigen::Matrix<FLOAT, -1, 1>::NullaryExpr(len, list);
-			auto dAlpha = math::digammaT(alpha);
-			return (math::digammaApprox(listExpr.array() + alpha) - dAlpha).sum();
+			return math::digammaSum(list.data(), alpha, list.size()) - list.size() * math::digammaT(alpha);
 		}
 
 		/*
-		function for optimizing hyperparameters
+		function for optimizing hyperparameters, split in three phases so that it can run while sampling goes on.
+		prepareOptimizer() snapshots what it needs of the current state, between iterations.
+		the optimizer it returns works on the snapshot only, and returns the applier swapping its result in, between iterations.
+		docs of zero count add nothing to the digamma sums, so each topic visits only docs having non-zero count of it.
 		*/
-		void optimizeParameters(ThreadPool& pool, _ModelState* localData, RandGen* rgs)
+		ParameterOptimizer prepareOptimizer(ThreadPool& pool, _ModelState* localData, RandGen* rgs)
 		{
 			const auto K = this->K;
-			for (size_t i = 0; i < 10; ++i)
+			auto countsByTopic = std::make_shared<std::vector<std::vector<FLOAT>>>(K);
+			auto sums = std::make_shared<std::vector<FLOAT>>();
+			sums->reserve(this->docs.size());
+			for (auto& doc : this->docs)
 			{
-				FLOAT denom = calcDigammaSum([&](size_t i) { return this->docs[i].getSumWordWeight(); }, this->docs.size(), alphas.sum());
 				for (size_t k = 0; k < K; ++k)
 				{
-					FLOAT nom = calcDigammaSum([&](size_t i) { return this->docs[i].numByTopic[k]; }, this->docs.size(), alphas(k));
-					alphas(k) = std::max(nom / denom * alphas(k), 1e-5f);
+					if (doc.numByTopic[k]) (*countsByTopic)[k].emplace_back(doc.numByTopic[k]);
+				}
+				if (doc.getSumWordWeight()) sums->emplace_back(doc.getSumWordWeight());
+			}
+
+			Eigen::Matrix<FLOAT, -1, 1> newAlphas = alphas;
+			return [this, countsByTopic, sums, newAlphas](ThreadPool& pool) mutable -> ParameterApplier
+			{
+				for (size_t i = 0; i < 10; ++i)
+				{
+					FLOAT denom = calcDigammaSum(*sums, newAlphas.sum());
+					for (size_t k = 0; k < this->K; ++k)
+					{
+						FLOAT nom = calcDigammaSum((*countsByTopic)[k], newAlphas(k));
+						newAlphas(k) = std::max(nom / denom * newAlphas(k), 1e-5f);
+					}
 				}
+				return [this, newAlphas]() { alphas = newAlphas; };
+			};
+		}
+
+		void optimizeParameters(ThreadPool& pool, _ModelState* localData, RandGen* rgs)
+		{
+			static_cast<DerivedClass*>(this)->prepareOptimizer(pool, localData, rgs)(pool)();
+		}
+
+		// starts the optimizer on a pool of its own, so that sampling with the current hyperparameters goes on
+		void launchOptimizer(ThreadPool& pool, _ModelState* localData, RandGen* rgs)
+		{
+			auto optimizer = static_cast<DerivedClass*>(this)->prepareOptimizer(pool, localData, rgs);
+			if (!optimizerPool || optimizerPool->getNumWorkers() != pool.getNumWorkers())
+			{
+				optimizerPool = make_unique<ThreadPool>(pool.getNumWorkers());
 			}
+			auto& optPool = *optimizerPool;
+			pendingOptimizer = std::async(std::launch::async, [optimizer, &optPool]() { return optimizer(optPool); });
+			pendingOptimizerIterated = this->iterated;
+		}
+
+		// waits for the optimizer in the background and swaps its result in
+		void applyPendingOptimizer()
+		{
+			auto applier = pendingOptimizer.get();
+			applier();
+			// priors of documents have been changed
+			cachedLLDocs = NAN;
+		}
+
+		// waits for the optimizer in the background, dropping its result and errors
+		void discardPendingOptimizer()
+		{
+			if (!pendingOptimizer.valid()) return;
+			pendingOptimizer.wait();
+			pendingOptimizer = {};
 		}
 
 		template<bool _asymEta>
@@ -169,21 +313,70 @@ namespace tomoto
 			return EtaHelper<DerivedClass, _asymEta>{ static_cast<const DerivedClass*>(this) };
 		}
 
+		const FLOAT* getAlphasOfDoc(const _ModelState& ld, const _DocType& doc) const
+		{
+			return alphas.data();
+		}
+
+		// prepares what getAlphasOfDoc() needs, for documents sampled without sampleDocument()
+		void prepareAlphasOfDoc(_ModelState& ld, const _DocType& doc) const
+		{
+		}
+
 		template<bool _asymEta>
 		FLOAT* getZLikelihoods(_ModelState& ld, const _DocType& doc, size_t docId, size_t vid) const
 		{
-			const size_t V = this->realV;
-			assert(vid < V);
+			assert(vid < this->realV);
 			auto etaHelper = this->template getEtaHelper<_asymEta>();
+			auto alphaDoc = Eigen::Map<const Eigen::Array<FLOAT, -1, 1>>{
+				static_cast<const DerivedClass*>(this)->getAlphasOfDoc(ld, doc), (Eigen::Index)K };
 			auto& zLikelihood = ld.zLikelihood;
-			zLikelihood = (doc.numByTopic.array().template cast<FLOAT>() + alphas.array())
+			zLikelihood = (doc.numByTopic.array().template cast<FLOAT>() + alphaDoc)
 				* (ld.numByTopicWord.col(vid).array().template cast<FLOAT>() + etaHelper.getEta(vid))
 				/ (ld.numByTopic.array().template cast<FLOAT>() + etaHelper.getEtaSum());
 			sample::prefixSum(zLikelihood.data(), K);
 			return &zLikelihood[0];
 		}
 
-		template<int INC>
+		/*
+		draws the topic of a word by the fused kernel of sample::sampleFromLikelihoods().
+		alphas come from getAlphasOfDoc(), so this serves every prior of derived models.
+		sparse columns of numByTopicWord are left to getZLikelihoods().
+		*/
+		template<bool _asymEta>
+		TID drawTopic(_ModelState& ld, const _DocType& doc, size_t docId, size_t vid, RandGen& rgs) const
+		{
+			const WeightType* topicWord = denseColumn(ld.numByTopicWord, vid);
+			if (!topicWord)
+			{
+				FLOAT* dist = static_cast<const DerivedClass*>(this)->template getZLikelihoods<_asymEta>(ld, doc, docId, vid);
+				return sample::sampleFromDiscreteAcc(dist, dist + K, rgs);
+			}
+			auto etaHelper = this->template getEtaHelper<_asymEta>();
+			const sample::LikelihoodTerms<WeightType, _asymEta> terms{
+				doc.numByTopic.data(), static_cast<const DerivedClass*>(this)->getAlphasOfDoc(ld, doc),
+				topicWord, etaHelper.getEtaData(vid),
+				ld.numByTopic.data(), etaHelper.getEtaSumData()
+			};
+			return sample::sampleFromLikelihoods(ld.zLikelihood.data(), terms, K, rgs);
+		}
+
+		// lgamma(c + eta) up to a constant, the term of a topic-word count in the log likelihood
+		double lgammaEtaOfCount(int32_t c) const
+		{
+			return etaCountTable(c);
+		}
+
+		double lgammaEtaOfCount(float c) const
+		{
+			return math::lgammaT(c + eta);
+		}
+
+		/*
+		_trackLL accumulates the change of the log likelihood made by weighted counts into ld.
+		they are clamped at zero when decreased, so the change is taken from the counts before and after the update.
+		*/
+		template<int INC, bool _trackLL = false>
 		inline void addWordTo(_ModelState& ld, _DocType& doc, uint32_t pid, VID vid, TID tid) const
 		{
 			assert(tid < K);
@@ -192,16 +385,110 @@ namespace tomoto
 			typename std::conditional<_TW != TermWeight::one, float, int32_t>::type weight
 				= _TW != TermWeight::one ? doc.wordWeights[pid] : 1;
 
+			const WeightType nBefore = doc.numByTopic[tid];
 			updateCnt<DEC>(doc.numByTopic[tid], INC * weight);
 			updateCnt<DEC>(ld.numByTopic[tid], INC * weight);
-			updateCnt<DEC>(ld.numByTopicWord(tid, vid), INC * weight);
+			auto& cnt = ld.numByTopicWord(tid, vid);
+			const WeightType before = cnt;
+			updateCnt<DEC>(cnt, INC * weight);
+			if (!ld.deltasByChunk.empty())
+			{
+				auto& deltas = ld.deltasByChunk[vid % ld.deltasByChunk.size()];
+				// a token removed and put back to the same topic cancels out
+				if (INC > 0 && !deltas.empty() && deltas.back().vid == vid && deltas.back().tid == tid)
+				{
+					if (!(deltas.back().delta += cnt - before)) deltas.pop_back();
+				}
+				else deltas.push_back({ vid, tid, cnt - before });
+			}
+			if (_trackLL && _TW != TermWeight::one)
+			{
+				const FLOAT alpha = static_cast<const DerivedClass*>(this)->getAlphasOfDoc(ld, doc)[tid];
+				ld.llDocTopicDelta += math::lgammaT(doc.numByTopic[tid] + alpha) - math::lgammaT(nBefore + alpha);
+				ld.llTopicWordDelta += lgammaEtaOfCount(cnt) - lgammaEtaOfCount(before);
+			}
+			updateTopicsByWord(ld, tid, vid, before <= 0, cnt <= 0);
+			if (cnt <= 0) pruneZero(ld.numByTopicWord, tid, vid);
+		}
+
+		/*
+		accumulates the change of the log likelihood made by moving a token from zOld to zNew, after the move.
+		integer counts are never clamped, so it is known from the counts after the move only.
+		weighted counts are tracked by addWordTo<INC, true>() instead.
+		*/
+		inline void trackLLOfMove(_ModelState& ld, const _DocType& doc, uint32_t pid, VID vid, TID zOld, TID zNew) const
+		{
+			if (_TW != TermWeight::one || zOld == zNew) return;
+			const FLOAT* alphaDoc = static_cast<const DerivedClass*>(this)->getAlphasOfDoc(ld, doc);
+			const WeightType nOld = doc.numByTopic[zOld], nNew = doc.numByTopic[zNew];
+			// lgamma(n + 1 + a) - lgamma(n + a) = log(n + a)
+			ld.llDocTopicDelta += std::log((nNew - 1 + alphaDoc[zNew]) / (nOld + alphaDoc[zOld]));
+			const WeightType cOld = ld.numByTopicWord.coeff(zOld, vid), cNew = ld.numByTopicWord.coeff(zNew, vid);
+			ld.llTopicWordDelta += lgammaEtaOfCount(cOld) - lgammaEtaOfCount(cOld + 1)
+				+ lgammaEtaOfCount(cNew) - lgammaEtaOfCount(cNew - 1);
+		}
+
+		// keeps the non-zero topic list of the word in step with the count
+		static void updateTopicsByWord(_ModelState& ld, TID tid, VID vid, bool wasZero, bool isZero)
+		{
+			if (ld.topicsByWord.empty() || wasZero == isZero) return;
+			auto& topics = ld.topicsByWord[vid];
+			if (wasZero) topics.emplace_back(tid);
+			else
+			{
+				auto it = std::find(topics.begin(), topics.end(), tid);
+				*it = topics.back();
+				topics.pop_back();
+			}
+		}
+
+		static void setTopicWordCount(_ModelState& ld, TID tid, VID vid, WeightType val)
+		{
+			const WeightType before = ld.numByTopicWord.coeff(tid, vid);
+			if (before == val) return;
+			ld.numByTopicWord(tid, vid) = val;
+			updateTopicsByWord(ld, tid, vid, before <= 0, val <= 0);
+			if (val <= 0) pruneZero(ld.numByTopicWord, tid, vid);
+		}
+
+		// replaces the counts of ld with src, updating the non-zero topic lists only at the entries changing sign
+		template<typename _Matrix>
+		static void assignTopicWordCount(_ModelState& ld, const _Matrix& src)
+		{
+			if (ld.topicsByWord.size() != (size_t)src.cols())
+			{
+				ld.topicsByWord.clear();
+				ld.numByTopicWord = src;
+				return;
+			}
+			forEachNonZero(ld.numByTopicWord, [&](size_t k, size_t v, WeightType c)
+			{
+				if (c > 0 && !(src.coeff(k, v) > 0)) updateTopicsByWord(ld, k, v, false, true);
+			});
+			forEachNonZero(src, [&](size_t k, size_t v, WeightType c)
+			{
+				if (c > 0 && !(ld.numByTopicWord.coeff(k, v) > 0)) updateTopicsByWord(ld, k, v, true, false);
+			});
+			ld.numByTopicWord = src;
+		}
+
+		static void buildTopicsByWord(_ModelState& ld)
+		{
+			ld.topicsByWord.clear();
+			ld.topicsByWord.resize(ld.numByTopicWord.cols());
+			forEachNonZero(ld.numByTopicWord, [&](size_t k, size_t v, WeightType c)
+			{
+				if (c > 0) ld.topicsByWord[v].emplace_back(k);
+			});
 		}
 
 		/*
-		main sampling procedure
+		sampling procedure of Sampler::sparse
+		the conditional is split into smoothing(s), document(r) and word(q) buckets, and only q is computed for each word.
+		* Yao, L., Mimno, D., & McCallum, A. (2009). Efficient methods for topic model inference on streaming document collections. In Proceedings of the 15th ACM SIGKDD (pp. 937-946).
 		*/
 		template<ParallelScheme _ps, bool _infer, typename _ExtraDocData>
-		void sampleDocument(_DocType& doc, const _ExtraDocData& edd, size_t docId, _ModelState& ld, RandGen& rgs, size_t iterationCnt, size_t partitionId = 0) const
+		void sampleDocumentSparse(_DocType& doc, const _ExtraDocData& edd, size_t docId, _ModelState& ld, RandGen& rgs, size_t iterationCnt, size_t partitionId = 0) const
 		{
 			size_t b = 0, e = doc.words.size();
 			if (_ps == ParallelScheme::partition)
@@ -212,23 +499,135 @@ namespace tomoto
 
 			size_t vOffset = (_ps == ParallelScheme::partition && partitionId) ? edd.vChunkOffset[partitionId - 1] : 0;
 
+			if (ld.topicsByWord.empty()) buildTopicsByWord(ld);
+			const FLOAT* alphaDoc = static_cast<const DerivedClass*>(this)->getAlphasOfDoc(ld, doc);
+			const FLOAT etaSum = eta * this->realV;
+			auto& coef = ld.sparseCoef;
+			auto& docTopics = ld.topicsOfDoc;
+			coef.resize(K);
+			docTopics.clear();
+			FLOAT sSum = 0, rSum = 0;
+			for (TID k = 0; k < K; ++k)
+			{
+				FLOAT denom = 1 / (ld.numByTopic[k] + etaSum);
+				sSum += alphaDoc[k] * eta * denom;
+				if (doc.numByTopic[k] > 0)
+				{
+					docTopics.emplace_back(k);
+					rSum += doc.numByTopic[k] * eta * denom;
+				}
+				coef[k] = (alphaDoc[k] + doc.numByTopic[k]) * denom;
+			}
+
+			// remove or restore the contribution of topic k to the buckets, which must wrap every change of the counts of k
+			auto detach = [&](TID k)
+			{
+				FLOAT denom = 1 / (ld.numByTopic[k] + etaSum);
+				sSum -= alphaDoc[k] * eta * denom;
+				rSum -= doc.numByTopic[k] * eta * denom;
+			};
+			auto attach = [&](TID k)
+			{
+				FLOAT denom = 1 / (ld.numByTopic[k] + etaSum);
+				sSum += alphaDoc[k] * eta * denom;
+				rSum += doc.numByTopic[k] * eta * denom;
+				coef[k] = (alphaDoc[k] + doc.numByTopic[k]) * denom;
+			};
+
 			for (size_t w = b; w < e; ++w)
 			{
 				if (doc.words[w] >= this->realV) continue;
-				addWordTo<-1>(ld, doc, w, doc.words[w] - vOffset, doc.Zs[w]);
-				FLOAT* dist;
-				if (etaByTopicWord.size())
+				const VID vid = doc.words[w] - vOffset;
+				const TID z0 = doc.Zs[w];
+				TID z = z0;
+				detach(z);
+				addWordTo<-1, !_infer>(ld, doc, w, vid, z);
+				if (doc.numByTopic[z] <= 0)
 				{
-					dist = static_cast<const DerivedClass*>(this)->template
-						getZLikelihoods<true>(ld, doc, docId, doc.words[w] - vOffset);
+					auto it = std::find(docTopics.begin(), docTopics.end(), z);
+					if (it != docTopics.end())
+					{
+						*it = docTopics.back();
+						docTopics.pop_back();
+					}
+				}
+				attach(z);
+
+				const auto& wordTopics = ld.topicsByWord[vid];
+				FLOAT qSum = 0;
+				for (size_t i = 0; i < wordTopics.size(); ++i)
+				{
+					qSum += coef[wordTopics[i]] * ld.numByTopicWord.coeff(wordTopics[i], vid);
+					ld.zLikelihood[i] = qSum;
+				}
+
+				FLOAT u = sample::FastRealGenerator{}(rgs) * (sSum + rSum + qSum);
+				if (u < qSum)
+				{
+					size_t i = 0;
+					for (; i < wordTopics.size() - 1 && u >= ld.zLikelihood[i]; ++i);
+					z = wordTopics[i];
+				}
+				else if ((u -= qSum) < rSum && !docTopics.empty())
+				{
+					size_t i = 0;
+					for (; i < docTopics.size() - 1; ++i)
+					{
+						u -= doc.numByTopic[docTopics[i]] * eta / (ld.numByTopic[docTopics[i]] + etaSum);
+						if (u < 0) break;
+					}
+					z = docTopics[i];
 				}
 				else
 				{
-					dist = static_cast<const DerivedClass*>(this)->template
-						getZLikelihoods<false>(ld, doc, docId, doc.words[w] - vOffset);
+					u -= rSum;
+					for (z = 0; z < K - 1; ++z)
+					{
+						u -= alphaDoc[z] * eta / (ld.numByTopic[z] + etaSum);
+						if (u < 0) break;
+					}
 				}
-				doc.Zs[w] = sample::sampleFromDiscreteAcc(dist, dist + K, rgs);
-				addWordTo<1>(ld, doc, w, doc.words[w] - vOffset, doc.Zs[w]);
+
+				detach(z);
+				if (doc.numByTopic[z] <= 0) docTopics.emplace_back(z);
+				addWordTo<1, !_infer>(ld, doc, w, vid, z);
+				attach(z);
+				if (!_infer) trackLLOfMove(ld, doc, w, vid, z0, z);
+				doc.Zs.set(w, z);
+			}
+		}
+
+		template<ParallelScheme _ps, bool _infer, typename _ExtraDocData>
+		void sampleDocument(_DocType& doc, const _ExtraDocData& edd, size_t docId, _ModelState& ld, RandGen& rgs, size_t iterationCnt, size_t partitionId = 0) const
+		{
+			// the sparse samplers cannot split the smoothing bucket when word priors are given, and are not used for inference
+			if (!_infer && sampler == Sampler::sparse && !etaByTopicWord.size())
+			{
+				return static_cast<const DerivedClass*>(this)->template sampleDocumentSparse<_ps, _infer>(
+					doc, edd, docId, ld, rgs, iterationCnt, partitionId);
+			}
+
+			size_t b = 0, e = doc.words.size();
+			if (_ps == ParallelScheme::partition)
+			{
+				b = edd.chunkOffsetByDoc(partitionId, docId);
+				e = edd.chunkOffsetByDoc(partitionId + 1, docId);
+			}
+
+			size_t vOffset = (_ps == ParallelScheme::partition && partitionId) ? edd.vChunkOffset[partitionId - 1] : 0;
+
+			for (size_t w = b; w < e; ++w)
+			{
+				if (doc.words[w] >= this->realV) continue;
+				const VID vid = doc.words[w] - vOffset;
+				const TID z0 = doc.Zs[w];
+				addWordTo<-1, !_infer>(ld, doc, w, vid, z0);
+				const TID z = etaByTopicWord.size()
+					? static_cast<const DerivedClass*>(this)->template drawTopic<true>(ld, doc, docId, vid, rgs)
+					: static_cast<const DerivedClass*>(this)->template drawTopic<false>(ld, doc, docId, vid, rgs);
+				doc.Zs.set(w, z);
+				addWordTo<1, !_infer>(ld, doc, w, vid, z);
+				if (!_infer) trackLLOfMove(ld, doc, w, vid, z0, z);
 			}
 		}
 
@@ -334,7 +733,7 @@ namespace tomoto
 				size_t b = partitionId ? edd.vChunkOffset[partitionId - 1] : 0,
 					e = edd.vChunkOffset[partitionId];
 
-				localData[partitionId].numByTopicWord = globalState.numByTopicWord.block(0, b, globalState.numByTopicWord.rows(), e - b);
+				assignTopicWordCount(localData[partitionId], globalState.numByTopicWord.middleCols(b, e - b));
 				localData[partitionId].numByTopic = globalState.numByTopic;
 				if (!localData[partitionId].zLikelihood.size()) localData[partitionId].zLikelihood = globalState.zLikelihood;
 			});
@@ -363,22 +762,62 @@ namespace tomoto
 			try
 			{
 				performSampling<_ps, false>(pool, localData, rgs, res, 
-					this->docs.begin(), this->docs.end(), eddTrain);
+					this->docs.begin() + this->firstTrainDoc, this->docs.end(), eddTrain);
 				static_cast<DerivedClass*>(this)->updateGlobalInfo(pool, localData);
 				static_cast<DerivedClass*>(this)->template mergeState<_ps>(pool, this->globalState, this->tState, localData, rgs, eddTrain);
-				static_cast<DerivedClass*>(this)->template sampleGlobalLevel<>(&pool, localData, rgs, this->docs.begin(), this->docs.end());
-				if (this->iterated >= this->burnIn && optimInterval && (this->iterated + 1) % optimInterval == 0)
+				static_cast<DerivedClass*>(this)->template sampleGlobalLevel<>(&pool, localData, rgs, this->docs.begin() + this->firstTrainDoc, this->docs.end());
+
+				cachedLLDocs += this->globalState.llDocTopicDelta;
+				cachedLLTopicWord += this->globalState.llTopicWordDelta;
+				this->globalState.llDocTopicDelta = this->globalState.llTopicWordDelta = 0;
+
+				if (pendingOptimizer.valid() && (this->iterated >= pendingOptimizerIterated + optimStaleness
+					|| pendingOptimizer.wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+				{
+					applyPendingOptimizer();
+				}
+
+				if (this->iterated >= this->burnIn && optimInterval && (this->iterated + 1 + optimStaleness) % optimInterval == 0)
 				{
-					static_cast<DerivedClass*>(this)->optimizeParameters(pool, localData, rgs);
+					if (optimStaleness)
+					{
+						// at most one optimizer runs at a time
+						if (pendingOptimizer.valid()) applyPendingOptimizer();
+						launchOptimizer(pool, localData, rgs);
+					}
+					else
+					{
+						static_cast<DerivedClass*>(this)->optimizeParameters(pool, localData, rgs);
+						// priors of documents may have been changed
+						cachedLLDocs = NAN;
+					}
 				}
 			}
 			catch (const exception::TrainingError& e)
 			{
 				for (auto& r : res) if(r.valid()) r.get();
+				discardPendingOptimizer();
+				invalidateCachedLL();
 				throw;
 			}
 		}
 
+		void invalidateCachedLL()
+		{
+			cachedLLDocs = cachedLLTopicWord = NAN;
+		}
+
+		// moves the log likelihood changes tracked by the workers into globalState
+		static void gatherLLDelta(_ModelState& globalState, _ModelState* localData, size_t numWorkers, bool withTopicWord)
+		{
+			for (size_t i = 0; i < numWorkers; ++i)
+			{
+				globalState.llDocTopicDelta += localData[i].llDocTopicDelta;
+				if (withTopicWord) globalState.llTopicWordDelta += localData[i].llTopicWordDelta;
+				localData[i].llDocTopicDelta = localData[i].llTopicWordDelta = 0;
+			}
+		}
+
 		/*
 		updates global informations after sampling documents
 		ex) update new global K at HDP model
@@ -397,27 +836,110 @@ namespace tomoto
 
 			if (_ps == ParallelScheme::copy_merge)
 			{
-				tState = globalState;
-				globalState = localData[0];
-				for (size_t i = 1; i < pool.getNumWorkers(); ++i)
+				const size_t numWorkers = pool.getNumWorkers();
+				if (localData[0].deltasByChunk.empty())
 				{
-					globalState.numByTopicWord += localData[i].numByTopicWord - tState.numByTopicWord;
-				}
+					// the first merge after the replicas are made: merge them whole and start recording deltas
+					tState = globalState;
+					globalState = localData[0];
+					globalState.deltasByChunk.clear();
+					globalState.llDocTopicDelta = 0;
+					gatherLLDelta(globalState, localData, numWorkers, false);
+					// the change of the topic-word part is unknown here
+					globalState.llTopicWordDelta = NAN;
+					for (size_t i = 1; i < numWorkers; ++i)
+					{
+						addDifference(globalState.numByTopicWord, localData[i].numByTopicWord, tState.numByTopicWord);
+					}
 
-				// make all count being positive
-				if (_TW != TermWeight::one)
-				{
-					globalState.numByTopicWord = globalState.numByTopicWord.cwiseMax(0);
+					// make all count being positive
+					if (_TW != TermWeight::one)
+					{
+						clampNonNegative(globalState.numByTopicWord);
+					}
+					globalState.numByTopic = rowSums(globalState.numByTopicWord);
+					globalState.topicsByWord.clear();
+
+					for (size_t i = 0; i < numWorkers; ++i)
+					{
+						res.emplace_back(pool.enqueue([&, i](size_t)
+						{
+							localData[i] = globalState;
+							localData[i].deltasByChunk.resize(numWorkers);
+							localData[i].llDocTopicDelta = localData[i].llTopicWordDelta = 0;
+						}));
+					}
+					for (auto& r : res) r.get();
+					return;
 				}
-				globalState.numByTopic = globalState.numByTopicWord.rowwise().sum();
 
-				for (size_t i = 0; i < pool.getNumWorkers(); ++i)
+				// each chunk owns the words of vid % numWorkers == chunkId, so chunks never touch the same column
+				std::vector<Eigen::Matrix<WeightType, -1, 1>> diffByChunk(numWorkers);
+				std::vector<double> llByChunk(numWorkers);
+				res = pool.enqueueToAll([&](size_t chunkId)
 				{
-					res.emplace_back(pool.enqueue([&, i](size_t)
+					auto& diff = diffByChunk[chunkId];
+					diff = Eigen::Matrix<WeightType, -1, 1>::Zero(K);
+					auto& global = globalState.numByTopicWord;
+					double ll = 0;
+					for (size_t i = 0; i < numWorkers; ++i)
 					{
-						localData[i] = globalState;
-					}));
-				}
+						for (auto& d : localData[i].deltasByChunk[chunkId])
+						{
+							auto& cnt = global(d.tid, d.vid);
+							const WeightType before = cnt;
+							// terms of intermediate counts cancel out, leaving those of the final (clamped) and the initial count
+							ll -= lgammaEtaOfCount(std::max(cnt, (WeightType)0));
+							cnt += d.delta;
+							ll += lgammaEtaOfCount(std::max(cnt, (WeightType)0));
+							diff[d.tid] += d.delta;
+							// clamping below never turns a count positive, so the list follows the merged count
+							updateTopicsByWord(globalState, d.tid, d.vid, before <= 0, cnt <= 0);
+						}
+					}
+					llByChunk[chunkId] = ll;
+
+					for (size_t i = 0; i < numWorkers; ++i)
+					{
+						for (auto& d : localData[i].deltasByChunk[chunkId])
+						{
+							const WeightType cnt = global.coeff(d.tid, d.vid);
+							if (cnt > 0) continue;
+							// make all count being positive
+							if (_TW != TermWeight::one && cnt < 0)
+							{
+								diff[d.tid] -= cnt;
+								global(d.tid, d.vid) = 0;
+							}
+							pruneZero(global, d.tid, d.vid);
+						}
+					}
+
+					// patch the replicas with the merged counts of every touched entry
+					for (size_t j = 0; j < numWorkers; ++j)
+					{
+						for (size_t i = 0; i < numWorkers; ++i)
+						{
+							for (auto& d : localData[i].deltasByChunk[chunkId])
+							{
+								setTopicWordCount(localData[j], d.tid, d.vid, global.coeff(d.tid, d.vid));
+							}
+						}
+					}
+
+					for (size_t i = 0; i < numWorkers; ++i) localData[i].deltasByChunk[chunkId].clear();
+				});
+				for (auto& r : res) r.get();
+				res.clear();
+
+				for (auto& diff : diffByChunk) globalState.numByTopic += diff;
+				gatherLLDelta(globalState, localData, numWorkers, false);
+				for (auto ll : llByChunk) globalState.llTopicWordDelta += ll;
+
+				res = pool.enqueueToAll([&](size_t threadId)
+				{
+					localData[threadId].numByTopic = globalState.numByTopic;
+				});
 			}
 			else if (_ps == ParallelScheme::partition)
 			{
@@ -425,17 +947,21 @@ namespace tomoto
 				{
 					size_t b = partitionId ? edd.vChunkOffset[partitionId - 1] : 0,
 						e = edd.vChunkOffset[partitionId];
-					globalState.numByTopicWord.block(0, b, globalState.numByTopicWord.rows(), e - b) = localData[partitionId].numByTopicWord;
+					globalState.numByTopicWord.middleCols(b, e - b) = localData[partitionId].numByTopicWord;
 				});
 				for (auto& r : res) r.get();
 				res.clear();
+				// each worker owns its columns, so the changes simply add up
+				gatherLLDelta(globalState, localData, pool.getNumWorkers(), true);
 
 				// make all count being positive
 				if (_TW != TermWeight::one)
 				{
-					globalState.numByTopicWord = globalState.numByTopicWord.cwiseMax(0);
+					clampNonNegative(globalState.numByTopicWord);
 				}
-				globalState.numByTopic = globalState.numByTopicWord.rowwise().sum();
+				globalState.numByTopic = rowSums(globalState.numByTopicWord);
+				// the partitions keep their own lists, so the one of globalState is rebuilt only if it is read
+				globalState.topicsByWord.clear();
 
 				res = pool.enqueueToAll([&](size_t threadId)
 				{
@@ -460,69 +986,172 @@ namespace tomoto
 		{
 		}
 
+		// sums fn(b, e) over [0, n) split into chunks, in parallel over cachedPool if it is ready
+		template<typename _Fn>
+		double sumInChunks(size_t n, _Fn fn) const
+		{
+			ThreadPool* pool = this->cachedPool.get();
+			const size_t numChunks = pool ? std::min(pool->getNumWorkers() * 4, n / 64 + 1) : 1;
+			if (numChunks <= 1) return fn(0, n);
+
+			std::vector<std::future<double>> res;
+			for (size_t i = 0; i < numChunks; ++i)
+			{
+				res.emplace_back(pool->enqueue([&, i](size_t)
+				{
+					return fn(n * i / numChunks, n * (i + 1) / numChunks);
+				}));
+			}
+			double ret = 0;
+			for (auto& r : res) ret += r.get();
+			return ret;
+		}
+
 		template<typename _DocIter>
 		double getLLDocs(_DocIter _first, _DocIter _last) const
 		{
-			double ll = 0;
+			const FLOAT alphaSum = alphas.sum();
 			// doc-topic distribution
-			for (; _first != _last; ++_first)
+			return sumInChunks(std::distance(_first, _last), [&](size_t b, size_t e)
 			{
-				auto& doc = *_first;
-				ll -= math::lgammaT(doc.getSumWordWeight() + alphas.sum()) - math::lgammaT(alphas.sum());
-				for (TID k = 0; k < K; ++k)
+				double ll = 0;
+				for (size_t i = b; i < e; ++i)
 				{
-					ll += math::lgammaT(doc.numByTopic[k] + alphas[k]) - math::lgammaT(alphas[k]);
+					auto& doc = _first[i];
+					ll -= math::lgammaT(doc.getSumWordWeight() + alphaSum) - math::lgammaT(alphaSum);
+					ll += math::lgammaSubtSum(alphas.data(), doc.numByTopic.data(), K);
 				}
-			}
-			return ll;
+				return ll;
+			});
 		}
 
 		double getLLRest(const _ModelState& ld) const
+		{
+			// topic-word distribution
+			return getLLTopicWord(ld);
+		}
+
+		// lgamma(c + eta) - lgamma(eta) of topic-word counts, for a whole column or a single count
+		struct LLTopicWordOp
+		{
+			FLOAT eta, lgammaEta;
+			const math::LgammaCountTable& table;
+
+			double operator()(int32_t c) const
+			{
+				return table(c);
+			}
+
+			double operator()(float c) const
+			{
+				return math::lgammaT(c + eta) - lgammaEta;
+			}
+
+			double operator()(const Eigen::Map<const Eigen::Matrix<int32_t, -1, 1>>& col) const
+			{
+				double ll = 0;
+				for (Eigen::Index k = 0; k < col.size(); ++k) ll += table(col[k]);
+				return ll;
+			}
+
+			double operator()(const Eigen::Map<const Eigen::Matrix<float, -1, 1>>& col) const
+			{
+				return math::lgammaSubtSum(eta, col.data(), col.size());
+			}
+		};
+
+		// log likelihood of the topic-word distribution, shared by derived models
+		double getLLTopicWord(const _ModelState& ld) const
 		{
 			double ll = 0;
 			const size_t V = this->realV;
-			// topic-word distribution
-			auto lgammaEta = math::lgammaT(eta);
 			ll += math::lgammaT(V*eta) * K;
 			for (TID k = 0; k < K; ++k)
 			{
 				ll -= math::lgammaT(ld.numByTopic[k] + V * eta);
-				for (VID v = 0; v < V; ++v)
-				{
-					if (!ld.numByTopicWord(k, v)) continue;
-					ll += math::lgammaT(ld.numByTopicWord(k, v) + eta) - lgammaEta;
-					assert(isfinite(ll));
-				}
 			}
-			return ll;
+
+			if (&ld != &this->globalState || std::isnan(cachedLLTopicWord)) return ll + getLLTopicWordCounts(ld);
+			return ll + cachedLLTopicWord;
+		}
+
+		// sum of lgamma(n_kv + eta) - lgamma(eta)
+		double getLLTopicWordCounts(const _ModelState& ld) const
+		{
+			LLTopicWordOp op{ eta, math::lgammaT(eta), etaCountTable };
+			double ll = sumInChunks(ld.numByTopicWord.cols(), [&](size_t b, size_t e)
+			{
+				return sumColumns(ld.numByTopicWord, b, e, op);
+			});
+			assert(std::isfinite(ll));
+			return ll;
+		}
+
+		// const methods, which may be called from many threads at once, only read the caches filled here
+		void fillCachedLL()
+		{
+			if (std::isnan(cachedLLDocs))
+			{
+				cachedLLDocs = static_cast<const DerivedClass*>(this)->template getLLDocs<>(this->docs.begin(), this->docs.end());
+			}
+			if (std::isnan(cachedLLTopicWord)) cachedLLTopicWord = getLLTopicWordCounts(this->globalState);
+			// the tracked changes should add up to a full recomputation, up to rounding
+			assert(std::abs(cachedLLDocs - static_cast<const DerivedClass*>(this)->template getLLDocs<>(this->docs.begin(), this->docs.end()))
+				<= 1e-4 * std::abs(cachedLLDocs) + 1e-2);
+			assert(std::abs(cachedLLTopicWord - getLLTopicWordCounts(this->globalState)) <= 1e-4 * std::abs(cachedLLTopicWord) + 1e-2);
 		}
 
 		double getLL() const
 		{
-			return static_cast<const DerivedClass*>(this)->template getLLDocs<>(this->docs.begin(), this->docs.end())
-				+ static_cast<const DerivedClass*>(this)->getLLRest(this->globalState);
+			const double llDocs = std::isnan(cachedLLDocs)
+				? static_cast<const DerivedClass*>(this)->template getLLDocs<>(this->docs.begin(), this->docs.end())
+				: cachedLLDocs;
+			return llDocs + static_cast<const DerivedClass*>(this)->getLLRest(this->globalState);
 		}
 
 		void prepareShared()
 		{
-			auto txZs = [](_DocType& doc) { return &doc.Zs; };
-			tvector<TID>::trade(sharedZs, 
-				makeTransformIter(this->docs.begin(), txZs),
-				makeTransformIter(this->docs.end(), txZs));
+			// Zs and wordWeights of a mapped model are already laid out in it
+			if (this->mappedFile) return;
+			// arrays are gathered anew, since those of docs prepared before may be views of the current ones
+			std::vector<uint64_t> newZs;
+			this->tradeDocArrays(newZs, [](_DocType& doc) { return &doc.Zs.getBlocks(); });
+			sharedZs.swap(newZs);
 			if (_TW != TermWeight::one)
 			{
-				auto txWeights = [](_DocType& doc) { return &doc.wordWeights; };
-				tvector<FLOAT>::trade(sharedWordWeights,
-					makeTransformIter(this->docs.begin(), txWeights),
-					makeTransformIter(this->docs.end(), txWeights));
+				std::vector<FLOAT> newWeights;
+				this->tradeDocArrays(newWeights, [](_DocType& doc) { return &doc.wordWeights; });
+				sharedWordWeights.swap(newWeights);
+			}
+		}
+
+		// gives docs zero Zs and unit wordWeights as views of the shared arrays, so that docs being initialized allocate nothing of their own
+		void layoutShared()
+		{
+			const uint32_t width = PackedVector<TID>::widthFor(K);
+			std::vector<size_t> zOffsets(this->docs.size() + 1);
+			for (size_t i = 0; i < this->docs.size(); ++i)
+			{
+				zOffsets[i + 1] = zOffsets[i] + PackedVector<TID>::numBlocks(this->docs[i].words.size(), width);
+			}
+			std::vector<uint64_t>(zOffsets.back()).swap(sharedZs);
+			if (_TW != TermWeight::one) std::vector<FLOAT>(this->words.size(), 1).swap(sharedWordWeights);
+			for (size_t i = 0; i < this->docs.size(); ++i)
+			{
+				auto& doc = this->docs[i];
+				doc.Zs = PackedVector<TID>{ sharedZs.data() + zOffsets[i], doc.words.size(), width };
+				if (_TW != TermWeight::one) doc.wordWeights = tvector<FLOAT>{ sharedWordWeights.data() + this->wOffsetByDoc[i], doc.words.size() };
 			}
 		}
 		
 		void prepareDoc(_DocType& doc, WeightType* topicDocPtr, size_t wordSize) const
 		{
-			sortAndWriteOrder(doc.words, doc.wOrder);
+			if (this->keepWordOrder) sortAndWriteOrder(doc.words, doc.wOrder);
+			else std::sort(doc.words.begin(), doc.words.end());
 			doc.numByTopic.init((m_flags & flags::continuous_doc_data) ? topicDocPtr : nullptr, K);
-			doc.Zs = tvector<TID>(wordSize);
+			// Zs laid out by layoutShared() are kept
+			const uint32_t width = PackedVector<TID>::widthFor(K);
+			if (doc.Zs.size() != wordSize || doc.Zs.getWidth() != width) doc.Zs = PackedVector<TID>(wordSize, width);
 			if(_TW != TermWeight::one) doc.wordWeights.resize(wordSize, 1);
 		}
 
@@ -548,9 +1177,13 @@ namespace tomoto
 			if (initDocs)
 			{
 				this->globalState.numByTopic = Eigen::Matrix<WeightType, -1, 1>::Zero(K);
-				this->globalState.numByTopicWord = Eigen::Matrix<WeightType, -1, -1>::Zero(K, V);
+				this->globalState.numByTopicWord = _ModelState::TopicWordMatrix::Zero(K, V);
 			}
 			if(m_flags & flags::continuous_doc_data) numByTopicDoc = Eigen::Matrix<WeightType, -1, -1>::Zero(K, this->docs.size());
+			// integer counts of TermWeight::one are looked up from the table
+			etaCountTable = _TW == TermWeight::one ? math::LgammaCountTable{ eta } : math::LgammaCountTable{};
+			discardDeferred();
+			invalidateCachedLL();
 		}
 
 		struct Generator
@@ -563,27 +1196,63 @@ namespace tomoto
 			return Generator{ std::uniform_int_distribution<TID>{0, (TID)(K - 1)} };
 		}
 
-		template<bool _Infer>
-		void updateStateWithDoc(Generator& g, _ModelState& ld, RandGen& rgs, _DocType& doc, size_t i) const
+		TID sampleInitialTopic(Generator& g, RandGen& rgs, VID w) const
 		{
-			auto& z = doc.Zs[i];
-			auto w = doc.words[i];
 			if (etaByTopicWord.size())
 			{
 				auto col = etaByTopicWord.col(w);
-				z = sample::sampleFromDiscrete(col.data(), col.data() + col.size(), rgs);
-			}
-			else
-			{
-				z = g.theta(rgs);
+				return sample::sampleFromDiscrete(col.data(), col.data() + col.size(), rgs);
 			}
+			return g.theta(rgs);
+		}
+
+		template<bool _Infer>
+		void updateStateWithDoc(Generator& g, _ModelState& ld, RandGen& rgs, _DocType& doc, size_t i) const
+		{
+			auto w = doc.words[i];
+			const TID z = sampleInitialTopic(g, rgs, w);
+			doc.Zs.set(i, z);
 			addWordTo<1>(ld, doc, i, w, z);
 		}
 
 		template<bool _Infer, typename _Generator>
 		void initializeDocState(_DocType& doc, WeightType* topicDocPtr, _Generator& g, _ModelState& ld, RandGen& rgs) const
 		{
-			std::vector<uint32_t> tf(this->realV);
+			initializeDocWords(doc, topicDocPtr, g, [&](_Generator& sg, size_t i)
+			{
+				static_cast<const DerivedClass*>(this)->template updateStateWithDoc<_Infer>(sg, ld, rgs, doc, i);
+			});
+		}
+
+		// weights of the words of doc in the vocabulary by vocabWeights, doc should have been prepared by prepareDoc()
+		void updateWordWeights(_DocType& doc) const
+		{
+			if (_TW == TermWeight::one) return;
+			for (size_t i = 0; i < doc.words.size(); ++i)
+			{
+				if (doc.words[i] >= this->realV) continue;
+				if (_TW == TermWeight::idf)
+				{
+					doc.wordWeights[i] = vocabWeights[doc.words[i]];
+				}
+				else if (_TW == TermWeight::idf_one)
+				{
+					doc.wordWeights[i] = (vocabWeights[doc.words[i]] + 1) / 2;
+				}
+				else if (_TW == TermWeight::pmi)
+				{
+					// words are sorted by prepareDoc(), so the occurrences of a word are in a row
+					auto r = std::equal_range(doc.words.begin(), doc.words.end(), doc.words[i]);
+					const size_t tf = r.second - r.first;
+					doc.wordWeights[i] = std::max((FLOAT)log(tf / vocabWeights[doc.words[i]] / doc.words.size()), (FLOAT)0);
+				}
+			}
+		}
+
+		// prepares doc and the weights of its words, then calls update(generator, i) for each word in the vocabulary
+		template<typename _Generator, typename _Fn>
+		void initializeDocWords(_DocType& doc, WeightType* topicDocPtr, _Generator& g, _Fn update) const
+		{
 			static_cast<const DerivedClass*>(this)->prepareDoc(doc, topicDocPtr, doc.words.size());
 			_Generator g2;
 			_Generator* selectedG = &g;
@@ -592,30 +1261,87 @@ namespace tomoto
 				g2 = static_cast<const DerivedClass*>(this)->makeGeneratorForInit(&doc);
 				selectedG = &g2;
 			}
-			if (_TW == TermWeight::pmi)
+			updateWordWeights(doc);
+			for (size_t i = 0; i < doc.words.size(); ++i)
 			{
-				std::fill(tf.begin(), tf.end(), 0);
-				for (auto& w : doc.words) if(w < this->realV) ++tf[w];
+				if (doc.words[i] >= this->realV) continue;
+				update(*selectedG, i);
 			}
+			doc.updateSumWordWeight(this->realV);
+		}
 
-			for (size_t i = 0; i < doc.words.size(); ++i)
+		/*
+		initializes the docs from firstDoc, split into a chunk for each worker of cachedPool.
+		each chunk draws from its own random stream and records its topic-word counts as deltas bucketed by vid,
+		so that the buckets are added to globalState in parallel at the end, without a (K, V) matrix per chunk.
+		counts of doc i are laid from topicDocBase + K * i if it is given.
+		*/
+		void initializeDocs(size_t firstDoc, WeightType* topicDocBase)
+		{
+			const size_t n = this->docs.size() - firstDoc;
+			const size_t numChunks = this->numChunksFor(n);
+			auto& gs = this->globalState;
+
+			decltype(static_cast<DerivedClass*>(this)->makeGeneratorForInit(nullptr)) generator;
+			if (!(m_flags & flags::generator_by_doc)) generator = static_cast<DerivedClass*>(this)->makeGeneratorForInit(nullptr);
+			// a single chunk counts into globalState directly with the random stream of the model
+			if (numChunks <= 1)
 			{
-				if (doc.words[i] >= this->realV) continue;
-				if (_TW == TermWeight::idf)
+				for (size_t i = firstDoc; i < this->docs.size(); ++i)
 				{
-					doc.wordWeights[i] = vocabWeights[doc.words[i]];
+					initializeDocState<false>(this->docs[i], topicDocBase ? topicDocBase + K * i : nullptr, generator, gs, this->rg);
 				}
-				if (_TW == TermWeight::idf_one)
+				return;
+			}
+
+			std::vector<_ModelState> localData(numChunks);
+			std::vector<RandGen> localRG;
+			for (auto& ld : localData)
+			{
+				ld.numByTopic = Eigen::Matrix<WeightType, -1, 1>::Zero(K);
+				ld.deltasByChunk.resize(numChunks);
+				localRG.emplace_back(RandGen{ this->rg() });
+			}
+
+			this->forEachChunk(numChunks, n, [&](size_t c, size_t b, size_t e)
+			{
+				auto g = generator;
+				auto& ld = localData[c];
+				for (size_t i = firstDoc + b; i < firstDoc + e; ++i)
 				{
-					doc.wordWeights[i] = (vocabWeights[doc.words[i]] + 1) / 2;
+					auto& doc = this->docs[i];
+					initializeDocWords(doc, topicDocBase ? topicDocBase + K * i : nullptr, g, [&](decltype(generator)& sg, size_t w)
+					{
+						const VID vid = doc.words[w];
+						const TID z = sampleInitialTopic(sg, localRG[c], vid);
+						const WeightType weight = _TW != TermWeight::one ? doc.wordWeights[w] : 1;
+						doc.Zs.set(w, z);
+						doc.numByTopic[z] += weight;
+						ld.numByTopic[z] += weight;
+						auto& deltas = ld.deltasByChunk[vid % numChunks];
+						// words of a doc are sorted, so repeats of a word drawing the same topic are merged
+						if (!deltas.empty() && deltas.back().vid == vid && deltas.back().tid == z) deltas.back().delta += weight;
+						else deltas.push_back({ vid, z, weight });
+					});
 				}
-				else if (_TW == TermWeight::pmi)
+			});
+
+			for (auto& ld : localData) gs.numByTopic += ld.numByTopic;
+			// bucket c holds the words of vid % numChunks == c, so buckets never touch the same column
+			this->forEachChunk(numChunks, numChunks, [&](size_t c, size_t, size_t)
+			{
+				for (auto& ld : localData)
 				{
-					doc.wordWeights[i] = std::max((FLOAT)log(tf[doc.words[i]] / vocabWeights[doc.words[i]] / doc.words.size()), (FLOAT)0);
+					for (auto& d : ld.deltasByChunk[c])
+					{
+						auto& cnt = gs.numByTopicWord(d.tid, d.vid);
+						const WeightType before = cnt;
+						cnt += d.delta;
+						updateTopicsByWord(gs, d.tid, d.vid, before <= 0, cnt <= 0);
+					}
+					std::vector<typename _ModelState::TopicWordDelta>{}.swap(ld.deltasByChunk[c]);
 				}
-				static_cast<const DerivedClass*>(this)->template updateStateWithDoc<_Infer>(*selectedG, ld, rgs, doc, i);
-			}
-			doc.updateSumWordWeight(this->realV);
+			});
 		}
 
 		std::vector<size_t> _getTopicsCount() const
@@ -637,14 +1363,114 @@ namespace tomoto
 			const size_t V = this->realV;
 			std::vector<FLOAT> ret(V);
 			FLOAT sum = this->globalState.numByTopic[tid] + V * eta;
-			auto r = this->globalState.numByTopicWord.row(tid);
 			for (size_t v = 0; v < V; ++v)
 			{
-				ret[v] = (r[v] + eta) / sum;
+				ret[v] = (this->globalState.numByTopicWord.coeff(tid, v) + eta) / sum;
 			}
 			return ret;
 		}
 
+		/*
+		state of a document under inference, layered over the read-only globalState.
+		only the columns of the words in the document are kept, instead of a copy of the whole globalState.
+		*/
+		struct InferenceOverlay
+		{
+			_ModelState ld; // numByTopic and scratch buffers, numByTopicWord is left empty
+			Eigen::Matrix<WeightType, -1, -1> numByTopicWord; // Dim: (Topic, vids), global counts plus those of the document
+			std::vector<VID> vids; // distinct words of the document
+			std::vector<uint32_t> colOfWord; // column in numByTopicWord of each word of the document
+		};
+
+		template<int INC>
+		inline void addWordToOverlay(InferenceOverlay& ov, _DocType& doc, uint32_t pid, TID tid) const
+		{
+			constexpr bool DEC = INC < 0 && _TW != TermWeight::one;
+			typename std::conditional<_TW != TermWeight::one, float, int32_t>::type weight
+				= _TW != TermWeight::one ? doc.wordWeights[pid] : 1;
+
+			updateCnt<DEC>(doc.numByTopic[tid], INC * weight);
+			updateCnt<DEC>(ov.ld.numByTopic[tid], INC * weight);
+			updateCnt<DEC>(ov.numByTopicWord(tid, ov.colOfWord[pid]), INC * weight);
+		}
+
+		template<typename _Generator>
+		void initializeInferenceOverlay(_DocType& doc, _Generator& g, InferenceOverlay& ov, RandGen& rgs) const
+		{
+			ov.ld.numByTopic = this->globalState.numByTopic;
+			ov.ld.zLikelihood = Eigen::Matrix<FLOAT, -1, 1>::Zero(K);
+			ov.vids.clear();
+			ov.colOfWord.clear();
+			initializeDocWords(doc, nullptr, g, [&](_Generator& sg, size_t i)
+			{
+				// columns are built on the first word, after prepareDoc() has sorted the words
+				if (ov.colOfWord.empty())
+				{
+					ov.colOfWord.resize(doc.words.size(), -1);
+					for (size_t j = 0; j < doc.words.size(); ++j)
+					{
+						if (doc.words[j] >= this->realV) continue;
+						if (ov.vids.empty() || ov.vids.back() != doc.words[j]) ov.vids.emplace_back(doc.words[j]);
+						ov.colOfWord[j] = ov.vids.size() - 1;
+					}
+					ov.numByTopicWord.resize(K, ov.vids.size());
+					for (size_t u = 0; u < ov.vids.size(); ++u)
+					{
+						ov.numByTopicWord.col(u) = this->globalState.numByTopicWord.col(ov.vids[u]);
+					}
+				}
+				const TID z = sampleInitialTopic(sg, rgs, doc.words[i]);
+				doc.Zs.set(i, z);
+				addWordToOverlay<1>(ov, doc, i, z);
+			});
+			static_cast<const DerivedClass*>(this)->prepareAlphasOfDoc(ov.ld, doc);
+		}
+
+		template<bool _asymEta>
+		void sampleDocumentOnOverlay(_DocType& doc, InferenceOverlay& ov, RandGen& rgs) const
+		{
+			auto etaHelper = this->template getEtaHelper<_asymEta>();
+			const FLOAT* alphaDoc = static_cast<const DerivedClass*>(this)->getAlphasOfDoc(ov.ld, doc);
+			for (size_t w = 0; w < doc.words.size(); ++w)
+			{
+				const VID vid = doc.words[w];
+				if (vid >= this->realV) continue;
+				addWordToOverlay<-1>(ov, doc, w, doc.Zs[w]);
+				const sample::LikelihoodTerms<WeightType, _asymEta> terms{
+					doc.numByTopic.data(), alphaDoc,
+					ov.numByTopicWord.col(ov.colOfWord[w]).data(), etaHelper.getEtaData(vid),
+					ov.ld.numByTopic.data(), etaHelper.getEtaSumData()
+				};
+				const TID z = sample::sampleFromLikelihoods(ov.ld.zLikelihood.data(), terms, K, rgs);
+				doc.Zs.set(w, z);
+				addWordToOverlay<1>(ov, doc, w, z);
+			}
+		}
+
+		// getLLRest() of globalState with the document added minus that of globalState, from the touched counts only
+		double getLLRestDelta(const InferenceOverlay& ov) const
+		{
+			const size_t V = this->realV;
+			const auto& gs = this->globalState;
+			double ll = 0;
+			for (TID k = 0; k < K; ++k)
+			{
+				if (ov.ld.numByTopic[k] == gs.numByTopic[k]) continue;
+				ll -= math::lgammaT(ov.ld.numByTopic[k] + V * eta) - math::lgammaT(gs.numByTopic[k] + V * eta);
+			}
+
+			LLTopicWordOp op{ eta, math::lgammaT(eta), etaCountTable };
+			for (size_t u = 0; u < ov.vids.size(); ++u)
+			{
+				for (TID k = 0; k < K; ++k)
+				{
+					const WeightType c = ov.numByTopicWord(k, u), g = gs.numByTopicWord.coeff(k, ov.vids[u]);
+					if (c != g) ll += op(c) - op(g);
+				}
+			}
+			return ll;
+		}
+
 		template<bool _Together, ParallelScheme _ps, typename _Iter>
 		std::vector<double> _infer(_Iter docFirst, _Iter docLast, size_t maxIter, FLOAT tolerance, size_t numWorkers) const
 		{
@@ -715,24 +1541,23 @@ namespace tomoto
 			}
 			else
 			{
+				// models sampling the global level have flags::shared_state, so globalState stays read-only here
 				ThreadPool pool{ numWorkers, numWorkers * 8 };
-				ExtraDocData edd;
+				std::vector<InferenceOverlay> overlays(pool.getNumWorkers());
 				std::vector<std::future<double>> res;
-				const double gllRest = static_cast<const DerivedClass*>(this)->getLLRest(this->globalState);
 				for (auto d = docFirst; d != docLast; ++d)
 				{
 					res.emplace_back(pool.enqueue([&, d](size_t threadId)
 					{
 						RandGen rgc{};
-						auto tmpState = this->globalState;
-						initializeDocState<true>(*d, nullptr, generator, tmpState, rgc);
+						auto& ov = overlays[threadId];
+						initializeInferenceOverlay(*d, generator, ov, rgc);
 						for (size_t i = 0; i < maxIter; ++i)
 						{
-							static_cast<const DerivedClass*>(this)->template sampleDocument<ParallelScheme::none, true>(*d, edd, -1, tmpState, rgc, i);
-							static_cast<const DerivedClass*>(this)->template sampleGlobalLevel<>(
-								nullptr, &tmpState, &rgc, &*d, &*d + 1);
+							if (etaByTopicWord.size()) sampleDocumentOnOverlay<true>(*d, ov, rgc);
+							else sampleDocumentOnOverlay<false>(*d, ov, rgc);
 						}
-						double ll = static_cast<const DerivedClass*>(this)->getLLRest(tmpState) - gllRest;
+						double ll = getLLRestDelta(ov);
 						ll += static_cast<const DerivedClass*>(this)->template getLLDocs<>(&*d, &*d + 1);
 						return ll;
 					}));
@@ -743,6 +1568,378 @@ namespace tomoto
 			}
 		}
 
+		// p(word | topic) of the model, Dim: (Topic, Vocabs)
+		Eigen::Matrix<FLOAT, -1, -1> getNormalizedTopicWord() const
+		{
+			const auto& gs = this->globalState;
+			Eigen::Matrix<FLOAT, -1, -1> ret{ (Eigen::Index)K, (Eigen::Index)this->realV };
+			for (size_t v = 0; v < this->realV; ++v)
+			{
+				if (etaByTopicWord.size())
+				{
+					ret.col(v) = (gs.numByTopicWord.col(v).array().template cast<FLOAT>() + etaByTopicWord.col(v).array())
+						/ (gs.numByTopic.array().template cast<FLOAT>() + etaSumByTopic.array());
+				}
+				else
+				{
+					ret.col(v) = (gs.numByTopicWord.col(v).array().template cast<FLOAT>() + eta)
+						/ (gs.numByTopic.array().template cast<FLOAT>() + eta * this->realV);
+				}
+			}
+			return ret;
+		}
+
+		/*
+		infers a document with the topic-word distribution fixed to topicWord, so that nothing but the document is updated.
+		returns the log likelihood of its topics and of its words given the topics.
+		*/
+		double inferWithTopicWord(_DocType& doc, const Eigen::Matrix<FLOAT, -1, -1>& topicWord, _ModelState& ld, size_t maxIter) const
+		{
+			RandGen rgs{};
+			auto generator = static_cast<const DerivedClass*>(this)->makeGeneratorForInit(nullptr);
+			initializeDocWords(doc, nullptr, generator, [&](Generator& g, size_t i)
+			{
+				const TID z = sampleInitialTopic(g, rgs, doc.words[i]);
+				doc.Zs.set(i, z);
+				doc.numByTopic[z] += doc.getWordWeight(i);
+			});
+			static_cast<const DerivedClass*>(this)->prepareAlphasOfDoc(ld, doc);
+			auto alphaDoc = Eigen::Map<const Eigen::Array<FLOAT, -1, 1>>{
+				static_cast<const DerivedClass*>(this)->getAlphasOfDoc(ld, doc), (Eigen::Index)K };
+			ld.zLikelihood.resize(K);
+			auto& zLikelihood = ld.zLikelihood;
+			for (size_t it = 0; it < maxIter; ++it)
+			{
+				for (size_t w = 0; w < doc.words.size(); ++w)
+				{
+					const VID vid = doc.words[w];
+					if (vid >= this->realV) continue;
+					updateCnt<_TW != TermWeight::one>(doc.numByTopic[doc.Zs[w]], -doc.getWordWeight(w));
+					zLikelihood = (doc.numByTopic.array().template cast<FLOAT>() + alphaDoc) * topicWord.col(vid).array();
+					sample::prefixSum(zLikelihood.data(), K);
+					const TID z = sample::sampleFromDiscreteAcc(zLikelihood.data(), zLikelihood.data() + K, rgs);
+					doc.Zs.set(w, z);
+					doc.numByTopic[z] += doc.getWordWeight(w);
+				}
+			}
+
+			double ll = static_cast<const DerivedClass*>(this)->template getLLDocs<>(&doc, &doc + 1);
+			for (size_t w = 0; w < doc.words.size(); ++w)
+			{
+				if (doc.words[w] >= this->realV) continue;
+				ll += doc.getWordWeight(w) * std::log(topicWord(doc.Zs[w], doc.words[w]));
+			}
+			return ll;
+		}
+
+		class LDAInferenceContext : public InferenceContext
+		{
+			const LDAModel* mdl;
+			Eigen::Matrix<FLOAT, -1, -1> topicWord;
+			std::vector<_ModelState> localData; // scratch of each worker, and of the caller thread at last
+			ThreadPool pool;
+		public:
+			LDAInferenceContext(const LDAModel* _mdl, size_t numWorkers)
+				: mdl(_mdl), topicWord(_mdl->getNormalizedTopicWord()), localData(numWorkers + 1),
+				pool(numWorkers > 1 ? numWorkers : 0)
+			{
+				for (auto& ld : localData) ld.zLikelihood.resize(mdl->K);
+			}
+
+			std::vector<double> infer(const std::vector<DocumentBase*>& docs, size_t maxIter) override
+			{
+				std::vector<double> ret(docs.size());
+				auto inferDoc = [&](size_t i, _ModelState& ld)
+				{
+					ret[i] = mdl->inferWithTopicWord(*static_cast<_DocType*>(docs[i]), topicWord, ld, maxIter);
+				};
+
+				// small batches are run on the caller thread, which avoids the latency of waking workers up
+				if (docs.size() <= 1 || !pool.getNumWorkers())
+				{
+					for (size_t i = 0; i < docs.size(); ++i) inferDoc(i, localData.back());
+					return ret;
+				}
+
+				std::atomic<size_t> next{ 0 };
+				std::vector<std::future<void>> res;
+				const size_t numTasks = std::min(pool.getNumWorkers(), docs.size());
+				for (size_t t = 0; t < numTasks; ++t)
+				{
+					res.emplace_back(pool.enqueue([&](size_t threadId)
+					{
+						for (size_t i; (i = next++) < docs.size();) inferDoc(i, localData[threadId]);
+					}));
+				}
+				for (auto& r : res) r.get();
+				return ret;
+			}
+		};
+
+		// expected topic-word counts of a batch gathered by a worker, over the columns of the words it has seen
+		struct OnlineAccumulator
+		{
+			std::vector<FLOAT> topicWord; // (K, vids) in column-major order
+			std::vector<VID> vids;
+			std::vector<uint32_t> colOfWord; // column of each vid in topicWord, -1 for unseen ones
+			double ll = 0;
+			size_t numWords = 0;
+
+			FLOAT* col(VID vid, size_t K)
+			{
+				auto& c = colOfWord[vid];
+				if (c == (uint32_t)-1)
+				{
+					c = vids.size();
+					vids.emplace_back(vid);
+					topicWord.resize(topicWord.size() + K);
+				}
+				return &topicWord[c * K];
+			}
+		};
+
+		/*
+		SCVB0 on a document, against the expected counts of the previous batch given as onlineTopicWord and invTopic.
+		the document keeps its own expected counts in theta, which are left in doc.numByTopic rounded.
+		responsibilities of its words in the last pass are added into acc.
+		* Foulds, J., Boyles, L., DuBois, C., Smyth, P., & Welling, M. (2013). Stochastic collapsed variational Bayesian inference for latent Dirichlet allocation. In Proceedings of the 19th ACM SIGKDD (pp. 446-454).
+		*/
+		template<bool _asymEta>
+		void inferDocOnline(_DocType& doc, const Eigen::Array<FLOAT, -1, 1>& invTopic, _ModelState& ld, OnlineAccumulator& acc, size_t docIteration) const
+		{
+			auto etaHelper = this->template getEtaHelper<_asymEta>();
+			static_cast<const DerivedClass*>(this)->prepareAlphasOfDoc(ld, doc);
+			auto alphaDoc = Eigen::Map<const Eigen::Array<FLOAT, -1, 1>>{
+				static_cast<const DerivedClass*>(this)->getAlphasOfDoc(ld, doc), (Eigen::Index)K };
+			const FLOAT n = doc.getSumWordWeight(), logDenom = std::log(n + alphaDoc.sum());
+			Eigen::Array<FLOAT, -1, 1> theta = Eigen::Array<FLOAT, -1, 1>::Constant(K, n / K), gamma{ K };
+			size_t t = 0;
+			for (size_t it = 0; it < docIteration; ++it)
+			{
+				const bool last = it + 1 == docIteration;
+				for (size_t w = 0; w < doc.words.size(); ++w)
+				{
+					const VID vid = doc.words[w];
+					if (vid >= this->realV) continue;
+					gamma = (onlineScale * onlineTopicWord.col(vid).array() + etaHelper.getEta(vid)) * invTopic * (theta + alphaDoc);
+					const FLOAT sum = gamma.sum();
+					gamma /= sum;
+					// step size of theta by the paper
+					const FLOAT rho = std::pow(10 + (FLOAT)t++, (FLOAT)-0.9);
+					theta = (1 - rho) * theta + rho * n * gamma;
+					if (!last) continue;
+					acc.ll += std::log(sum) - logDenom;
+					++acc.numWords;
+					Eigen::Map<Eigen::Array<FLOAT, -1, 1>>{ acc.col(vid, K), (Eigen::Index)K } += gamma;
+				}
+			}
+			for (TID k = 0; k < K; ++k) doc.numByTopic[k] = (WeightType)std::round(theta[k]);
+		}
+
+		// expected counts start from globalState, or from random ones which break the symmetry of topics if it is empty
+		void initOnlineState()
+		{
+			const size_t V = this->realV;
+			onlineNumWords = std::accumulate(this->vocabFrequencies.begin(), this->vocabFrequencies.begin() + V, (size_t)0);
+			onlineTopicWord.resize(K, V);
+			onlineScale = 1;
+			onlineStale = false;
+			const auto& gs = this->globalState;
+			if (gs.numByTopic.sum() > 0)
+			{
+				for (size_t v = 0; v < V; ++v) onlineTopicWord.col(v) = gs.numByTopicWord.col(v).template cast<FLOAT>();
+			}
+			else
+			{
+				std::uniform_real_distribution<FLOAT> dist{ 0, 2 * (FLOAT)onlineNumWords / K / std::max(V, (size_t)1) };
+				for (size_t i = 0; i < (size_t)onlineTopicWord.size(); ++i) onlineTopicWord.data()[i] = dist(this->rg);
+			}
+			onlineTopicSum = onlineTopicWord.rowwise().sum();
+		}
+
+		// multiplies the expected counts by decay, folding onlineScale into them before it gets too small for FLOAT
+		void decayOnlineState(FLOAT decay)
+		{
+			static constexpr FLOAT minScale = 1e-12;
+			onlineScale *= decay;
+			if (onlineScale >= minScale) return;
+			onlineTopicWord *= onlineScale;
+			onlineTopicSum *= onlineScale;
+			onlineScale = 1;
+		}
+
+		// writes the expected counts into globalState rounded, so that the rest of the model sees the result of trainOnline()
+		void syncOnlineState()
+		{
+			auto& gs = this->globalState;
+			for (size_t v = 0; v < this->realV; ++v)
+			{
+				for (TID k = 0; k < K; ++k) setTopicWordCount(gs, k, v, (WeightType)std::round(onlineScale * onlineTopicWord(k, v)));
+			}
+			gs.numByTopic = rowSums(gs.numByTopicWord);
+			gs.topicsByWord.clear();
+			onlineStale = false;
+			invalidateCachedLL();
+		}
+
+		/*
+		brings globalState up to date with the training deferred so far.
+		const readers call it too, so that only the first of them after training does the work.
+		*/
+		void flushDeferred(bool training = false) const
+		{
+			std::lock_guard<std::mutex> lock{ deferredMutex };
+			auto self = const_cast<LDAModel*>(this);
+			if (onlineStale) self->syncOnlineState();
+			if (training || !pendingOptimizer.valid()) return;
+			try
+			{
+				self->applyPendingOptimizer();
+			}
+			catch (const exception::TrainingError& e)
+			{
+				std::cerr << e.what() << std::endl;
+				static_cast<DerivedClass*>(self)->restoreFromTrainingError(e, *this->cachedPool, nullptr, nullptr);
+			}
+		}
+
+		void discardDeferred()
+		{
+			std::lock_guard<std::mutex> lock{ deferredMutex };
+			discardPendingOptimizer();
+			onlineTopicWord.resize(0, 0);
+			onlineStale = false;
+		}
+
+		/*
+		updates priors of documents by a stochastic step of size rho on the docs of a batch, which stand for numDocs docs.
+		priors of LDA are left fixed.
+		*/
+		template<typename _DocIter>
+		void updatePriorOnline(ThreadPool& pool, _ModelState* localData, _DocIter first, _DocIter last, FLOAT rho, FLOAT numDocs)
+		{
+		}
+
+		// weights of vids in [firstVid, realV) from the docs, those of the others are left as they are
+		void updateVocabWeights(size_t firstVid)
+		{
+			const size_t V = this->realV;
+			std::vector<uint32_t> df;
+			uint32_t totCf;
+
+			// calculate weighting
+			if (_TW != TermWeight::one)
+			{
+				// each chunk counts into its own df, marking words by the last doc having them
+				const size_t numChunks = this->numChunksFor(this->docs.size());
+				std::vector<std::vector<uint32_t>> dfByChunk(numChunks);
+				this->forEachChunk(numChunks, this->docs.size(), [&](size_t c, size_t b, size_t e)
+				{
+					auto& cdf = dfByChunk[c];
+					cdf.resize(V);
+					std::vector<size_t> lastDoc(V, -1);
+					for (size_t i = b; i < e; ++i)
+					{
+						for (auto w : this->docs[i].words)
+						{
+							if (w < firstVid || w >= V || lastDoc[w] == i) continue;
+							lastDoc[w] = i;
+							++cdf[w];
+						}
+					}
+				});
+				df.swap(dfByChunk[0]);
+				for (size_t c = 1; c < numChunks; ++c)
+				{
+					for (size_t w = firstVid; w < V; ++w) df[w] += dfByChunk[c][w];
+				}
+				totCf = accumulate(this->vocabFrequencies.begin(), this->vocabFrequencies.end(), 0);
+			}
+			if (_TW == TermWeight::idf || _TW == TermWeight::idf_one)
+			{
+				vocabWeights.resize(V);
+				for (size_t i = firstVid; i < V; ++i)
+				{
+					vocabWeights[i] = log(this->docs.size() / (FLOAT)df[i]);
+				}
+			}
+			else if (_TW == TermWeight::pmi)
+			{
+				vocabWeights.resize(V);
+				for (size_t i = firstVid; i < V; ++i)
+				{
+					vocabWeights[i] = this->vocabFrequencies[i] / (float)totCf;
+				}
+			}
+		}
+
+		/*
+		weighs the words of docs [0, lastDoc) again by the current vocabWeights, and recounts globalState from their topics.
+		the counts of docs from lastDoc are left to initializeDocs().
+		*/
+		void reweighDocs(size_t lastDoc)
+		{
+			auto& gs = this->globalState;
+			gs.numByTopic.setZero();
+			gs.numByTopicWord = _ModelState::TopicWordMatrix::Zero(K, this->realV);
+			for (size_t i = 0; i < lastDoc; ++i)
+			{
+				auto& doc = this->docs[i];
+				updateWordWeights(doc);
+				doc.numByTopic.setZero();
+				for (size_t w = 0; w < doc.words.size(); ++w)
+				{
+					if (doc.words[w] >= this->realV) continue;
+					addWordTo<1>(gs, doc, w, doc.words[w], doc.Zs[w]);
+				}
+				doc.updateSumWordWeight(this->realV);
+			}
+		}
+
+		/*
+		grows the parameters of documents for the docs from firstDoc, which are not prepared yet.
+		LDA has nothing to grow.
+		*/
+		void extendParameters(size_t firstDoc)
+		{
+		}
+
+		size_t _prepareNewDocs(size_t firstDoc, size_t minWordCnt)
+		{
+			const size_t oldV = this->realV;
+			const size_t added = this->addNewWords(minWordCnt);
+			this->realN = this->countRealN();
+
+			auto& gs = this->globalState;
+			gs.numByTopicWord.conservativeResize(K, this->realV);
+			gs.topicsByWord.clear();
+			static_cast<DerivedClass*>(this)->prepareWordPriors();
+			if (_TW == TermWeight::one)
+			{
+				static_cast<DerivedClass*>(this)->updateVocabWeights(oldV);
+			}
+			else
+			{
+				// df of the old words and the totals have changed too, so every word is weighed again
+				static_cast<DerivedClass*>(this)->updateVocabWeights(0);
+				static_cast<DerivedClass*>(this)->reweighDocs(firstDoc);
+			}
+			static_cast<DerivedClass*>(this)->extendParameters(firstDoc);
+
+			static_cast<DerivedClass*>(this)->initializeDocs(firstDoc, nullptr);
+			// counts of all docs are laid out again, since the matrix is resized
+			if (m_flags & flags::continuous_doc_data)
+			{
+				numByTopicDoc = Eigen::Matrix<WeightType, -1, -1>::Zero(K, this->docs.size());
+				static_cast<DerivedClass*>(this)->updateDocs();
+			}
+			static_cast<DerivedClass*>(this)->updateWeakArray();
+			static_cast<DerivedClass*>(this)->prepareShared();
+			eddTrain.vChunkOffset.clear();
+			invalidateCachedLL();
+			return added;
+		}
+
 		DEFINE_SERIALIZER(vocabWeights, alpha, alphas, eta, K);
 
 	public:
@@ -755,11 +1952,19 @@ namespace tomoto
 			alphas = Eigen::Matrix<FLOAT, -1, 1>::Constant(K, alpha);
 		}
 
+		~LDAModel()
+		{
+			// an optimizer left running reads the model from its own thread
+			discardPendingOptimizer();
+		}
+
 		GETTER(K, size_t, K);
 		GETTER(Alpha, FLOAT, alpha);
 		GETTER(Eta, FLOAT, eta);
 		GETTER(OptimInterval, size_t, optimInterval);
 		GETTER(BurnInIteration, size_t, burnIn);
+		GETTER(OptimStaleness, size_t, optimStaleness);
+		GETTER(Sampler, Sampler, sampler);
 
 		FLOAT getAlpha(TID k1) const override { return alphas[k1]; }
 
@@ -778,16 +1983,148 @@ namespace tomoto
 			burnIn = iteration;
 		}
 
+		void setOptimStaleness(size_t staleness) override
+		{
+			optimStaleness = staleness;
+		}
+
+		void setSampler(Sampler _sampler) override
+		{
+			sampler = _sampler;
+		}
+
+		int train(size_t iteration, size_t numWorkers, ParallelScheme ps) override
+		{
+			int ret;
+			try
+			{
+				ret = BaseClass::train(iteration, numWorkers, ps);
+			}
+			catch (...)
+			{
+				discardPendingOptimizer();
+				throw;
+			}
+			// an optimizer still running is kept for the next call, see optimStaleness
+			if (ret < 0) discardPendingOptimizer();
+			else fillCachedLL();
+			return ret;
+		}
+
+		int train(size_t iteration, size_t numWorkers, Sampler _sampler, ParallelScheme ps) override
+		{
+			sampler = _sampler;
+			return this->train(iteration, numWorkers, ps);
+		}
+
 		size_t addDoc(const std::vector<std::string>& words) override
 		{
 			return this->_addDoc(this->_makeDoc(words));
 		}
 
+		size_t addDoc(const std::vector<VID>& words) override
+		{
+			return this->_addDoc(this->_makeDoc(words));
+		}
+
 		std::unique_ptr<DocumentBase> makeDoc(const std::vector<std::string>& words) const override
 		{
 			return make_unique<_DocType>(this->_makeDocWithinVocab(words));
 		}
 
+		std::unique_ptr<DocumentBase> makeDoc(const std::vector<VID>& words) const override
+		{
+			return make_unique<_DocType>(this->_makeDocWithinVocab(words));
+		}
+
+		std::unique_ptr<InferenceContext> makeInferenceContext(size_t numWorkers) const override
+		{
+			if (!numWorkers) numWorkers = std::thread::hardware_concurrency();
+			flushDeferred();
+			return make_unique<LDAInferenceContext>(this, numWorkers);
+		}
+
+		void scanDoc(const std::vector<VID>& words) override
+		{
+			this->_scanDoc(words);
+		}
+
+		void setOnlineStepSize(FLOAT tau, FLOAT kappa) override
+		{
+			if (tau < 1) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "tau must not be less than 1.");
+			if (kappa <= 0.5 || kappa > 1) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "kappa must be in (0.5, 1].");
+			onlineTau = tau;
+			onlineKappa = kappa;
+		}
+
+		double trainOnline(const std::vector<DocumentBase*>& batch, size_t numWorkers, size_t docIteration) override
+		{
+			if (_TW != TermWeight::one) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "online training supports TermWeight::one only.");
+			if (this->globalState.numByTopic.size() != K) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "prepare() should be called before online training.");
+			if (!docIteration) docIteration = 1;
+			if (!numWorkers) numWorkers = std::thread::hardware_concurrency();
+			if (!this->cachedPool || this->cachedPool->getNumWorkers() != numWorkers)
+			{
+				this->cachedPool = make_unique<ThreadPool>(numWorkers);
+			}
+			auto& pool = *this->cachedPool;
+			if ((size_t)onlineTopicWord.cols() != this->realV) initOnlineState();
+
+			Eigen::Array<FLOAT, -1, 1> invTopic = onlineScale * onlineTopicSum.array();
+			if (etaByTopicWord.size()) invTopic += etaSumByTopic.array();
+			else invTopic += eta * this->realV;
+			invTopic = invTopic.inverse();
+			std::vector<_ModelState> localData(numWorkers);
+			std::vector<OnlineAccumulator> accs(numWorkers);
+			std::atomic<size_t> next{ 0 };
+			auto res = pool.enqueueToAll([&](size_t threadId)
+			{
+				auto& acc = accs[threadId];
+				acc.colOfWord.resize(this->realV, -1);
+				for (size_t i; (i = next++) < batch.size();)
+				{
+					auto& doc = *static_cast<_DocType*>(batch[i]);
+					static_cast<const DerivedClass*>(this)->prepareDoc(doc, nullptr, doc.words.size());
+					doc.updateSumWordWeight(this->realV);
+					if (etaByTopicWord.size()) inferDocOnline<true>(doc, invTopic, localData[threadId], acc, docIteration);
+					else inferDocOnline<false>(doc, invTopic, localData[threadId], acc, docIteration);
+				}
+			});
+			for (auto& r : res) r.get();
+
+			double ll = 0;
+			size_t numWords = 0;
+			for (auto& acc : accs)
+			{
+				ll += acc.ll;
+				numWords += acc.numWords;
+			}
+			if (!numWords) return 0;
+
+			// each batch stands for the whole stream, scaled by the ratio of their words
+			const FLOAT rho = std::min(std::pow(onlineTau + onlineIterated, -onlineKappa), (FLOAT)1);
+			decayOnlineState(1 - rho);
+			// in units of onlineTopicWord
+			const FLOAT scale = rho * std::max(onlineNumWords, numWords) / numWords / onlineScale;
+			for (auto& acc : accs)
+			{
+				for (size_t u = 0; u < acc.vids.size(); ++u)
+				{
+					auto col = Eigen::Map<Eigen::Matrix<FLOAT, -1, 1>>{ &acc.topicWord[u * K], (Eigen::Index)K };
+					onlineTopicWord.col(acc.vids[u]) += scale * col;
+					onlineTopicSum += scale * col;
+				}
+			}
+			auto tx = [](DocumentBase* p)->_DocType& { return *static_cast<_DocType*>(p); };
+			static_cast<DerivedClass*>(this)->updatePriorOnline(pool, localData.data(),
+				makeTransformIter(batch.begin(), tx), makeTransformIter(batch.end(), tx),
+				rho, (FLOAT)std::max(onlineNumWords, numWords) * batch.size() / numWords);
+			onlineStale = true;
+			invalidateCachedLL();
+			++onlineIterated;
+			return ll / numWords;
+		}
+
 		void setWordPrior(const std::string& word, const std::vector<FLOAT>& priors) override
 		{
 			if (priors.size() != K) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "priors.size() must be equal to K.");
@@ -825,70 +2162,40 @@ namespace tomoto
 			}
 		}
 
-		void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0) override
+		void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0, size_t numWorkers = 0) override
 		{
+			this->getPool(numWorkers);
 			if (initDocs) this->removeStopwords(minWordCnt, removeTopN);
 			static_cast<DerivedClass*>(this)->updateWeakArray();
 			static_cast<DerivedClass*>(this)->initGlobalState(initDocs);
 			static_cast<DerivedClass*>(this)->prepareWordPriors();
 
-			const size_t V = this->realV;
-
 			if (initDocs)
 			{
-				std::vector<uint32_t> df, cf, tf;
-				uint32_t totCf;
-
-				// calculate weighting
-				if (_TW != TermWeight::one)
-				{
-					df.resize(V);
-					tf.resize(V);
-					for (auto& doc : this->docs)
-					{
-						for (auto w : std::unordered_set<VID>{ doc.words.begin(), doc.words.end() })
-						{
-							if (w >= this->realV) continue;
-							++df[w];
-						}
-					}
-					totCf = accumulate(this->vocabFrequencies.begin(), this->vocabFrequencies.end(), 0);
-				}
-				if (_TW == TermWeight::idf || _TW == TermWeight::idf_one)
-				{
-					vocabWeights.resize(V);
-					for (size_t i = 0; i < V; ++i)
-					{
-						vocabWeights[i] = log(this->docs.size() / (FLOAT)df[i]);
-					}
-				}
-				else if (_TW == TermWeight::pmi)
-				{
-					vocabWeights.resize(V);
-					for (size_t i = 0; i < V; ++i)
-					{
-						vocabWeights[i] = this->vocabFrequencies[i] / (float)totCf;
-					}
-				}
-
-				decltype(static_cast<DerivedClass*>(this)->makeGeneratorForInit(nullptr)) generator;
-				if(!(m_flags & flags::generator_by_doc)) generator = static_cast<DerivedClass*>(this)->makeGeneratorForInit(nullptr);
-				for (auto& doc : this->docs)
-				{
-					initializeDocState<false>(doc, (m_flags & flags::continuous_doc_data) ? numByTopicDoc.col(&doc - &this->docs[0]).data() : nullptr, generator, this->globalState, this->rg);
-				}
+				static_cast<DerivedClass*>(this)->updateVocabWeights(0);
+				static_cast<DerivedClass*>(this)->layoutShared();
+				static_cast<DerivedClass*>(this)->initializeDocs(0, (m_flags & flags::continuous_doc_data) ? numByTopicDoc.data() : nullptr);
 			}
 			else
 			{
 				static_cast<DerivedClass*>(this)->updateDocs();
 				for (auto& doc : this->docs) doc.updateSumWordWeight(this->realV);
+				static_cast<DerivedClass*>(this)->prepareShared();
 			}
-			static_cast<DerivedClass*>(this)->prepareShared();
-			BaseClass::prepare(initDocs, minWordCnt, removeTopN);
+			BaseClass::prepare(initDocs, minWordCnt, removeTopN, numWorkers);
 		}
 
 		std::vector<size_t> getCountByTopic() const override
 		{
+			flushDeferred();
+			// a model without docs, trained online or saved without them, has the counts in globalState only
+			if (this->docs.empty())
+			{
+				const auto& n = this->globalState.numByTopic;
+				std::vector<size_t> cnt(K);
+				for (TID k = 0; k < K && k < n.size(); ++k) cnt[k] = n[k] > 0 ? (size_t)std::round(n[k]) : 0;
+				return cnt;
+			}
 			return static_cast<const DerivedClass*>(this)->_getTopicsCount();
 		}
 
@@ -907,6 +2214,7 @@ namespace tomoto
 	void DocumentLDA<_TW, _Flags>::update(WeightType* ptr, const _TopicModel& mdl)
 	{
 		numByTopic.init(ptr, mdl.getK());
+		Zs.setWidth(PackedVector<TID>::widthFor(mdl.getK()));
 		for (size_t i = 0; i < Zs.size(); ++i)
 		{
 			if (this->words[i] >= mdl.getV()) continue;
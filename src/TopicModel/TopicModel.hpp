@@ -1,10 +1,12 @@
 ﻿#pragma once
+#include <numeric>
 #include "../Utils/Utils.hpp"
 #include "../Utils/Dictionary.h"
 #include "../Utils/tvector.hpp"
 #include "../Utils/ThreadPool.hpp"
 #include "../Utils/serializer.hpp"
 #include "../Utils/exception.h"
+#include "../Utils/MappedFile.hpp"
 
 
 namespace tomoto
@@ -51,11 +53,34 @@ namespace tomoto
 		}
 	}
 
+	/*
+	resources for inferring independent documents, which are made once and reused across calls.
+	it is made by ITopicModel::makeInferenceContext() and must not outlive its model nor be used while the model is trained.
+	infer() must not be called concurrently on the same context.
+	*/
+	class InferenceContext
+	{
+	public:
+		// returns the log likelihood of each document
+		virtual std::vector<double> infer(const std::vector<DocumentBase*>& docs, size_t maxIter) = 0;
+		virtual ~InferenceContext() {}
+	};
+
 	class ITopicModel
 	{
 	public:
 		virtual void saveModel(std::ostream& writer, bool fullModel) const = 0;
 		virtual void loadModel(std::istream& reader) = 0;
+		// saves into the container which loadMappedModel() uses in place. writer should be at the start of a file.
+		virtual void saveMappedModel(std::ostream& writer, bool fullModel) const = 0;
+		// maps the file written by saveMappedModel(), so that its arrays are shared with other processes mapping it
+		virtual void loadMappedModel(const std::string& path) = 0;
+		// writes the docs added so far with their vocabulary, should be called before prepare()
+		virtual void saveCorpus(std::ostream& writer) const = 0;
+		// adds the docs of a corpus written by saveCorpus() into a model which has no docs yet
+		virtual void loadCorpus(std::istream& reader) = 0;
+		// makes docs to be inferred from a corpus written by saveCorpus(), dropping words out of the vocabulary of the model
+		virtual std::vector<std::unique_ptr<DocumentBase>> makeDocsFromCorpus(std::istream& reader) const = 0;
 		virtual const DocumentBase* getDoc(size_t docId) const = 0;
 
 		virtual double getLLPerWord() const = 0;
@@ -64,10 +89,26 @@ namespace tomoto
 		virtual size_t getN() const = 0;
 		virtual size_t getNumDocs() const = 0;
 		virtual const Dictionary& getVocabDict() const = 0;
+		// adds a word into the vocabulary, so that documents can be given by vids
+		virtual VID addWord(const std::string& word) = 0;
 		virtual const std::vector<size_t>& getVocabFrequencies() const = 0;
+		// whether prepare() keeps the original order of words in DocumentBase::wOrder, true by default.
+		// without it, words of documents are left sorted.
+		virtual bool getKeepWordOrder() const = 0;
+		virtual void setKeepWordOrder(bool keep) = 0;
 
 		virtual int train(size_t iteration, size_t numWorkers, ParallelScheme ps = ParallelScheme::default_) = 0;
-		virtual void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0) = 0;
+		// numWorkers threads prepare the docs, 0 means as many as the hardware has
+		virtual void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0, size_t numWorkers = 0) = 0;
+
+		/*
+		prepares the docs added after prepare() or loadModel(), keeping the topics of the others and the state of the model,
+		so that training goes on from where it was. words first seen in the new docs join the vocabulary if they occur minWordCnt times or more.
+		returns the number of words joining the vocabulary.
+		*/
+		virtual size_t prepareNewDocs(size_t minWordCnt = 0, size_t numWorkers = 0) = 0;
+		// same as train(), but samples the docs prepared by the last prepareNewDocs() only
+		virtual int trainNewDocs(size_t iteration, size_t numWorkers, ParallelScheme ps = ParallelScheme::default_) = 0;
 		virtual std::vector<FLOAT> getWidsByTopic(TID tid) const = 0;
 		virtual std::vector<std::pair<std::string, FLOAT>> getWordsByTopicSorted(TID tid, size_t topN) const = 0;
 
@@ -76,6 +117,7 @@ namespace tomoto
 		virtual std::vector<FLOAT> getTopicsByDoc(const DocumentBase* doc) const = 0;
 		virtual std::vector<std::pair<TID, FLOAT>> getTopicsByDocSorted(const DocumentBase* doc, size_t topN) const = 0;
 		virtual std::vector<double> infer(const std::vector<DocumentBase*>& docs, size_t maxIter, FLOAT tolerance, size_t numWorkers, ParallelScheme ps, bool together) const = 0;
+		virtual std::unique_ptr<InferenceContext> makeInferenceContext(size_t numWorkers = 0) const = 0;
 		virtual ~ITopicModel() {}
 	};
 
@@ -127,9 +169,18 @@ namespace tomoto
 		size_t realV = 0; // vocab size after removing stopwords
 		size_t realN = 0; // total word size after removing stopwords
 		size_t maxThreads[(size_t)ParallelScheme::size] = { 0, };
+		bool keepWordOrder = true;
+
+		bool prepared = false;
+		size_t numPreparedDocs = 0, numPreparedWords = 0; // docs and words added after these are prepared by prepareNewDocs()
+		size_t firstNewDoc = 0; // the first doc prepared by the last prepareNewDocs()
+		size_t firstTrainDoc = 0; // docs before this are not sampled by train()
 
 		std::unique_ptr<ThreadPool> cachedPool;
 
+		static constexpr uint32_t mappedModelVersion = 3;
+		std::shared_ptr<MappedFile> mappedFile; // keeps views of a mapped model valid
+
 		void _saveModel(std::ostream& writer, bool fullModel) const
 		{
 			serializer::writeMany(writer, 
@@ -160,12 +211,110 @@ namespace tomoto
 			realN = countRealN();
 		}
 
+		/*
+		layout of the corpus: vocabulary and its frequencies, offsets of docs, vids of all docs in a row,
+		then the metadata of docs written by the derived model.
+		*/
+		void _saveCorpus(std::ostream& writer) const
+		{
+			serializer::writeMany(writer,
+				serializer::MagicConstant{ "Corpus" },
+				serializer::MagicConstant{ _Derived::TMID },
+				dict, vocabFrequencies);
+			std::vector<uint32_t> offsets{ 0 };
+			for (auto& doc : docs) offsets.emplace_back(offsets.back() + doc.words.size());
+			serializer::writeMany(writer, offsets, offsets.back());
+			for (auto& doc : docs)
+			{
+				if (!writer.write((const char*)doc.words.data(), sizeof(VID) * doc.words.size()))
+					throw std::ios_base::failure("writing words of the corpus is failed");
+			}
+			static_cast<const _Derived*>(this)->writeCorpusMetadata(writer);
+		}
+
+		// a truncated or corrupted corpus would otherwise be indexed out of bounds
+		static void checkCorpus(const std::vector<uint32_t>& offsets, const std::vector<VID>& corpusWords, size_t vocabSize)
+		{
+			if (offsets.empty() || offsets.front() != 0 || offsets.back() != corpusWords.size())
+				throw serializer::UnfitException("offsets of docs in the corpus don't match its words");
+			for (size_t i = 1; i < offsets.size(); ++i)
+			{
+				if (offsets[i] < offsets[i - 1]) throw serializer::UnfitException("offsets of docs in the corpus are not in order");
+			}
+			for (auto w : corpusWords)
+			{
+				if (w >= vocabSize) throw serializer::UnfitException("word id of the corpus is out of its vocabulary");
+			}
+		}
+
+		void _loadCorpus(std::istream& reader)
+		{
+			if (!docs.empty()) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "a corpus can be loaded only into a model without docs");
+			serializer::readMany(reader,
+				serializer::MagicConstant{ "Corpus" },
+				serializer::MagicConstant{ _Derived::TMID },
+				dict, vocabFrequencies, wOffsetByDoc, words);
+			if (vocabFrequencies.size() != dict.size()) throw serializer::UnfitException("frequencies of the corpus don't match its vocabulary");
+			checkCorpus(wOffsetByDoc, words, dict.size());
+			docs.resize(wOffsetByDoc.size() - 1);
+			// docs become views of words, so that updateWeakArray() has nothing left to do
+			for (size_t i = 0; i < docs.size(); ++i)
+			{
+				docs[i].words = tvector<VID>{ words.data() + wOffsetByDoc[i], wOffsetByDoc[i + 1] - wOffsetByDoc[i] };
+			}
+			static_cast<_Derived*>(this)->readCorpusMetadata(reader, docs);
+		}
+
+		std::vector<DocType> _makeDocsFromCorpus(std::istream& reader) const
+		{
+			Dictionary corpusDict;
+			std::vector<size_t> corpusFrequencies;
+			std::vector<uint32_t> offsets;
+			std::vector<VID> corpusWords;
+			serializer::readMany(reader,
+				serializer::MagicConstant{ "Corpus" },
+				serializer::MagicConstant{ _Derived::TMID },
+				corpusDict, corpusFrequencies, offsets, corpusWords);
+			checkCorpus(offsets, corpusWords, corpusDict.size());
+			std::vector<VID> vids(corpusDict.size());
+			for (size_t v = 0; v < vids.size(); ++v) vids[v] = dict.toWid(corpusDict.toWordView(v));
+			std::vector<DocType> ret(offsets.size() - 1);
+			for (size_t i = 0; i < ret.size(); ++i)
+			{
+				for (size_t j = offsets[i]; j < offsets[i + 1]; ++j)
+				{
+					if (vids[corpusWords[j]] != (VID)-1) ret[i].words.emplace_back(vids[corpusWords[j]]);
+				}
+			}
+			static_cast<const _Derived*>(this)->readCorpusMetadataWithinModel(reader, ret);
+			return ret;
+		}
+
+		void writeCorpusMetadata(std::ostream& writer) const
+		{
+		}
+
+		void readCorpusMetadata(std::istream& reader, std::vector<DocType>& corpusDocs)
+		{
+		}
+
+		void readCorpusMetadataWithinModel(std::istream& reader, std::vector<DocType>& corpusDocs) const
+		{
+		}
+
+		template<typename _Words>
+		void countWords(const _Words& words)
+		{
+			if (words.empty()) return;
+			size_t maxWid = *std::max_element(words.begin(), words.end());
+			if (vocabFrequencies.size() <= maxWid) vocabFrequencies.resize(maxWid + 1);
+			for (auto w : words) ++vocabFrequencies[w];
+		}
+
 		size_t _addDoc(const DocType& doc)
 		{
 			if (doc.words.empty()) return -1;
-			size_t maxWid = *std::max_element(doc.words.begin(), doc.words.end());
-			if (vocabFrequencies.size() <= maxWid) vocabFrequencies.resize(maxWid + 1);
-			for (auto w : doc.words) ++vocabFrequencies[w];
+			countWords(doc.words);
 			docs.emplace_back(doc);
 			return docs.size() - 1;
 		}
@@ -173,13 +322,21 @@ namespace tomoto
 		size_t _addDoc(DocType&& doc)
 		{
 			if (doc.words.empty()) return -1;
-			size_t maxWid = *std::max_element(doc.words.begin(), doc.words.end());
-			if (vocabFrequencies.size() <= maxWid) vocabFrequencies.resize(maxWid + 1);
-			for (auto w : doc.words) ++vocabFrequencies[w];
+			countWords(doc.words);
 			docs.emplace_back(std::move(doc));
 			return docs.size() - 1;
 		}
 
+		// counts the words into vocabFrequencies without keeping the document
+		void _scanDoc(const std::vector<VID>& words)
+		{
+			for (auto w : words)
+			{
+				if (w >= dict.size()) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "word id is out of the vocabulary");
+			}
+			countWords(words);
+		}
+
 		DocType _makeDoc(const std::vector<std::string>& words, FLOAT weight = 1)
 		{
 			DocType doc{ weight };
@@ -191,6 +348,18 @@ namespace tomoto
 			return doc;
 		}
 
+		DocType _makeDoc(const std::vector<VID>& words, FLOAT weight = 1)
+		{
+			for (auto w : words)
+			{
+				if (w >= dict.size()) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "word id is out of the vocabulary");
+			}
+			DocType doc{ weight };
+			doc.words.resize(words.size());
+			std::copy(words.begin(), words.end(), doc.words.begin());
+			return doc;
+		}
+
 		DocType _makeDocWithinVocab(const std::vector<std::string>& words, FLOAT weight = 1) const
 		{
 			DocType doc{ weight };
@@ -204,22 +373,91 @@ namespace tomoto
 			return doc;
 		}
 
+		DocType _makeDocWithinVocab(const std::vector<VID>& words, FLOAT weight = 1) const
+		{
+			DocType doc{ weight };
+			for (auto w : words)
+			{
+				if (w < dict.size()) doc.words.emplace_back(w);
+			}
+			return doc;
+		}
+
 		const DocType& _getDoc(size_t docId) const
 		{
 			return docs[docId];
 		}
 
+		ThreadPool& getPool(size_t numWorkers)
+		{
+			if (!numWorkers) numWorkers = std::thread::hardware_concurrency();
+			if (!cachedPool || cachedPool->getNumWorkers() != numWorkers)
+			{
+				cachedPool = make_unique<ThreadPool>(numWorkers);
+			}
+			return *cachedPool;
+		}
+
+		// one chunk per worker of cachedPool, or one if the pool is not ready
+		size_t numChunksFor(size_t n) const
+		{
+			return std::max(std::min(cachedPool ? cachedPool->getNumWorkers() : 1, n), (size_t)1);
+		}
+
+		// calls fn(chunkId, b, e) for the chunks splitting [0, n) evenly, in parallel over cachedPool if it is ready
+		template<typename _Fn>
+		void forEachChunk(size_t numChunks, size_t n, _Fn fn) const
+		{
+			ThreadPool* pool = cachedPool.get();
+			if (!pool || numChunks <= 1)
+			{
+				for (size_t i = 0; i < numChunks; ++i) fn(i, n * i / numChunks, n * (i + 1) / numChunks);
+				return;
+			}
+
+			std::vector<std::future<void>> res;
+			for (size_t i = 0; i < numChunks; ++i)
+			{
+				res.emplace_back(pool->enqueue([&, i](size_t)
+				{
+					fn(i, n * i / numChunks, n * (i + 1) / numChunks);
+				}));
+			}
+			for (auto& r : res) r.wait();
+			for (auto& r : res) r.get();
+		}
+
+		// copies the arrays *tx(doc) of all docs into dest in a row and makes them views of it, as tvector::trade() does
+		template<typename _Ty, typename _Tx>
+		void tradeDocArrays(std::vector<_Ty>& dest, _Tx tx)
+		{
+			std::vector<size_t> offsets(docs.size() + 1);
+			for (size_t i = 0; i < docs.size(); ++i) offsets[i + 1] = offsets[i] + tx(docs[i])->size();
+			dest.resize(offsets.back());
+			forEachChunk(numChunksFor(docs.size()), docs.size(), [&](size_t, size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; ++i)
+				{
+					auto& tv = *tx(docs[i]);
+					std::copy(tv.begin(), tv.end(), dest.data() + offsets[i]);
+					tv = tvector<_Ty>{ dest.data() + offsets[i], tv.size() };
+				}
+			});
+		}
+
 		void updateWeakArray()
 		{
+			if (wOffsetByDoc.size() == docs.size() + 1) return;
+			wOffsetByDoc.clear();
 			wOffsetByDoc.emplace_back(0);
 			for (auto& doc : docs)
 			{
 				wOffsetByDoc.emplace_back(wOffsetByDoc.back() + doc.words.size());
 			}
-			auto tx = [](_DocType& doc) { return &doc.words; };
-			tvector<VID>::trade(words, 
-				makeTransformIter(docs.begin(), tx),
-				makeTransformIter(docs.end(), tx));
+			// docs added after prepare() are gathered with the others, whose words are views of the current array until they are copied
+			std::vector<VID> newWords;
+			tradeDocArrays(newWords, [](_DocType& doc) { return &doc.words; });
+			words.swap(newWords);
 		}
 
 		size_t countRealN() const
@@ -245,15 +483,65 @@ namespace tomoto
 				return a < minWordCnt; 
 			}) - vocabFrequencies.begin();
 			dict.reorder(order);
-			realN = 0;
-			for (auto& doc : docs)
+			const size_t numChunks = numChunksFor(docs.size());
+			std::vector<size_t> nByChunk(numChunks);
+			forEachChunk(numChunks, docs.size(), [&](size_t c, size_t b, size_t e)
 			{
-				for (auto& w : doc.words)
+				for (size_t i = b; i < e; ++i)
 				{
-					w = order[w];
-					if (w < realV) ++realN;
+					for (auto& w : docs[i].words)
+					{
+						w = order[w];
+						if (w < realV) ++nByChunk[c];
+					}
 				}
+			});
+			realN = std::accumulate(nByChunk.begin(), nByChunk.end(), (size_t)0);
+		}
+
+		/*
+		gives vids from realV to the words added after prepare() which occur minWordCnt times or more,
+		and moves the words removed from the vocabulary behind them.
+		vids of the prepared docs keep their order, so that their words stay sorted. returns the number of words joining the vocabulary.
+		*/
+		size_t addNewWords(size_t minWordCnt)
+		{
+			const size_t n = dict.size();
+			vocabFrequencies.resize(n);
+			std::vector<VID> order(n);
+			size_t next = realV;
+			for (VID v = numPreparedWords; v < n; ++v)
+			{
+				if (vocabFrequencies[v] >= minWordCnt) order[v] = next++;
 			}
+			const size_t added = next - realV;
+			if (!added) return 0;
+			for (VID v = 0; v < realV; ++v) order[v] = v;
+			for (VID v = realV; v < numPreparedWords; ++v) order[v] = v + added;
+			next = numPreparedWords + added;
+			for (VID v = numPreparedWords; v < n; ++v)
+			{
+				if (vocabFrequencies[v] < minWordCnt) order[v] = next++;
+			}
+
+			dict.reorder(order);
+			std::vector<size_t> frequencies(n);
+			for (VID v = 0; v < n; ++v) frequencies[order[v]] = vocabFrequencies[v];
+			vocabFrequencies.swap(frequencies);
+			for (auto& doc : docs)
+			{
+				for (auto& w : doc.words) w = order[w];
+			}
+			realV += added;
+			return added;
+		}
+
+		void updateMaxThreads()
+		{
+			maxThreads[(size_t)ParallelScheme::default_] = -1;
+			maxThreads[(size_t)ParallelScheme::none] = -1;
+			maxThreads[(size_t)ParallelScheme::copy_merge] = static_cast<_Derived*>(this)->template estimateMaxThreads<ParallelScheme::copy_merge>();
+			maxThreads[(size_t)ParallelScheme::partition] = static_cast<_Derived*>(this)->template estimateMaxThreads<ParallelScheme::partition>();
 		}
 
 		int restoreFromTrainingError(const exception::TrainingError& e, ThreadPool& pool, _ModelState* localData, RandGen* rgs)
@@ -261,6 +549,20 @@ namespace tomoto
 			throw e;
 		}
 
+		/*
+		applies what training has left deferred, before the model is read or changed otherwise.
+		training is set when train() goes on, which may keep what is deferred between its iterations only.
+		const methods call it too, so a derived model deferring anything should guard it against concurrent calls.
+		*/
+		void flushDeferred(bool training = false) const
+		{
+		}
+
+		// drops what training has left deferred, before the model is replaced by a loaded one
+		void discardDeferred()
+		{
+		}
+
 	public:
 		TopicModel(const RandGen& _rg) : rg(_rg)
 		{
@@ -281,12 +583,49 @@ namespace tomoto
 			return realV;
 		}
 
-		void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0) override
+		void prepare(bool initDocs = true, size_t minWordCnt = 0, size_t removeTopN = 0, size_t numWorkers = 0) override
 		{
-			maxThreads[(size_t)ParallelScheme::default_] = -1;
-			maxThreads[(size_t)ParallelScheme::none] = -1;
-			maxThreads[(size_t)ParallelScheme::copy_merge] = static_cast<_Derived*>(this)->template estimateMaxThreads<ParallelScheme::copy_merge>();
-			maxThreads[(size_t)ParallelScheme::partition] = static_cast<_Derived*>(this)->template estimateMaxThreads<ParallelScheme::partition>();
+			updateMaxThreads();
+			prepared = true;
+			numPreparedDocs = firstNewDoc = docs.size();
+			numPreparedWords = dict.size();
+		}
+
+		size_t prepareNewDocs(size_t minWordCnt = 0, size_t numWorkers = 0) override
+		{
+			if (!prepared) THROW_ERROR_WITH_INFO(exception::InvalidArgument, "prepare() should be called before prepareNewDocs().");
+			static_cast<const _Derived*>(this)->flushDeferred();
+			getPool(numWorkers);
+			const size_t first = numPreparedDocs;
+			size_t ret = static_cast<_Derived*>(this)->_prepareNewDocs(first, minWordCnt);
+			updateMaxThreads();
+			numPreparedDocs = docs.size();
+			numPreparedWords = dict.size();
+			firstNewDoc = first;
+			return ret;
+		}
+
+		int trainNewDocs(size_t iteration, size_t numWorkers, ParallelScheme ps = ParallelScheme::default_) override
+		{
+			if (firstNewDoc >= docs.size()) return 0;
+			// partitions are made over the docs to be sampled
+			auto& edd = static_cast<_Derived*>(this)->eddTrain;
+			edd.vChunkOffset.clear();
+			firstTrainDoc = firstNewDoc;
+			int ret;
+			try
+			{
+				ret = train(iteration, numWorkers, ps);
+			}
+			catch (...)
+			{
+				firstTrainDoc = 0;
+				edd.vChunkOffset.clear();
+				throw;
+			}
+			firstTrainDoc = 0;
+			edd.vChunkOffset.clear();
+			return ret;
 		}
 
 		static ParallelScheme getRealScheme(ParallelScheme ps)
@@ -312,6 +651,7 @@ namespace tomoto
 		int train(size_t iteration, size_t numWorkers, ParallelScheme ps) override
 		{
 			if (!numWorkers) numWorkers = std::thread::hardware_concurrency();
+			static_cast<const _Derived*>(this)->flushDeferred(true);
 			ps = getRealScheme(ps);
 			numWorkers = std::min(numWorkers, maxThreads[(size_t)ps]);
 			if (numWorkers == 1 || (_Flags & flags::shared_state)) ps = ParallelScheme::none;
@@ -331,7 +671,7 @@ namespace tomoto
 			if (ps == ParallelScheme::partition)
 			{
 				localData.resize(numWorkers);
-				static_cast<_Derived*>(this)->updatePartition(*cachedPool, globalState, localData.data(), docs.begin(), docs.end(), 
+				static_cast<_Derived*>(this)->updatePartition(*cachedPool, globalState, localData.data(), docs.begin() + firstTrainDoc, docs.end(), 
 					static_cast<_Derived*>(this)->eddTrain);
 			}
 
@@ -374,6 +714,7 @@ namespace tomoto
 
 		double getLLPerWord() const override
 		{
+			static_cast<const _Derived*>(this)->flushDeferred();
 			return words.empty() ? 0 : static_cast<const _Derived*>(this)->getLL() / realN;
 		}
 
@@ -384,12 +725,13 @@ namespace tomoto
 
 		std::vector<FLOAT> getWidsByTopic(TID tid) const override
 		{
+			static_cast<const _Derived*>(this)->flushDeferred();
 			return static_cast<const _Derived*>(this)->_getWidsByTopic(tid);
 		}
 
 		std::vector<std::pair<VID, FLOAT>> getWidsByTopicSorted(TID tid, size_t topN) const
 		{
-			return extractTopN<VID>(static_cast<const _Derived*>(this)->_getWidsByTopic(tid), topN);
+			return extractTopN<VID>(getWidsByTopic(tid), topN);
 		}
 
 		std::vector<std::pair<std::string, FLOAT>> vid2String(const std::vector<std::pair<VID, FLOAT>>& vids) const
@@ -423,6 +765,7 @@ namespace tomoto
 		std::vector<double> infer(const std::vector<DocumentBase*>& docs, size_t maxIter, FLOAT tolerance, size_t numWorkers, ParallelScheme ps, bool together) const override
 		{
 			if (!numWorkers) numWorkers = std::thread::hardware_concurrency();
+			static_cast<const _Derived*>(this)->flushDeferred();
 			ps = getRealScheme(ps);
 			if (numWorkers == 1) ps = ParallelScheme::none;
 			auto tx = [](DocumentBase* p)->DocType& { return *static_cast<DocType*>(p); };
@@ -476,21 +819,96 @@ namespace tomoto
 			return dict;
 		}
 
+		VID addWord(const std::string& word) override
+		{
+			return dict.add(word);
+		}
+
 		const std::vector<size_t>& getVocabFrequencies() const override
 		{
 			return vocabFrequencies;
 		}
 
+		bool getKeepWordOrder() const override
+		{
+			return keepWordOrder;
+		}
+
+		void setKeepWordOrder(bool keep) override
+		{
+			keepWordOrder = keep;
+		}
+
 		void saveModel(std::ostream& writer, bool fullModel) const override
 		{ 
+			static_cast<const _Derived*>(this)->flushDeferred();
 			static_cast<const _Derived*>(this)->_saveModel(writer, fullModel);
 		}
 
 		void loadModel(std::istream& reader) override
 		{ 
+			static_cast<_Derived*>(this)->discardDeferred();
 			static_cast<_Derived*>(this)->_loadModel(reader);
+			mappedFile.reset();
 			static_cast<_Derived*>(this)->prepare(false);
 		}
+
+		void saveMappedModel(std::ostream& writer, bool fullModel) const override
+		{
+			static_cast<const _Derived*>(this)->flushDeferred();
+			const auto base = writer.tellp();
+			serializer::writeMany(writer, serializer::MagicConstant{ "TMmf" }, mappedModelVersion);
+			serializer::setAlignedMode(writer, base);
+			try
+			{
+				static_cast<const _Derived*>(this)->_saveModel(writer, fullModel);
+			}
+			catch (...)
+			{
+				serializer::unsetAlignedMode(writer);
+				throw;
+			}
+			serializer::unsetAlignedMode(writer);
+		}
+
+		void loadMappedModel(const std::string& path) override
+		{
+			auto file = std::make_shared<MappedFile>(path);
+			serializer::imstreambuf buf{ file->data(), file->data() + file->size() };
+			std::istream reader{ &buf };
+			uint32_t version = 0;
+			serializer::readMany(reader, serializer::MagicConstant{ "TMmf" }, version);
+			if (version != mappedModelVersion)
+				throw serializer::UnfitException(text::format("version %u of mapped model is not supported", version));
+			static_cast<_Derived*>(this)->discardDeferred();
+			serializer::setAlignedMode(reader, 0);
+			// the previous mapping, if any, is released after its views are replaced
+			std::swap(mappedFile, file);
+			static_cast<_Derived*>(this)->_loadModel(reader);
+			static_cast<_Derived*>(this)->prepare(false);
+		}
+
+		void saveCorpus(std::ostream& writer) const override
+		{
+			static_cast<const _Derived*>(this)->_saveCorpus(writer);
+		}
+
+		void loadCorpus(std::istream& reader) override
+		{
+			static_cast<_Derived*>(this)->_loadCorpus(reader);
+		}
+
+		std::vector<std::unique_ptr<DocumentBase>> makeDocsFromCorpus(std::istream& reader) const override
+		{
+			std::vector<std::unique_ptr<DocumentBase>> ret;
+			for (auto& doc : static_cast<const _Derived*>(this)->_makeDocsFromCorpus(reader))
+			{
+				ret.emplace_back(make_unique<DocType>(std::move(doc)));
+			}
+			return ret;
+		}
 	};
 
+	template<size_t _Flags, typename _Interface, typename _Derived, typename _DocType, typename _ModelState>
+	constexpr uint32_t TopicModel<_Flags, _Interface, _Derived, _DocType, _ModelState>::mappedModelVersion;
 }
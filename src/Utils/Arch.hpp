@@ -0,0 +1,201 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <initializer_list>
+#include <utility>
+
+// sse2 is the baseline of x86-64, so kernels of sse2 need no check
+#if defined(__x86_64__) || defined(_M_X64)
+#define TMT_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+/*
+kernels for an instruction set beyond the baseline of the build are compiled with the target attribute,
+and chosen at runtime by getArch(), so that a single build runs on any x86-64 cpu with the fastest path it has.
+MSVC needs no attribute to use intrinsics.
+*/
+#if defined(TMT_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TMT_TARGET_SSE2 __attribute__((target("sse2")))
+#define TMT_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TMT_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx2,fma")))
+#else
+#define TMT_TARGET_SSE2
+#define TMT_TARGET_AVX2
+#define TMT_TARGET_AVX512
+#endif
+
+// functions defined between TMT_BEGIN_TARGET_* and TMT_END_TARGET are compiled for the instruction set
+#if defined(TMT_X86) && defined(__clang__)
+#define TMT_BEGIN_TARGET_AVX2 _Pragma("clang attribute push (__attribute__((target(\"avx2,fma\"))), apply_to = function)")
+#define TMT_BEGIN_TARGET_AVX512 _Pragma("clang attribute push (__attribute__((target(\"avx512f,avx512vl,avx2,fma\"))), apply_to = function)")
+#define TMT_END_TARGET _Pragma("clang attribute pop")
+#elif defined(TMT_X86) && defined(__GNUC__)
+#define TMT_BEGIN_TARGET_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2,fma\")")
+#define TMT_BEGIN_TARGET_AVX512 _Pragma("GCC push_options") _Pragma("GCC target(\"avx512f,avx512vl,avx2,fma\")")
+#define TMT_END_TARGET _Pragma("GCC pop_options")
+#else
+#define TMT_BEGIN_TARGET_AVX2
+#define TMT_BEGIN_TARGET_AVX512
+#define TMT_END_TARGET
+#endif
+
+// kernels for x86-64 instruction sets don't exist on other cpus
+#ifdef TMT_X86
+#define TMT_X86_KERNEL(fn) fn
+#else
+#define TMT_X86_KERNEL(fn) nullptr
+#endif
+
+namespace tomoto
+{
+	enum class ArchType
+	{
+		none,
+		sse2,
+		avx2, // with fma
+		avx512, // foundation and vector length
+		size
+	};
+
+	inline const char* toString(ArchType arch)
+	{
+		static const char* names[] = { "none", "sse2", "avx2", "avx512" };
+		return names[(size_t)arch];
+	}
+
+	namespace detail
+	{
+#ifdef TMT_X86
+		inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* regs)
+		{
+#ifdef _MSC_VER
+			int r[4];
+			__cpuidex(r, leaf, subleaf);
+			for (size_t i = 0; i < 4; ++i) regs[i] = r[i];
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		// register states the os saves on context switches
+		inline uint64_t xgetbv0()
+		{
+#ifdef _MSC_VER
+			return _xgetbv(0);
+#else
+			uint32_t a, d;
+			__asm__ volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+			return ((uint64_t)d << 32) | a;
+#endif
+		}
+#endif
+
+		inline ArchType detectArch()
+		{
+#ifdef TMT_X86
+			uint32_t r[4];
+			cpuid(0, 0, r);
+			const uint32_t maxLeaf = r[0];
+			cpuid(1, 0, r);
+			if (!(r[3] & (1u << 26))) return ArchType::none;
+			const bool fma = r[2] & (1u << 12), osxsave = r[2] & (1u << 27), avx = r[2] & (1u << 28);
+			if (!fma || !osxsave || !avx || maxLeaf < 7) return ArchType::sse2;
+			const uint64_t xcr0 = xgetbv0();
+			// xmm and ymm
+			if ((xcr0 & 0x6) != 0x6) return ArchType::sse2;
+			cpuid(7, 0, r);
+			if (!(r[1] & (1u << 5))) return ArchType::sse2;
+			// opmask and all of zmm. without vector length, gcc moves values spilled to xmm16-31 by whole zmm, leaving the upper halves dirty
+			if ((r[1] & (1u << 16)) && (r[1] & (1u << 31)) && (xcr0 & 0xe0) == 0xe0) return ArchType::avx512;
+			return ArchType::avx2;
+#else
+			return ArchType::none;
+#endif
+		}
+
+		// the environment variable GDMR_ARCH can lower the detected one, e.g. to compare the results of paths
+		inline ArchType selectArch()
+		{
+			const ArchType detected = detectArch();
+			const char* env = std::getenv("GDMR_ARCH");
+			if (!env) return detected;
+			for (size_t i = 0; i < (size_t)detected; ++i)
+			{
+				if (!std::strcmp(env, toString((ArchType)i))) return (ArchType)i;
+			}
+			return detected;
+		}
+	}
+
+	// the best instruction set which both the cpu and the os support, detected once
+	inline ArchType getArch()
+	{
+		static const ArchType arch = detail::selectArch();
+		return arch;
+	}
+
+	/*
+	kernels of each ArchType with the least length of input from which each one is used.
+	a wider kernel pays more for its setup and its tail, so that it is chosen only for inputs long enough
+	to run faster than the narrower ones, not always for the widest arch.
+	*/
+	template<typename _Fn>
+	class KernelTable
+	{
+		_Fn fns[(size_t)ArchType::size] = {};
+		size_t minLengths[(size_t)ArchType::size] = {};
+		size_t numFns = 0;
+	public:
+		// kernels[i] is the kernel for ArchType i with its least length, or null if there is none
+		KernelTable(std::initializer_list<std::pair<_Fn, size_t>> kernels)
+		{
+			const size_t end = std::min((size_t)getArch() + 1, kernels.size());
+			for (size_t i = 0; i < end; ++i)
+			{
+				const auto& k = kernels.begin()[i];
+				if (!k.first) continue;
+				fns[numFns] = k.first;
+				minLengths[numFns] = numFns ? k.second : 0;
+				++numFns;
+			}
+		}
+
+		// the widest usable kernel for inputs of the length
+		_Fn operator()(size_t length) const
+		{
+			size_t i = numFns - 1;
+			while (i && length < minLengths[i]) --i;
+			return fns[i];
+		}
+	};
+
+#ifdef TMT_X86
+	/*
+	loads of 4, 8 or 16 floats or counts, casting counts to float, from unaligned memory.
+	intrinsics of avx512 are used in their masked forms with a zero source where gcc warns of the undefined source of the plain ones.
+	*/
+	namespace simd
+	{
+		TMT_TARGET_SSE2 inline __m128 load4(const float* p) { return _mm_loadu_ps(p); }
+		TMT_TARGET_SSE2 inline __m128 load4(const int32_t* p) { return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)p)); }
+
+		TMT_TARGET_AVX2 inline __m256 load8(const float* p) { return _mm256_loadu_ps(p); }
+		TMT_TARGET_AVX2 inline __m256 load8(const int32_t* p) { return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)p)); }
+
+		TMT_TARGET_AVX512 inline __m512 load16(const float* p) { return _mm512_loadu_ps(p); }
+		TMT_TARGET_AVX512 inline __m512 load16(const int32_t* p) { return _mm512_mask_cvtepi32_ps(_mm512_setzero_ps(), (__mmask16)-1, _mm512_loadu_si512(p)); }
+
+		// loads of the lanes in the mask only, filling the others with zero
+		TMT_TARGET_AVX512 inline __m512 load16(const float* p, __mmask16 m) { return _mm512_maskz_loadu_ps(m, p); }
+		TMT_TARGET_AVX512 inline __m512 load16(const int32_t* p, __mmask16 m) { return _mm512_mask_cvtepi32_ps(_mm512_setzero_ps(), (__mmask16)-1, _mm512_maskz_loadu_epi32(m, p)); }
+	}
+#endif
+}
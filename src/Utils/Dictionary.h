@@ -1,11 +1,13 @@
 #pragma once
 #include <random>
 #include <exception>
-#include <unordered_map>
 #include <vector>
+#include <string>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <cassert>
+#include <cstring>
 #include "serializer.hpp"
 
 namespace tomoto
@@ -14,66 +16,247 @@ namespace tomoto
 	typedef uint16_t TID;
 	typedef float FLOAT;
 
+	// non-owning reference to a string, standing in for std::string_view of C++17
+	class StringView
+	{
+		const char* ptr = nullptr;
+		size_t len = 0;
+	public:
+		StringView() = default;
+		StringView(const char* _ptr, size_t _len) : ptr(_ptr), len(_len) {}
+		StringView(const std::string& str) : ptr(str.data()), len(str.size()) {}
+
+		const char* data() const { return ptr; }
+		size_t size() const { return len; }
+		bool empty() const { return !len; }
+		std::string str() const { return std::string(ptr, len); }
+
+		bool operator==(const StringView& o) const
+		{
+			return len == o.len && !memcmp(ptr, o.ptr, len);
+		}
+
+		bool operator!=(const StringView& o) const
+		{
+			return !operator==(o);
+		}
+	};
+
+	/*
+	words are stored once in a contiguous arena of chars with their offsets, and found through an open addressing table of vids.
+	dictionary is either owning, or a read-only view of a mapped model, which turns into owning one before it is modified.
+	const methods modify nothing, so a dictionary can be read by many threads at once.
+	*/
 	class Dictionary
 	{
 	protected:
-		std::unordered_map<std::string, VID> dict;
-		std::vector<std::string> id2word;
-	public:
-		VID add(const std::string& word)
+		std::vector<uint32_t> offsets = { 0 }; // (size + 1) offsets of words in chars
+		std::vector<char> chars;
+		std::vector<uint32_t> buckets; // vids, -1 for empty buckets. the number of buckets is a power of 2
+		std::vector<uint32_t> hashes; // hash of each word
+
+		// used by a view only
+		const uint32_t* mappedOffsets = nullptr;
+		const char* mappedChars = nullptr;
+		const uint32_t* mappedBuckets = nullptr;
+		size_t mappedSize = 0, numMappedBuckets = 0;
+
+		static uint32_t hashWord(StringView word)
+		{
+			// FNV-1a
+			uint32_t h = 2166136261u;
+			for (size_t i = 0; i < word.size(); ++i) h = (h ^ (uint8_t)word.data()[i]) * 16777619u;
+			return h;
+		}
+
+		bool isView() const { return mappedOffsets; }
+		const uint32_t* offsetData() const { return isView() ? mappedOffsets : offsets.data(); }
+		const char* charData() const { return isView() ? mappedChars : chars.data(); }
+		const uint32_t* bucketData() const { return isView() ? mappedBuckets : buckets.data(); }
+		size_t numBuckets() const { return isView() ? numMappedBuckets : buckets.size(); }
+
+		VID find(StringView word, uint32_t h) const
 		{
-			auto it = dict.find(word);
-			if (it == dict.end())
+			const size_t nb = numBuckets();
+			if (!nb) return (VID)-1;
+			const uint32_t* bs = bucketData();
+			for (size_t b = h & (nb - 1); bs[b] != (uint32_t)-1; b = (b + 1) & (nb - 1))
 			{
-				dict.emplace(std::make_pair(word, dict.size()));
-				id2word.emplace_back(word);
-				return dict.size() - 1;
+				const VID v = bs[b];
+				if (!isView() && hashes[v] != h) continue;
+				if (toWordView(v) == word) return v;
 			}
-			return it->second;
+			return (VID)-1;
+		}
+
+		void insertBucket(VID v)
+		{
+			size_t b = hashes[v] & (buckets.size() - 1);
+			while (buckets[b] != (uint32_t)-1) b = (b + 1) & (buckets.size() - 1);
+			buckets[b] = v;
+		}
+
+		void rehash(size_t nb)
+		{
+			buckets.assign(nb, (uint32_t)-1);
+			for (VID v = 0; v < hashes.size(); ++v) insertBucket(v);
+		}
+
+		void computeHashes()
+		{
+			hashes.resize(offsets.size() - 1);
+			for (VID v = 0; v < hashes.size(); ++v) hashes[v] = hashWord(toWordView(v));
+		}
+
+		void clearView()
+		{
+			mappedOffsets = nullptr;
+			mappedChars = nullptr;
+			mappedBuckets = nullptr;
+			mappedSize = numMappedBuckets = 0;
+		}
+
+		void becomeOwner()
+		{
+			if (!isView()) return;
+			offsets.assign(mappedOffsets, mappedOffsets + mappedSize + 1);
+			chars.assign(mappedChars, mappedChars + offsets.back());
+			buckets.assign(mappedBuckets, mappedBuckets + numMappedBuckets);
+			clearView();
+			computeHashes();
+		}
+
+		// in the aligned mode of the mapped container, each array is aligned so that it can be used in place
+		void writeArrays(std::ostream& writer) const
+		{
+			serializer::writeMany(writer,
+				tvector<uint32_t>{ (uint32_t*)offsetData(), size() + 1 },
+				tvector<char>{ (char*)charData(), offsetData()[size()] },
+				tvector<uint32_t>{ (uint32_t*)bucketData(), numBuckets() });
+		}
+
+		void readArrays(std::istream& reader)
+		{
+			tvector<uint32_t> o, b;
+			tvector<char> c;
+			serializer::readMany(reader, o, c, b);
+			if (o.empty() || o.back() != c.size() || (b.size() & (b.size() - 1)) || (o.size() > 1 && b.size() <= o.size() - 1))
+				throw std::ios_base::failure("broken dictionary");
+			if (o.isOwner())
+			{
+				// read from a stream, not from memory
+				offsets.assign(o.begin(), o.end());
+				chars.assign(c.begin(), c.end());
+				buckets.assign(b.begin(), b.end());
+				computeHashes();
+				return;
+			}
+			mappedOffsets = o.data();
+			mappedChars = c.data();
+			mappedBuckets = b.data();
+			mappedSize = o.size() - 1;
+			numMappedBuckets = b.size();
+		}
+
+		// format of the model files written before the arena, a list of words
+		void readWordList(std::istream& reader, size_t n)
+		{
+			std::string word;
+			for (size_t i = 0; i < n; ++i)
+			{
+				serializer::readMany(reader, word);
+				add(word);
+			}
+		}
+
+	public:
+		Dictionary() = default;
+		Dictionary(const Dictionary&) = default;
+		Dictionary(Dictionary&&) = default;
+		Dictionary& operator=(const Dictionary&) = default;
+		Dictionary& operator=(Dictionary&&) = default;
+
+		VID add(StringView word)
+		{
+			becomeOwner();
+			const uint32_t h = hashWord(word);
+			VID v = find(word, h);
+			if (v != (VID)-1) return v;
+			v = size();
+			chars.insert(chars.end(), word.data(), word.data() + word.size());
+			offsets.emplace_back(chars.size());
+			hashes.emplace_back(h);
+			if (hashes.size() * 2 > buckets.size()) rehash(std::max(buckets.size() * 2, (size_t)16));
+			else insertBucket(v);
+			return v;
+		}
+
+		size_t size() const { return isView() ? mappedSize : offsets.size() - 1; }
+
+		StringView toWordView(VID vid) const
+		{
+			assert(vid < size());
+			const uint32_t* o = offsetData();
+			return { charData() + o[vid], o[vid + 1] - o[vid] };
 		}
 
-		size_t size() const { return dict.size(); }
-		
 		std::string toWord(VID vid) const
 		{
-			assert(vid < id2word.size());
-			return id2word[vid];
+			return toWordView(vid).str();
 		}
-		
-		VID toWid(const std::string& word) const
+
+		VID toWid(StringView word) const
 		{
-			auto it = dict.find(word);
-			if (it == dict.end()) return (VID)-1;
-			return it->second;
+			return find(word, hashWord(word));
 		}
 
+		// the arena and the hash table are written as they are, after -1 which tells them from the word list of old files
 		void serializerWrite(std::ostream& writer) const
 		{
-			serializer::writeMany(writer, serializer::MagicConstant("Dictionary"), id2word);
+			serializer::writeMany(writer, serializer::MagicConstant("Dictionary"), (uint32_t)-1);
+			writeArrays(writer);
 		}
-		
+
 		void serializerRead(std::istream& reader)
 		{
-			serializer::readMany(reader, serializer::MagicConstant("Dictionary"), id2word);
-			for (size_t i = 0; i < id2word.size(); ++i)
-			{
-				dict.emplace(id2word[i], i);
-			}
+			uint32_t n;
+			serializer::readMany(reader, serializer::MagicConstant("Dictionary"), n);
+			clearView();
+			offsets.assign(1, 0);
+			chars.clear();
+			buckets.clear();
+			hashes.clear();
+			if (n == (uint32_t)-1) readArrays(reader);
+			else readWordList(reader, n);
 		}
 
 		void swap(Dictionary& rhs)
 		{
-			std::swap(dict, rhs.dict);
-			std::swap(id2word, rhs.id2word);
+			std::swap(*this, rhs);
 		}
 
+		// the word of vid v gets vid order[v]
 		void reorder(const std::vector<VID>& order)
 		{
-			for (auto& p : dict)
+			becomeOwner();
+			const size_t n = size();
+			std::vector<VID> inv(n);
+			for (VID v = 0; v < n; ++v) inv[order[v]] = v;
+			std::vector<uint32_t> newOffsets{ 0 }, newHashes(n);
+			std::vector<char> newChars;
+			newOffsets.reserve(n + 1);
+			newChars.reserve(chars.size());
+			for (VID v = 0; v < n; ++v)
 			{
-				p.second = order[p.second];
-				id2word[p.second] = p.first;
+				auto w = toWordView(inv[v]);
+				newChars.insert(newChars.end(), w.data(), w.data() + w.size());
+				newOffsets.emplace_back(newChars.size());
+				newHashes[v] = hashes[inv[v]];
 			}
+			offsets.swap(newOffsets);
+			chars.swap(newChars);
+			hashes.swap(newHashes);
+			rehash(buckets.size());
 		}
 	};
 
@@ -174,7 +174,8 @@ namespace Eigen
 
 	}
 
-	template <typename Derived, typename T> EIGEN_DEVICE_FUNC inline 
+	// only for scalar T, so that two arrays go to the overload below
+	template <typename Derived, typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type> EIGEN_DEVICE_FUNC inline 
 		const CwiseBinaryOp<internal::scalar_lgamma_subt_op< typename internal::traits<Derived>::Scalar, T >, const Derived,
 		const typename internal::plain_constant_type<Derived, T>::type>
 		lgamma_subt(const Eigen::ArrayBase<Derived>& x, const T& scalar)  {
@@ -0,0 +1,224 @@
+#pragma once
+#include "Arch.hpp"
+#include "math.h"
+
+#ifdef TMT_X86
+#include "sse_gamma.h"
+TMT_BEGIN_TARGET_AVX512
+#include "avx512_gamma.h"
+TMT_END_TARGET
+#endif
+
+namespace tomoto
+{
+	namespace math
+	{
+		/*
+		kernels of each instruction set, chosen at runtime by KernelTable.
+		counts of int32_t are cast to float as they are loaded. z is z[0] for all elements if _zConst.
+		there are no kernels of avx2, since log_ps of avx_gamma.h, doing its integer steps in halves of sse,
+		made them slower than those of sse2 at any length. kernels of avx512 take their tails by masks, clear the upper halves
+		of ymm registers before they return, and are used from the lengths where they got faster on a xeon of avx512 (gcc -O2).
+		*/
+		namespace detail
+		{
+			template<bool _zConst, typename _Ty>
+			inline double lgammaSubtSumNone(const float* z, const _Ty* a, size_t n)
+			{
+				double ret = 0;
+				for (size_t i = 0; i < n; ++i) ret += lgammaSubt(z[_zConst ? 0 : i], (float)a[i]);
+				return ret;
+			}
+
+			inline double digammaSumNone(const float* x, float shift, size_t n)
+			{
+				double ret = 0;
+				for (size_t i = 0; i < n; ++i) ret += digammaApprox(x[i] + shift);
+				return ret;
+			}
+
+			inline void digammaEachNone(const float* x, float* out, size_t n)
+			{
+				for (size_t i = 0; i < n; ++i) out[i] = digammaApprox(x[i]);
+			}
+
+#ifdef TMT_X86
+			TMT_TARGET_SSE2 inline double hsum(__m128 x)
+			{
+				float buf[4];
+				_mm_storeu_ps(buf, x);
+				return (double)buf[0] + buf[1] + buf[2] + buf[3];
+			}
+
+			template<bool _zConst, typename _Ty>
+			TMT_TARGET_SSE2 inline double lgammaSubtSumSSE2(const float* z, const _Ty* a, size_t n)
+			{
+				const size_t nf = (n >> 2) << 2;
+				__m128 acc = _mm_setzero_ps();
+				for (size_t i = 0; i < nf; i += 4)
+				{
+					acc = _mm_add_ps(acc, lgamma_subt(_zConst ? _mm_set1_ps(*z) : _mm_loadu_ps(z + i), simd::load4(a + i)));
+				}
+				return hsum(acc) + lgammaSubtSumNone<_zConst>(_zConst ? z : z + nf, a + nf, n - nf);
+			}
+
+			// digammaApprox() with exact reciprocals, which digamma_ps() approximates
+			TMT_TARGET_SSE2 inline __m128 digammaSSE2(__m128 x)
+			{
+				const __m128 one = _mm_set1_ps(1);
+				__m128 x_4 = _mm_add_ps(x, _mm_set1_ps(4));
+				__m128 ret = log_ps(x_4);
+				ret = _mm_sub_ps(ret, _mm_div_ps(_mm_set1_ps(1 / 2.f), x_4));
+				ret = _mm_sub_ps(ret, _mm_div_ps(_mm_div_ps(_mm_set1_ps(1 / 12.f), x_4), x_4));
+				for (int i = 1; i <= 4; ++i) ret = _mm_sub_ps(ret, _mm_div_ps(one, _mm_sub_ps(x_4, _mm_set1_ps(i))));
+				return ret;
+			}
+
+			TMT_TARGET_SSE2 inline double digammaSumSSE2(const float* x, float shift, size_t n)
+			{
+				const size_t nf = (n >> 2) << 2;
+				const __m128 s = _mm_set1_ps(shift);
+				__m128 acc = _mm_setzero_ps();
+				for (size_t i = 0; i < nf; i += 4)
+				{
+					acc = _mm_add_ps(acc, digammaSSE2(_mm_add_ps(_mm_loadu_ps(x + i), s)));
+				}
+				return hsum(acc) + digammaSumNone(x + nf, shift, n - nf);
+			}
+
+			TMT_TARGET_SSE2 inline void digammaEachSSE2(const float* x, float* out, size_t n)
+			{
+				const size_t nf = (n >> 2) << 2;
+				for (size_t i = 0; i < nf; i += 4)
+				{
+					_mm_storeu_ps(out + i, digammaSSE2(_mm_loadu_ps(x + i)));
+				}
+				digammaEachNone(x + nf, out + nf, n - nf);
+			}
+
+			TMT_TARGET_AVX512 inline double hsum(__m512 x)
+			{
+				float buf[16];
+				_mm512_storeu_ps(buf, x);
+				double ret = 0;
+				for (float f : buf) ret += f;
+				return ret;
+			}
+
+			template<bool _zConst, typename _Ty>
+			TMT_TARGET_AVX512 inline double lgammaSubtSumAVX512(const float* z, const _Ty* a, size_t n)
+			{
+				const size_t nf = (n >> 4) << 4;
+				__m512 acc = _mm512_setzero_ps();
+				for (size_t i = 0; i < nf; i += 16)
+				{
+					acc = _mm512_add_ps(acc, lgamma_subt(_zConst ? _mm512_set1_ps(*z) : _mm512_loadu_ps(z + i), simd::load16(a + i)));
+				}
+				// the rest is loaded by the mask, and its lanes out of n are left out of the sum
+				if (nf < n)
+				{
+					const __mmask16 m = (__mmask16)((1u << (n - nf)) - 1);
+					acc = _mm512_mask_add_ps(acc, m, acc, lgamma_subt(_zConst ? _mm512_set1_ps(*z) : simd::load16(z + nf, m), simd::load16(a + nf, m)));
+				}
+				const double ret = hsum(acc);
+				_mm256_zeroupper();
+				return ret;
+			}
+
+			TMT_TARGET_AVX512 inline __m512 digammaAVX512(__m512 x)
+			{
+				const __m512 one = _mm512_set1_ps(1);
+				__m512 x_4 = _mm512_add_ps(x, _mm512_set1_ps(4));
+				__m512 ret = log_ps(x_4);
+				ret = _mm512_sub_ps(ret, _mm512_div_ps(_mm512_set1_ps(1 / 2.f), x_4));
+				ret = _mm512_sub_ps(ret, _mm512_div_ps(_mm512_div_ps(_mm512_set1_ps(1 / 12.f), x_4), x_4));
+				for (int i = 1; i <= 4; ++i) ret = _mm512_sub_ps(ret, _mm512_div_ps(one, _mm512_sub_ps(x_4, _mm512_set1_ps(i))));
+				return ret;
+			}
+
+			TMT_TARGET_AVX512 inline double digammaSumAVX512(const float* x, float shift, size_t n)
+			{
+				const size_t nf = (n >> 4) << 4;
+				const __m512 s = _mm512_set1_ps(shift);
+				__m512 acc = _mm512_setzero_ps();
+				for (size_t i = 0; i < nf; i += 16)
+				{
+					acc = _mm512_add_ps(acc, digammaAVX512(_mm512_add_ps(_mm512_loadu_ps(x + i), s)));
+				}
+				if (nf < n)
+				{
+					const __mmask16 m = (__mmask16)((1u << (n - nf)) - 1);
+					acc = _mm512_mask_add_ps(acc, m, acc, digammaAVX512(_mm512_add_ps(simd::load16(x + nf, m), s)));
+				}
+				const double ret = hsum(acc);
+				_mm256_zeroupper();
+				return ret;
+			}
+
+			TMT_TARGET_AVX512 inline void digammaEachAVX512(const float* x, float* out, size_t n)
+			{
+				const size_t nf = (n >> 4) << 4;
+				for (size_t i = 0; i < nf; i += 16)
+				{
+					_mm512_storeu_ps(out + i, digammaAVX512(_mm512_loadu_ps(x + i)));
+				}
+				if (nf < n)
+				{
+					const __mmask16 m = (__mmask16)((1u << (n - nf)) - 1);
+					_mm512_mask_storeu_ps(out + nf, m, digammaAVX512(simd::load16(x + nf, m)));
+				}
+				_mm256_zeroupper();
+			}
+#endif
+			template<bool _zConst, typename _Ty>
+			inline double lgammaSubtSum(const float* z, const _Ty* a, size_t n)
+			{
+				static const KernelTable<double(*)(const float*, const _Ty*, size_t)> fns{
+					{ &lgammaSubtSumNone<_zConst, _Ty>, 0 },
+					{ TMT_X86_KERNEL((&lgammaSubtSumSSE2<_zConst, _Ty>)), 0 },
+					{ nullptr, 0 },
+					{ TMT_X86_KERNEL((&lgammaSubtSumAVX512<_zConst, _Ty>)), 8 },
+				};
+				return fns(n)(z, a, n);
+			}
+		}
+
+		// sum of lgamma(z[i] + a[i]) - lgamma(z[i]) over i < n, by lgammaSubt()
+		template<typename _Ty>
+		inline double lgammaSubtSum(const float* z, const _Ty* a, size_t n)
+		{
+			return detail::lgammaSubtSum<false>(z, a, n);
+		}
+
+		// sum of lgamma(z + a[i]) - lgamma(z) over i < n
+		template<typename _Ty>
+		inline double lgammaSubtSum(float z, const _Ty* a, size_t n)
+		{
+			return detail::lgammaSubtSum<true>(&z, a, n);
+		}
+
+		// sum of digamma(x[i] + shift) over i < n, by digammaApprox()
+		inline double digammaSum(const float* x, float shift, size_t n)
+		{
+			static const KernelTable<double(*)(const float*, float, size_t)> fns{
+				{ detail::digammaSumNone, 0 },
+				{ TMT_X86_KERNEL(detail::digammaSumSSE2), 0 },
+				{ nullptr, 0 },
+				{ TMT_X86_KERNEL(detail::digammaSumAVX512), 12 },
+			};
+			return fns(n)(x, shift, n);
+		}
+
+		// out[i] = digamma(x[i]) for i < n, by digammaApprox()
+		inline void digammaEach(const float* x, float* out, size_t n)
+		{
+			static const KernelTable<void(*)(const float*, float*, size_t)> fns{
+				{ detail::digammaEachNone, 0 },
+				{ TMT_X86_KERNEL(detail::digammaEachSSE2), 0 },
+				{ nullptr, 0 },
+				{ TMT_X86_KERNEL(detail::digammaEachAVX512), 12 },
+			};
+			fns(n)(x, out, n);
+		}
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <string>
+#include <ios>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace tomoto
+{
+	/*
+	whole file mapped copy-on-write.
+	pages are shared by every process mapping the same file until one writes into them, and the file itself is never modified.
+	*/
+	class MappedFile
+	{
+		char* ptr = nullptr;
+		size_t len = 0;
+#ifdef _WIN32
+		HANDLE hFile = INVALID_HANDLE_VALUE, hMap = nullptr;
+#endif
+	public:
+		MappedFile(const std::string& path)
+		{
+#ifdef _WIN32
+			hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (hFile == INVALID_HANDLE_VALUE) throw std::ios_base::failure("cannot open '" + path + "'");
+			LARGE_INTEGER size;
+			GetFileSizeEx(hFile, &size);
+			len = size.QuadPart;
+			if (len)
+			{
+				hMap = CreateFileMappingA(hFile, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+				if (hMap) ptr = (char*)MapViewOfFile(hMap, FILE_MAP_COPY, 0, 0, 0);
+				if (!ptr)
+				{
+					if (hMap) CloseHandle(hMap);
+					CloseHandle(hFile);
+					throw std::ios_base::failure("cannot map '" + path + "'");
+				}
+			}
+#else
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw std::ios_base::failure("cannot open '" + path + "'");
+			struct stat st;
+			if (fstat(fd, &st) < 0)
+			{
+				close(fd);
+				throw std::ios_base::failure("cannot stat '" + path + "'");
+			}
+			len = st.st_size;
+			if (len)
+			{
+				void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+				if (p == MAP_FAILED)
+				{
+					close(fd);
+					throw std::ios_base::failure("cannot map '" + path + "'");
+				}
+				ptr = (char*)p;
+			}
+			close(fd);
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile()
+		{
+#ifdef _WIN32
+			if (ptr) UnmapViewOfFile(ptr);
+			if (hMap) CloseHandle(hMap);
+			if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+#else
+			if (ptr) munmap(ptr, len);
+#endif
+		}
+
+		const char* data() const { return ptr; }
+		size_t size() const { return len; }
+	};
+}
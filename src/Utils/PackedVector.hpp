@@ -0,0 +1,114 @@
+#pragma once
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include "tvector.hpp"
+#include "serializer.hpp"
+
+namespace tomoto
+{
+	/*
+	array of unsigned integers, each stored in the same number of bits which is given by the largest possible value.
+	values are decoded and encoded on every access. an array takes whole 64-bit blocks of its own,
+	so arrays whose blocks are laid out in one buffer can be written by different threads at once.
+	blocks are owning or a view, like tvector.
+	*/
+	template<typename _Ty>
+	class PackedVector
+	{
+		tvector<uint64_t> blocks;
+		uint32_t len = 0, width = sizeof(_Ty) * 8;
+
+		uint64_t mask() const { return ((uint64_t)1 << width) - 1; }
+
+	public:
+		static size_t numBlocks(size_t n, size_t width)
+		{
+			return (n * width + 63) / 64;
+		}
+
+		// the number of bits needed to store values in [0, bound)
+		static uint32_t widthFor(size_t bound)
+		{
+			uint32_t w = 1;
+			while (w < sizeof(_Ty) * 8 && ((uint64_t)1 << w) < bound) ++w;
+			return w;
+		}
+
+		PackedVector() = default;
+
+		// n zeros of the given width
+		PackedVector(size_t n, uint32_t _width) : blocks(numBlocks(n, _width), (uint64_t)0), len(n), width(_width)
+		{
+			assert(0 < width && width <= sizeof(_Ty) * 8);
+		}
+
+		// view of numBlocks(n, _width) blocks laid out elsewhere, holding n values
+		PackedVector(uint64_t* _blocks, size_t n, uint32_t _width) : blocks(_blocks, numBlocks(n, _width)), len(n), width(_width)
+		{
+			assert(0 < width && width <= sizeof(_Ty) * 8);
+		}
+
+		size_t size() const { return len; }
+		bool empty() const { return !len; }
+		uint32_t getWidth() const { return width; }
+
+		_Ty operator[](size_t i) const
+		{
+			assert(i < len);
+			const size_t pos = i * width, b = pos / 64, off = pos % 64;
+			uint64_t v = blocks[b] >> off;
+			if (off + width > 64) v |= blocks[b + 1] << (64 - off);
+			return (_Ty)(v & mask());
+		}
+
+		void set(size_t i, _Ty val)
+		{
+			assert(i < len && (uint64_t)val <= mask());
+			const size_t pos = i * width, b = pos / 64, off = pos % 64;
+			blocks[b] = (blocks[b] & ~(mask() << off)) | ((uint64_t)val << off);
+			if (off + width > 64)
+			{
+				blocks[b + 1] = (blocks[b + 1] & ~(mask() >> (64 - off))) | ((uint64_t)val >> (64 - off));
+			}
+		}
+
+		// re-encodes the values in newWidth bits, which should be able to hold all of them
+		void setWidth(uint32_t newWidth)
+		{
+			if (newWidth == width) return;
+			PackedVector o{ len, newWidth };
+			for (size_t i = 0; i < len; ++i) o.set(i, (*this)[i]);
+			*this = std::move(o);
+		}
+
+		tvector<uint64_t>& getBlocks() { return blocks; }
+		const tvector<uint64_t>& getBlocks() const { return blocks; }
+
+		// written after -1, which tells them from plain arrays of _Ty of older files
+		void serializerWrite(std::ostream& writer) const
+		{
+			serializer::writeMany(writer, (uint32_t)-1, len, width, blocks);
+		}
+
+		void serializerRead(std::istream& reader)
+		{
+			uint32_t n;
+			serializer::readMany(reader, n);
+			if (n == (uint32_t)-1)
+			{
+				serializer::readMany(reader, len, width, blocks);
+				if (!width || width > sizeof(_Ty) * 8 || blocks.size() != numBlocks(len, width))
+					throw std::ios_base::failure("broken packed array");
+				return;
+			}
+
+			std::vector<_Ty> plain(n);
+			serializer::skipPadding(reader, alignof(_Ty));
+			if (!reader.read((char*)plain.data(), sizeof(_Ty) * n))
+				throw std::ios_base::failure(std::string("reading type '") + typeid(_Ty).name() + std::string("' is failed"));
+			*this = PackedVector{ n, widthFor(n ? (size_t)*std::max_element(plain.begin(), plain.end()) + 1 : 0) };
+			for (size_t i = 0; i < n; ++i) set(i, plain[i]);
+		}
+	};
+}
@@ -0,0 +1,454 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <Eigen/Dense>
+#include "serializer.hpp"
+
+namespace tomoto
+{
+	namespace serializer
+	{
+		// the rows field of the sparse form of count matrices has this bit, which the dense form never has
+		static constexpr uint32_t sparseMatrixTag = 0x80000000u;
+	}
+
+	/*
+	(rows, cols) count matrix whose memory scales with the number of non-zeros.
+	each column is a run of (row, count) pairs sorted by row, and turns into a dense column
+	when more than half of its rows are non-zero, since then the run is larger than the dense one.
+	a dense column turns back into a run at prune(), e.g. at merges, when it has thinned out below a quarter of its rows,
+	which leaves a margin not to flip at every change around a half.
+	it is serialized in the sparse form, the non-zeros of each column, and reads the dense form of Eigen::Matrix as well,
+	so that models are loaded into either of the dense and the sparse storage whichever they were saved from.
+	*/
+	template<typename _Ty>
+	class SparseCountMatrix
+	{
+	public:
+		using Index = Eigen::Index;
+		using Entry = std::pair<uint32_t, _Ty>;
+
+		struct Column
+		{
+			std::vector<Entry> entries; // used if the column is sparse
+			std::vector<_Ty> dense; // used if the column is dense
+
+			bool isDense() const { return !dense.empty(); }
+
+			_Ty coeff(Index k) const
+			{
+				if (isDense()) return dense[k];
+				auto it = std::lower_bound(entries.begin(), entries.end(), Entry{ (uint32_t)k, 0 }, cmpRow);
+				return (it != entries.end() && it->first == k) ? it->second : 0;
+			}
+		};
+
+		class ColumnRange
+		{
+			SparseCountMatrix& m;
+			Index first, num;
+		public:
+			ColumnRange(SparseCountMatrix& _m, Index _first, Index _num) : m(_m), first(_first), num(_num) {}
+
+			ColumnRange& operator=(const SparseCountMatrix& o)
+			{
+				assert(o.rows() == m.rows() && o.cols() == num);
+				std::copy(o.columns.begin(), o.columns.end(), m.columns.begin() + first);
+				return *this;
+			}
+		};
+
+	private:
+		Index numRows = 0;
+		std::vector<Column> columns;
+
+		static bool cmpRow(const Entry& a, const Entry& b)
+		{
+			return a.first < b.first;
+		}
+
+		struct ColumnOp
+		{
+			const Column* c;
+			_Ty operator()(Index k) const { return c->coeff(k); }
+		};
+
+		struct RowOp
+		{
+			const SparseCountMatrix* m;
+			Index k;
+			_Ty operator()(Index v) const { return m->coeff(k, v); }
+		};
+
+		void densify(Column& c)
+		{
+			c.dense.resize(numRows);
+			for (auto& e : c.entries) c.dense[e.first] = e.second;
+			std::vector<Entry>{}.swap(c.entries);
+		}
+
+		void sparsify(Column& c, size_t nnz)
+		{
+			c.entries.reserve(nnz);
+			for (Index k = 0; k < numRows; ++k) if (c.dense[k]) c.entries.emplace_back(k, c.dense[k]);
+			std::vector<_Ty>{}.swap(c.dense);
+		}
+
+	public:
+		SparseCountMatrix() = default;
+		SparseCountMatrix(Index rows, Index cols) : numRows(rows), columns(cols) {}
+
+		static SparseCountMatrix Zero(Index rows, Index cols)
+		{
+			return { rows, cols };
+		}
+
+		Index rows() const { return numRows; }
+		Index cols() const { return columns.size(); }
+
+		// columns are added or removed at the end, new ones are empty. the number of rows can't be changed.
+		void conservativeResize(Index rows, Index cols)
+		{
+			assert(rows == numRows);
+			columns.resize(cols);
+		}
+
+		size_t nonZeros() const
+		{
+			size_t ret = 0;
+			for (auto& c : columns)
+			{
+				if (c.isDense()) ret += std::count_if(c.dense.begin(), c.dense.end(), [](_Ty x) { return x != 0; });
+				else ret += c.entries.size();
+			}
+			return ret;
+		}
+
+		_Ty coeff(Index k, Index v) const
+		{
+			return columns[v].coeff(k);
+		}
+
+		// inserts a zero entry if not exists, the entry remains until prune() is called.
+		_Ty& operator()(Index k, Index v)
+		{
+			auto& c = columns[v];
+			if (c.isDense()) return c.dense[k];
+			auto it = std::lower_bound(c.entries.begin(), c.entries.end(), Entry{ (uint32_t)k, 0 }, cmpRow);
+			if (it != c.entries.end() && it->first == k) return it->second;
+			if ((c.entries.size() + 1) * 2 > (size_t)numRows)
+			{
+				densify(c);
+				return c.dense[k];
+			}
+			return c.entries.insert(it, Entry{ (uint32_t)k, 0 })->second;
+		}
+
+		void prune(Index k, Index v)
+		{
+			auto& c = columns[v];
+			if (c.isDense()) return;
+			auto it = std::lower_bound(c.entries.begin(), c.entries.end(), Entry{ (uint32_t)k, 0 }, cmpRow);
+			if (it != c.entries.end() && it->first == k && it->second <= 0) c.entries.erase(it);
+		}
+
+		// drops non-positive entries and clamps dense columns to zero, turning thinned ones back into runs
+		void prune()
+		{
+			for (auto& c : columns)
+			{
+				if (c.isDense())
+				{
+					size_t nnz = 0;
+					for (auto& x : c.dense)
+					{
+						x = std::max(x, (_Ty)0);
+						nnz += !!x;
+					}
+					if (nnz * 4 < (size_t)numRows) sparsify(c, nnz);
+				}
+				else
+				{
+					c.entries.erase(std::remove_if(c.entries.begin(), c.entries.end(), [](const Entry& e) { return e.second <= 0; }), c.entries.end());
+				}
+			}
+		}
+
+		const Column& column(Index v) const
+		{
+			return columns[v];
+		}
+
+		Eigen::CwiseNullaryOp<ColumnOp, Eigen::Matrix<_Ty, -1, 1>> col(Index v) const
+		{
+			return Eigen::Matrix<_Ty, -1, 1>::NullaryExpr(numRows, ColumnOp{ &columns[v] });
+		}
+
+		Eigen::CwiseNullaryOp<RowOp, Eigen::Matrix<_Ty, 1, -1>> row(Index k) const
+		{
+			return Eigen::Matrix<_Ty, 1, -1>::NullaryExpr(cols(), RowOp{ this, k });
+		}
+
+		SparseCountMatrix middleCols(Index first, Index num) const
+		{
+			SparseCountMatrix ret;
+			ret.numRows = numRows;
+			ret.columns.assign(columns.begin() + first, columns.begin() + first + num);
+			return ret;
+		}
+
+		ColumnRange middleCols(Index first, Index num)
+		{
+			return { *this, first, num };
+		}
+
+		template<typename _Fn>
+		void forEachNonZero(_Fn fn) const
+		{
+			for (size_t v = 0; v < columns.size(); ++v)
+			{
+				auto& c = columns[v];
+				if (c.isDense())
+				{
+					for (Index k = 0; k < numRows; ++k) if (c.dense[k]) fn(k, v, c.dense[k]);
+				}
+				else
+				{
+					for (auto& e : c.entries) if (e.second) fn(e.first, v, e.second);
+				}
+			}
+		}
+
+		/*
+		reads the body of the sparse form after its header of rows and cols,
+		and calls fn(v, rowIds, counts, n) with the n non-zeros of each column v sorted by row.
+		*/
+		template<typename _Fn>
+		static void readSparseForm(std::istream& istr, Index rows, Index cols, _Fn fn)
+		{
+			std::vector<uint32_t> nnzs, rowIds;
+			std::vector<_Ty> counts;
+			serializer::readFromStream(istr, nnzs);
+			serializer::readFromStream(istr, rowIds);
+			serializer::readFromStream(istr, counts);
+			if (nnzs.size() != (size_t)cols || rowIds.size() != counts.size())
+				throw std::ios_base::failure("the sparse form of the count matrix is broken");
+			size_t offset = 0;
+			for (Index v = 0; v < cols; ++v)
+			{
+				if (nnzs[v] > rowIds.size() - offset) throw std::ios_base::failure("the sparse form of the count matrix is broken");
+				for (size_t i = offset; i < offset + nnzs[v]; ++i)
+				{
+					if (rowIds[i] >= (size_t)rows) throw std::ios_base::failure("the sparse form of the count matrix is broken");
+				}
+				fn(v, &rowIds[offset], &counts[offset], (size_t)nnzs[v]);
+				offset += nnzs[v];
+			}
+		}
+
+		void serializerWrite(std::ostream& ostr) const
+		{
+			std::vector<uint32_t> nnzs, rowIds;
+			std::vector<_Ty> counts;
+			nnzs.reserve(columns.size());
+			forEachNonZero([&](Index k, Index v, _Ty c)
+			{
+				if (nnzs.size() <= (size_t)v) nnzs.resize(v + 1);
+				++nnzs[v];
+				rowIds.emplace_back(k);
+				counts.emplace_back(c);
+			});
+			nnzs.resize(columns.size());
+			serializer::writeToStream<uint32_t>(ostr, (uint32_t)numRows | serializer::sparseMatrixTag);
+			serializer::writeToStream<uint32_t>(ostr, columns.size());
+			serializer::writeToStream(ostr, nnzs);
+			serializer::writeToStream(ostr, rowIds);
+			serializer::writeToStream(ostr, counts);
+		}
+
+		void serializerRead(std::istream& istr)
+		{
+			const uint32_t rows = serializer::readFromStream<uint32_t>(istr);
+			numRows = rows & ~serializer::sparseMatrixTag;
+			columns.clear();
+			columns.resize(serializer::readFromStream<uint32_t>(istr));
+			if (rows & serializer::sparseMatrixTag)
+			{
+				readSparseForm(istr, numRows, cols(), [&](Index v, const uint32_t* rowIds, const _Ty* counts, size_t n)
+				{
+					auto& c = columns[v];
+					if (n * 2 > (size_t)numRows)
+					{
+						c.dense.resize(numRows);
+						for (size_t i = 0; i < n; ++i) c.dense[rowIds[i]] = counts[i];
+					}
+					else
+					{
+						c.entries.reserve(n);
+						for (size_t i = 0; i < n; ++i) c.entries.emplace_back(rowIds[i], counts[i]);
+					}
+				});
+				return;
+			}
+
+			// the dense form, written by ShareableMatrix
+			serializer::skipPadding(istr, 64);
+			std::vector<_Ty> buf(numRows);
+			for (auto& c : columns)
+			{
+				if (!istr.read((char*)buf.data(), sizeof(_Ty) * numRows))
+					throw std::ios_base::failure(std::string("reading type '") + typeid(_Ty).name() + std::string("' is failed"));
+				size_t nnz = std::count_if(buf.begin(), buf.end(), [](_Ty x) { return x != 0; });
+				if (nnz * 2 > (size_t)numRows) c.dense = buf;
+				else
+				{
+					c.entries.reserve(nnz);
+					for (size_t k = 0; k < buf.size(); ++k) if (buf[k]) c.entries.emplace_back(k, buf[k]);
+				}
+			}
+		}
+	};
+
+	/*
+	operations on topic-word count matrices shared by the dense and the sparse storage
+	*/
+	template<typename _Derived>
+	inline void pruneZero(Eigen::MatrixBase<_Derived>& m, Eigen::Index k, Eigen::Index v)
+	{
+	}
+
+	template<typename _Ty>
+	inline void pruneZero(SparseCountMatrix<_Ty>& m, Eigen::Index k, Eigen::Index v)
+	{
+		m.prune(k, v);
+	}
+
+	template<typename _Derived, typename _Fn>
+	inline void forEachNonZero(const Eigen::MatrixBase<_Derived>& m, _Fn fn)
+	{
+		for (Eigen::Index v = 0; v < m.cols(); ++v)
+		{
+			for (Eigen::Index k = 0; k < m.rows(); ++k)
+			{
+				if (m(k, v)) fn(k, v, m(k, v));
+			}
+		}
+	}
+
+	template<typename _Ty, typename _Fn>
+	inline void forEachNonZero(const SparseCountMatrix<_Ty>& m, _Fn fn)
+	{
+		m.forEachNonZero(fn);
+	}
+
+	// sum of fn over columns [first, last). fn gets a whole column if it is stored densely, or each non-zero count otherwise.
+	template<typename _Derived, typename _Fn>
+	inline double sumColumns(const Eigen::MatrixBase<_Derived>& m, Eigen::Index first, Eigen::Index last, _Fn& fn)
+	{
+		using _Ty = typename _Derived::Scalar;
+		double ret = 0;
+		for (Eigen::Index v = first; v < last; ++v)
+		{
+			ret += fn(Eigen::Map<const Eigen::Matrix<_Ty, -1, 1>>{ m.derived().data() + v * m.rows(), m.rows() });
+		}
+		return ret;
+	}
+
+	template<typename _Ty, typename _Fn>
+	inline double sumColumns(const SparseCountMatrix<_Ty>& m, Eigen::Index first, Eigen::Index last, _Fn& fn)
+	{
+		double ret = 0;
+		for (Eigen::Index v = first; v < last; ++v)
+		{
+			auto& c = m.column(v);
+			if (c.isDense())
+			{
+				ret += fn(Eigen::Map<const Eigen::Matrix<_Ty, -1, 1>>{ c.dense.data(), m.rows() });
+			}
+			else
+			{
+				for (auto& e : c.entries) ret += fn(e.second);
+			}
+		}
+		return ret;
+	}
+
+	// the column v as a plain array, or null if it is stored sparsely
+	template<typename _Derived>
+	inline const typename _Derived::Scalar* denseColumn(const Eigen::MatrixBase<_Derived>& m, Eigen::Index v)
+	{
+		return m.derived().data() + v * m.rows();
+	}
+
+	template<typename _Ty>
+	inline const _Ty* denseColumn(const SparseCountMatrix<_Ty>& m, Eigen::Index v)
+	{
+		auto& c = m.column(v);
+		return c.isDense() ? c.dense.data() : nullptr;
+	}
+
+	template<typename _Derived>
+	inline Eigen::Matrix<typename _Derived::Scalar, -1, 1> rowSums(const Eigen::MatrixBase<_Derived>& m)
+	{
+		return m.rowwise().sum();
+	}
+
+	template<typename _Ty>
+	inline Eigen::Matrix<_Ty, -1, 1> rowSums(const SparseCountMatrix<_Ty>& m)
+	{
+		Eigen::Matrix<_Ty, -1, 1> ret = Eigen::Matrix<_Ty, -1, 1>::Zero(m.rows());
+		m.forEachNonZero([&](Eigen::Index k, Eigen::Index, _Ty c) { ret[k] += c; });
+		return ret;
+	}
+
+	// dst += a - b
+	template<typename _Derived, typename _DerivedA, typename _DerivedB>
+	inline void addDifference(Eigen::MatrixBase<_Derived>& dst, const Eigen::MatrixBase<_DerivedA>& a, const Eigen::MatrixBase<_DerivedB>& b)
+	{
+		dst += a - b;
+	}
+
+	template<typename _Ty>
+	inline void addDifference(SparseCountMatrix<_Ty>& dst, const SparseCountMatrix<_Ty>& a, const SparseCountMatrix<_Ty>& b)
+	{
+		a.forEachNonZero([&](Eigen::Index k, Eigen::Index v, _Ty c) { dst(k, v) += c; });
+		b.forEachNonZero([&](Eigen::Index k, Eigen::Index v, _Ty c) { dst(k, v) -= c; });
+		dst.prune();
+	}
+
+	// dst += src on columns [first, last)
+	template<typename _Derived, typename _DerivedSrc>
+	inline void addColumns(Eigen::MatrixBase<_Derived>& dst, const Eigen::MatrixBase<_DerivedSrc>& src, Eigen::Index first, Eigen::Index last)
+	{
+		dst.middleCols(first, last - first) += src.middleCols(first, last - first);
+	}
+
+	template<typename _Ty>
+	inline void addColumns(SparseCountMatrix<_Ty>& dst, const SparseCountMatrix<_Ty>& src, Eigen::Index first, Eigen::Index last)
+	{
+		for (Eigen::Index v = first; v < last; ++v)
+		{
+			auto& c = src.column(v);
+			if (c.isDense())
+			{
+				for (Eigen::Index k = 0; k < src.rows(); ++k) if (c.dense[k]) dst(k, v) += c.dense[k];
+			}
+			else
+			{
+				for (auto& e : c.entries) if (e.second) dst(e.first, v) += e.second;
+			}
+		}
+	}
+
+	template<typename _Derived>
+	inline void clampNonNegative(Eigen::MatrixBase<_Derived>& m)
+	{
+		m = m.cwiseMax((typename _Derived::Scalar)0);
+	}
+
+	template<typename _Ty>
+	inline void clampNonNegative(SparseCountMatrix<_Ty>& m)
+	{
+		m.prune();
+	}
+}
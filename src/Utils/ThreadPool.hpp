@@ -3,13 +3,17 @@
 /*
 A simple C++11 Thread Pool implementation(https://github.com/progschj/ThreadPool)
 modified by bab2min to have additional parameter threadId
+
+tasks are kept in per-worker deques, each behind its own mutex, and an idle worker steals from the others.
+tasks of enqueueToAll are pinned to their worker and are never stolen.
 */
 
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <future>
 #include <functional>
@@ -23,32 +27,118 @@ namespace tomoto
 		template<class F, class... Args>
 		auto enqueue(F&& f, Args&&... args)
 			->std::future<typename std::result_of<F(size_t, Args...)>::type>;
-		
+
 		template<class F, class... Args>
 		auto enqueueToAll(F&& f, Args&&... args)
 			->std::vector<std::future<typename std::result_of<F(size_t, Args...)>::type>>;
 
 		~ThreadPool();
-		
+
 		size_t getNumWorkers() const { return workers.size(); }
-		size_t getNumEnqued() const { return tasks.size(); }
+		size_t getNumEnqued() const { return numStealable; }
 	private:
+		/*
+		type-erased packaged_task stored inline, so that queueing a task needs no allocation
+		besides the shared state of its future.
+		*/
+		class Task
+		{
+			enum class Op { run, move, destroy };
+			using Storage = std::aligned_storage<sizeof(std::packaged_task<void(size_t)>), alignof(std::packaged_task<void(size_t)>)>::type;
+			Storage storage;
+			void(*manager)(Op, Task*, Task*, size_t) = nullptr;
+
+			template<class R>
+			static void manage(Op op, Task* self, Task* other, size_t threadId)
+			{
+				using PT = std::packaged_task<R(size_t)>;
+				auto* pt = reinterpret_cast<PT*>(&self->storage);
+				switch (op)
+				{
+				case Op::run:
+					(*pt)(threadId);
+					break;
+				case Op::move:
+					new (&self->storage) PT(std::move(*reinterpret_cast<PT*>(&other->storage)));
+					break;
+				case Op::destroy:
+					pt->~PT();
+					break;
+				}
+			}
+
+			void reset()
+			{
+				if (manager) manager(Op::destroy, this, nullptr, 0);
+				manager = nullptr;
+			}
+		public:
+			Task() = default;
+
+			template<class R>
+			Task(std::packaged_task<R(size_t)>&& pt)
+			{
+				using PT = std::packaged_task<R(size_t)>;
+				static_assert(sizeof(PT) <= sizeof(Storage) && alignof(PT) <= alignof(Storage), "packaged_task does not fit in Task");
+				new (&storage) PT(std::move(pt));
+				manager = &manage<R>;
+			}
+
+			Task(Task&& o)
+			{
+				*this = std::move(o);
+			}
+
+			Task& operator=(Task&& o)
+			{
+				reset();
+				if (o.manager)
+				{
+					o.manager(Op::move, this, &o, 0);
+					manager = o.manager;
+					o.reset();
+				}
+				return *this;
+			}
+
+			~Task()
+			{
+				reset();
+			}
+
+			void operator()(size_t threadId)
+			{
+				manager(Op::run, this, nullptr, threadId);
+			}
+		};
+
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<Task> pinned; // tasks of enqueueToAll, run only by the owner
+			std::deque<Task> stealable;
+			std::atomic<size_t> numPinned{ 0 };
+			char padding[64]; // keeps queues of different workers off the same cache line
+		};
+
 		// need to keep track of threads so we can join them
 		std::vector< std::thread > workers;
-		// the task queue
-		std::queue< std::function<void(size_t)> > shared_task;
-		std::vector< std::queue< std::function<void(size_t)> > > tasks;
-		// synchronization
-		std::mutex queue_mutex;
+		std::unique_ptr<Queue[]> queues;
+		std::atomic<size_t> numStealable{ 0 }, nextQueue{ 0 }, numSleeping{ 0 };
+		// synchronization, used only for sleeping and waking workers
+		std::mutex sleep_mutex;
 		std::condition_variable condition, inputCnd;
 		size_t maxQueued;
-		bool stop;
+		std::atomic<bool> stop{ false };
+
+		bool popTask(size_t i, Task& task);
+		void wakeUp(bool all);
 	};
 
 
 	// the constructor just launches some amount of workers
 	inline ThreadPool::ThreadPool(size_t threads, size_t _maxQueued)
-		: maxQueued(_maxQueued), stop(false), tasks(threads)
+		: queues(new Queue[std::max(threads, (size_t)1)]), maxQueued(_maxQueued)
 	{
 		for (size_t i = 0; i < threads; ++i)
 		{
@@ -56,35 +146,76 @@ namespace tomoto
 			{
 				while (1)
 				{
-					std::function<void(size_t)> task;
-
+					Task task;
+					if (popTask(i, task))
 					{
-						std::unique_lock<std::mutex> lock(this->queue_mutex);
-						this->condition.wait(lock,
-							[this, i] { return this->stop || !this->shared_task.empty() || !this->tasks[i].empty(); });
-						if (this->stop && this->shared_task.empty() && this->tasks[i].empty()) return;
-						if (this->tasks[i].empty())
-						{
-							task = std::move(this->shared_task.front());
-							this->shared_task.pop();
-						}
-						else
-						{
-							task = std::move(this->tasks[i].front());
-							this->tasks[i].pop();
-						}
-						
-						if (this->maxQueued) this->inputCnd.notify_all();
+						task(i);
+						continue;
 					}
 
-					//std::cout << "Start #" << i << std::endl;
-					task(i);
-					//std::cout << "End #" << i << std::endl;
+					std::unique_lock<std::mutex> lock(this->sleep_mutex);
+					++this->numSleeping;
+					this->condition.wait(lock,
+						[this, i] { return this->stop || this->numStealable || this->queues[i].numPinned; });
+					--this->numSleeping;
+					if (this->stop && !this->numStealable && !this->queues[i].numPinned) return;
 				}
 			});
 		}
 	}
 
+	// takes the own pinned task first, then the own stealable one, and steals from the other workers at last
+	inline bool ThreadPool::popTask(size_t i, Task& task)
+	{
+		{
+			auto& q = queues[i];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (!q.pinned.empty())
+			{
+				task = std::move(q.pinned.front());
+				q.pinned.pop_front();
+				--q.numPinned;
+				return true;
+			}
+		}
+
+		if (!numStealable) return false;
+		const size_t n = workers.size();
+		for (size_t j = 0; j < n; ++j)
+		{
+			auto& q = queues[(i + j) % n];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (q.stealable.empty()) continue;
+			if (j)
+			{
+				task = std::move(q.stealable.back());
+				q.stealable.pop_back();
+			}
+			else
+			{
+				task = std::move(q.stealable.front());
+				q.stealable.pop_front();
+			}
+			--numStealable;
+			if (maxQueued)
+			{
+				std::lock_guard<std::mutex> lock(sleep_mutex);
+				inputCnd.notify_all();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	inline void ThreadPool::wakeUp(bool all)
+	{
+		if (!numSleeping) return;
+		// taking the lock makes sure that a worker is either before its check or already waiting
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		if (all) condition.notify_all();
+		else condition.notify_one();
+	}
+
 	// add new work item to the pool
 	template<class F, class... Args>
 	auto ThreadPool::enqueue(F&& f, Args&&... args)
@@ -92,22 +223,24 @@ namespace tomoto
 	{
 		using return_type = typename std::result_of<F(size_t, Args...)>::type;
 
-		auto task = std::make_shared< std::packaged_task<return_type(size_t)> >(
-			std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Args>(args)...));
-
-		std::future<return_type> res = task->get_future();
+		// don't allow enqueueing after stopping the pool
+		if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+		if (maxQueued && numStealable >= maxQueued)
 		{
-			std::unique_lock<std::mutex> lock(queue_mutex);
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			inputCnd.wait(lock, [&]() { return numStealable < maxQueued; });
+		}
 
-			// don't allow enqueueing after stopping the pool
-			if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
-			if (maxQueued && shared_task.size() >= maxQueued)
-			{
-				inputCnd.wait(lock, [&]() { return shared_task.size() < maxQueued; });
-			}
-			shared_task.emplace([task](size_t id) { (*task)(id); });
+		std::packaged_task<return_type(size_t)> task{
+			std::bind(std::forward<F>(f), std::placeholders::_1, std::forward<Args>(args)...) };
+		std::future<return_type> res = task.get_future();
+		{
+			auto& q = queues[nextQueue++ % std::max(workers.size(), (size_t)1)];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.stealable.emplace_back(std::move(task));
 		}
-		condition.notify_one();
+		++numStealable;
+		wakeUp(false);
 		return res;
 	}
 
@@ -117,22 +250,20 @@ namespace tomoto
 	{
 		using return_type = typename std::result_of<F(size_t, Args...)>::type;
 
+		// don't allow enqueueing after stopping the pool
+		if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+
 		std::vector<std::future<return_type> > ret;
-		std::unique_lock<std::mutex> lock(queue_mutex);
 		for (size_t i = 0; i < workers.size(); ++i)
 		{
-			auto task = std::make_shared< std::packaged_task<return_type(size_t)> >(
-				std::bind(f, std::placeholders::_1, args...));
-
-			ret.emplace_back(task->get_future());
-
-			{
-				// don't allow enqueueing after stopping the pool
-				if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
-				tasks[i].emplace([task](size_t id) { (*task)(id); });
-			}
+			std::packaged_task<return_type(size_t)> task{ std::bind(f, std::placeholders::_1, args...) };
+			ret.emplace_back(task.get_future());
+			auto& q = queues[i];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.pinned.emplace_back(std::move(task));
+			++q.numPinned;
 		}
-		condition.notify_all();
+		wakeUp(true);
 		return ret;
 	}
 
@@ -140,7 +271,7 @@ namespace tomoto
 	inline ThreadPool::~ThreadPool()
 	{
 		{
-			std::unique_lock<std::mutex> lock(queue_mutex);
+			std::unique_lock<std::mutex> lock(sleep_mutex);
 			stop = true;
 		}
 		condition.notify_all();
@@ -0,0 +1,55 @@
+#pragma once
+#include <cmath>
+#include <immintrin.h>
+
+/*
+natural logarithm of 16 floats, NaN for x <= 0, the same as log_ps of avx_mathfun.h.
+x = m * 2^e with m in (sqrt(1/2), sqrt(2)], and log(m) is the polynomial of cephes.
+*/
+inline __m512 log_ps(__m512 x)
+{
+	const __m512 one = _mm512_set1_ps(1);
+	const __mmask16 invalid = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_LE_OS);
+	const __mmask16 inf = _mm512_cmp_ps_mask(x, _mm512_set1_ps(INFINITY), _CMP_EQ_OQ);
+	// the masked forms with a zero source, as gcc warns of the undefined source which the plain ones pass
+	__m512 m = _mm512_mask_getmant_ps(_mm512_setzero_ps(), (__mmask16)-1, x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_zero);
+	__m512 e = _mm512_mask_getexp_ps(_mm512_setzero_ps(), (__mmask16)-1, x);
+	const __mmask16 big = _mm512_cmp_ps_mask(m, _mm512_set1_ps(1.41421356f), _CMP_GT_OQ);
+	m = _mm512_mask_mul_ps(m, big, m, _mm512_set1_ps(0.5f));
+	e = _mm512_mask_add_ps(e, big, e, one);
+	x = _mm512_sub_ps(m, one);
+
+	__m512 z = _mm512_mul_ps(x, x);
+	__m512 y = _mm512_set1_ps(7.0376836292E-2f);
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(-1.1514610310E-1f));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.1676998740E-1f));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(-1.2420140846E-1f));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.4249322787E-1f));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(-1.6668057665E-1f));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(2.0000714765E-1f));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(-2.4999993993E-1f));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(3.3333331174E-1f));
+	y = _mm512_mul_ps(_mm512_mul_ps(y, x), z);
+	y = _mm512_fmadd_ps(e, _mm512_set1_ps(-2.12194440e-4f), y);
+	y = _mm512_fnmadd_ps(z, _mm512_set1_ps(0.5f), y);
+	x = _mm512_add_ps(x, y);
+	x = _mm512_fmadd_ps(e, _mm512_set1_ps(0.693359375f), x);
+	x = _mm512_mask_mov_ps(x, inf, _mm512_set1_ps(INFINITY));
+	return _mm512_mask_mov_ps(x, invalid, _mm512_set1_ps(NAN));
+}
+
+// approximation : lgamma(z + a) - lgamma(z) = (z + a + 1.5) * log(z + a + 2) - (z + 1.5) * log(z + 2) - a + (1. / (z + a + 2) - 1. / (z + 2)) / 12. - log(((z + a) * (z + a + 1)) / (z * (z + 1)))
+inline __m512 lgamma_subt(__m512 z, __m512 a)
+{
+	__m512 _1 = _mm512_set1_ps(1);
+	__m512 _1p5 = _mm512_set1_ps(1.5);
+	__m512 _2 = _mm512_set1_ps(2);
+	__m512 _1_12 = _mm512_set1_ps(1 / 12.f);
+	__m512 za = _mm512_add_ps(z, a);
+	__m512 ret = _mm512_mul_ps(_mm512_add_ps(za, _1p5), log_ps(_mm512_add_ps(za, _2)));
+	ret = _mm512_sub_ps(ret, _mm512_mul_ps(_mm512_add_ps(z, _1p5), log_ps(_mm512_add_ps(z, _2))));
+	ret = _mm512_sub_ps(ret, a);
+	ret = _mm512_add_ps(ret, _mm512_sub_ps(_mm512_div_ps(_1_12, _mm512_add_ps(za, _2)), _mm512_div_ps(_1_12, _mm512_add_ps(z, _2))));
+	ret = _mm512_sub_ps(ret, log_ps(_mm512_div_ps(_mm512_div_ps(_mm512_mul_ps(za, _mm512_add_ps(za, _1)), z), _mm512_add_ps(z, _1))));
+	return ret;
+}
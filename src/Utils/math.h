@@ -3,6 +3,7 @@
 #include <cmath>
 #include <random>
 #include <cfloat>
+#include <vector>
 #include "LUT.hpp"
 
 namespace tomoto
@@ -153,6 +154,25 @@ namespace tomoto
 		inline float lgammaT(float x) { return detail::LUT_lgamma::get(x); }
 		inline float digammaT(float x) { return detail::LUT_digamma::get(x); }
 
+		// lgamma(n + a) - lgamma(a) for integer n, tabulated for small n
+		class LgammaCountTable
+		{
+			float a = 0;
+			std::vector<double> table;
+		public:
+			LgammaCountTable() = default;
+			LgammaCountTable(float _a, size_t size = 1024) : a(_a), table(size)
+			{
+				for (size_t i = 0; i < size; ++i) table[i] = std::lgamma(i + (double)a) - std::lgamma((double)a);
+			}
+
+			double operator()(int32_t n) const
+			{
+				if ((size_t)n < table.size()) return table[n];
+				return lgammaT(n + a) - lgammaT(a);
+			}
+		};
+
 		template<class _T>
 		inline _T lgammaApprox(_T z)
 		{
@@ -1,12 +1,10 @@
 #pragma once
 
 #include <random>
-#ifdef __AVX__
+#include <numeric>
+#include "Arch.hpp"
+#ifdef TMT_X86
 #include <immintrin.h>
-#elif defined(__SSE2__)
-#include <xmmintrin.h>
-#else
-
 #endif
 
 #ifdef _WIN32
@@ -30,89 +28,217 @@ namespace tomoto
 #endif
 
 
-#ifdef __AVX__
-		inline __m256 scan_AVX(__m256 x)
+		/*
+		kernels of each instruction set, chosen at runtime by KernelTable.
+		arrays may be unaligned. kernels of avx2 and avx512 clear the upper halves of ymm registers
+		before they return or call narrower ones, so that sse code after them pays no transition penalty.
+		the least lengths of K in the tables are where each kernel got faster than the narrower ones on a xeon of avx512 (gcc -O2).
+		*/
+		namespace detail
 		{
-			__m256 t0, t1;
-			//shift1_AVX + add
-			t0 = _mm256_permute_ps(x, _MM_SHUFFLE(2, 1, 0, 3));
-			t1 = _mm256_permute2f128_ps(t0, t0, 41);
-			x = _mm256_add_ps(x, _mm256_blend_ps(t0, t1, 0x11));
-			//shift2_AVX + add
-			t0 = _mm256_permute_ps(x, _MM_SHUFFLE(1, 0, 3, 2));
-			t1 = _mm256_permute2f128_ps(t0, t0, 41);
-			x = _mm256_add_ps(x, _mm256_blend_ps(t0, t1, 0x33));
-			//shift3_AVX + add
-			x = _mm256_add_ps(x, _mm256_permute2f128_ps(x, x, 41));
-			return x;
-		}
+			inline void prefixSumNone(float* arr, size_t K)
+			{
+				for (size_t i = 1; i < K; ++i)
+				{
+					arr[i] += arr[i - 1];
+				}
+			}
 
-		inline void prefix_sum_AVX(float *a, const int n)
-		{
-			__m256 offset = _mm256_setzero_ps();
-			for (int i = 0; i < n; i += 8)
+			inline size_t searchAccNone(const float* acc, size_t K, float r)
 			{
-				__m256 x = _mm256_loadu_ps(&a[i]);
-				__m256 out = scan_AVX(x);
-				out = _mm256_add_ps(out, offset);
-				_mm256_storeu_ps(&a[i], out);
-				//broadcast last element
-				__m256 t0 = _mm256_permute2f128_ps(out, out, 0x11);
-				offset = _mm256_permute_ps(t0, 0xff);
+				size_t z = 0;
+				for (; z < (K >> 3) << 3; z += 8)
+				{
+					if (r < acc[z]) return z;
+					if (r < acc[z + 1]) return z + 1;
+					if (r < acc[z + 2]) return z + 2;
+					if (r < acc[z + 3]) return z + 3;
+					if (r < acc[z + 4]) return z + 4;
+					if (r < acc[z + 5]) return z + 5;
+					if (r < acc[z + 6]) return z + 6;
+					if (r < acc[z + 7]) return z + 7;
+				}
+				for (; z < K; ++z)
+				{
+					if (r < acc[z]) return z;
+				}
+				return K - 1;
 			}
-		}
 
-		inline void prefixSum(float* arr, size_t K)
-		{
-			size_t Kf = (K >> 3) << 3;
-			if (Kf) prefix_sum_AVX(arr, Kf);
-			else Kf = 1;
-			for (size_t i = Kf; i < K; ++i)
+#ifdef TMT_X86
+			TMT_TARGET_SSE2 inline __m128 scanSSE2(__m128 x)
 			{
-				arr[i] += arr[i - 1];
+				x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
+				x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+				return x;
 			}
-		}
 
-#elif defined(__SSE2__)
-		inline __m128 scan_SSE(__m128 x)
-		{
-			x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
-			x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
-			return x;
-		}
+			TMT_TARGET_SSE2 inline void prefixSumSSE2(float* arr, size_t K)
+			{
+				const size_t Kf = (K >> 2) << 2;
+				__m128 offset = _mm_setzero_ps();
+				for (size_t i = 0; i < Kf; i += 4)
+				{
+					__m128 out = _mm_add_ps(scanSSE2(_mm_loadu_ps(&arr[i])), offset);
+					_mm_storeu_ps(&arr[i], out);
+					offset = _mm_shuffle_ps(out, out, _MM_SHUFFLE(3, 3, 3, 3));
+				}
+				for (size_t i = std::max(Kf, (size_t)1); i < K; ++i)
+				{
+					arr[i] += arr[i - 1];
+				}
+			}
 
-		inline void prefix_sum_SSE(float *a, const int n)
-		{
-			__m128 offset = _mm_setzero_ps();
-			for (int i = 0; i < n; i += 4)
+			TMT_TARGET_SSE2 inline size_t searchAccSSE2(const float* acc, size_t K, float r)
 			{
-				__m128 x = _mm_load_ps(&a[i]);
-				__m128 out = scan_SSE(x);
-				out = _mm_add_ps(out, offset);
-				_mm_store_ps(&a[i], out);
-				offset = _mm_shuffle_ps(out, out, _MM_SHUFFLE(3, 3, 3, 3));
+				size_t z = 0;
+				__m128 mr = _mm_set1_ps(r);
+				for (; z < (K >> 2) << 2; z += 4)
+				{
+					int mask = _mm_movemask_ps(_mm_cmplt_ps(mr, _mm_loadu_ps(&acc[z])));
+					if (mask) return z + 4 - popcnt(mask);
+				}
+				for (; z < K; ++z)
+				{
+					if (r < acc[z]) return z;
+				}
+				return K - 1;
 			}
-		}
 
-		inline void prefixSum(float* arr, size_t K)
-		{
-			size_t Kf = (K >> 2) << 2;
-			if (Kf) prefix_sum_SSE(arr, Kf);
-			else Kf = 1;
-			for (size_t i = Kf; i < K; ++i)
+			TMT_TARGET_AVX2 inline __m256 scanAVX2(__m256 x)
+			{
+				__m256 t0, t1;
+				//shift1_AVX + add
+				t0 = _mm256_permute_ps(x, _MM_SHUFFLE(2, 1, 0, 3));
+				t1 = _mm256_permute2f128_ps(t0, t0, 41);
+				x = _mm256_add_ps(x, _mm256_blend_ps(t0, t1, 0x11));
+				//shift2_AVX + add
+				t0 = _mm256_permute_ps(x, _MM_SHUFFLE(1, 0, 3, 2));
+				t1 = _mm256_permute2f128_ps(t0, t0, 41);
+				x = _mm256_add_ps(x, _mm256_blend_ps(t0, t1, 0x33));
+				//shift3_AVX + add
+				x = _mm256_add_ps(x, _mm256_permute2f128_ps(x, x, 41));
+				return x;
+			}
+
+			TMT_TARGET_AVX2 inline void prefixSumAVX2(float* arr, size_t K)
+			{
+				const size_t Kf = (K >> 3) << 3;
+				__m256 offset = _mm256_setzero_ps();
+				for (size_t i = 0; i < Kf; i += 8)
+				{
+					__m256 out = _mm256_add_ps(scanAVX2(_mm256_loadu_ps(&arr[i])), offset);
+					_mm256_storeu_ps(&arr[i], out);
+					//broadcast last element
+					__m256 t0 = _mm256_permute2f128_ps(out, out, 0x11);
+					offset = _mm256_permute_ps(t0, 0xff);
+				}
+				_mm256_zeroupper();
+				for (size_t i = std::max(Kf, (size_t)1); i < K; ++i)
+				{
+					arr[i] += arr[i - 1];
+				}
+			}
+
+			TMT_TARGET_AVX2 inline size_t searchAccAVX2(const float* acc, size_t K, float r)
+			{
+				size_t z = 0;
+				__m256 mr = _mm256_set1_ps(r);
+				int mask;
+				for (; z < (K >> 5) << 5; z += 32)
+				{
+					mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, _mm256_loadu_ps(&acc[z]), _CMP_LT_OQ));
+					if (mask) { _mm256_zeroupper(); return z + 8 - popcnt(mask); }
+					mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, _mm256_loadu_ps(&acc[z + 8]), _CMP_LT_OQ));
+					if (mask) { _mm256_zeroupper(); return z + 16 - popcnt(mask); }
+					mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, _mm256_loadu_ps(&acc[z + 16]), _CMP_LT_OQ));
+					if (mask) { _mm256_zeroupper(); return z + 24 - popcnt(mask); }
+					mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, _mm256_loadu_ps(&acc[z + 24]), _CMP_LT_OQ));
+					if (mask) { _mm256_zeroupper(); return z + 32 - popcnt(mask); }
+				}
+				for (; z < (K >> 3) << 3; z += 8)
+				{
+					mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, _mm256_loadu_ps(&acc[z]), _CMP_LT_OQ));
+					if (mask) { _mm256_zeroupper(); return z + 8 - popcnt(mask); }
+				}
+				_mm256_zeroupper();
+				for (; z < K; ++z)
+				{
+					if (r < acc[z]) return z;
+				}
+				return K - 1;
+			}
+
+			// x shifted up by n lanes, filling zeros
+			template<int n>
+			TMT_TARGET_AVX512 inline __m512 shiftUpAVX512(__m512 x)
+			{
+				const __m512i zero = _mm512_setzero_si512();
+				return _mm512_castsi512_ps(_mm512_mask_alignr_epi32(zero, (__mmask16)-1, _mm512_castps_si512(x), zero, 16 - n));
+			}
+
+			TMT_TARGET_AVX512 inline void prefixSumAVX512(float* arr, size_t K)
 			{
-				arr[i] += arr[i - 1];
+				const size_t Kf = (K >> 4) << 4;
+				const __m512i last = _mm512_set1_epi32(15);
+				__m512 offset = _mm512_setzero_ps();
+				for (size_t i = 0; i < Kf; i += 16)
+				{
+					__m512 x = _mm512_loadu_ps(&arr[i]);
+					x = _mm512_add_ps(x, shiftUpAVX512<1>(x));
+					x = _mm512_add_ps(x, shiftUpAVX512<2>(x));
+					x = _mm512_add_ps(x, shiftUpAVX512<4>(x));
+					x = _mm512_add_ps(x, shiftUpAVX512<8>(x));
+					x = _mm512_add_ps(x, offset);
+					_mm512_storeu_ps(&arr[i], x);
+					offset = _mm512_mask_permutexvar_ps(_mm512_setzero_ps(), (__mmask16)-1, last, x);
+				}
+				_mm256_zeroupper();
+				// the rest is short, so that the kernel of avx2 does it
+				if (Kf < K)
+				{
+					if (Kf) arr[Kf] += arr[Kf - 1];
+					prefixSumAVX2(arr + Kf, K - Kf);
+				}
+			}
+
+			TMT_TARGET_AVX512 inline size_t searchAccAVX512(const float* acc, size_t K, float r)
+			{
+				size_t z = 0;
+				__m512 mr = _mm512_set1_ps(r);
+				for (; z < (K >> 4) << 4; z += 16)
+				{
+					__mmask16 mask = _mm512_cmp_ps_mask(mr, _mm512_loadu_ps(&acc[z]), _CMP_LT_OQ);
+					if (mask) { _mm256_zeroupper(); return z + 16 - popcnt(mask); }
+				}
+				_mm256_zeroupper();
+				return z + searchAccAVX2(acc + z, K - z, r);
 			}
+#endif
 		}
-#else
+
 		inline void prefixSum(float* arr, size_t K)
 		{
-			for (size_t i = 1; i < K; ++i)
-			{
-				arr[i] += arr[i - 1];
-			}
+			static const KernelTable<void(*)(float*, size_t)> fns{
+				{ detail::prefixSumNone, 0 },
+				{ TMT_X86_KERNEL(detail::prefixSumSSE2), 0 },
+				{ TMT_X86_KERNEL(detail::prefixSumAVX2), 256 },
+				{ TMT_X86_KERNEL(detail::prefixSumAVX512), 96 },
+			};
+			fns(K)(arr, K);
+		}
+
+		// the first z such that r < acc[z], or K - 1 if none. acc should be non-decreasing.
+		inline size_t searchAcc(const float* acc, size_t K, float r)
+		{
+			static const KernelTable<size_t(*)(const float*, size_t, float)> fns{
+				{ detail::searchAccNone, 0 },
+				{ TMT_X86_KERNEL(detail::searchAccSSE2), 0 },
+				{ TMT_X86_KERNEL(detail::searchAccAVX2), 8 },
+				{ TMT_X86_KERNEL(detail::searchAccAVX512), 16 },
+			};
+			return fns(K)(acc, K, r);
 		}
-#endif
 
 		template<class RealIt, class Random>
 		inline size_t sampleFromDiscrete(RealIt begin, RealIt end, Random& rg)
@@ -150,58 +276,159 @@ namespace tomoto
 			//auto r = std::generate_canonical<float, 32>(rg) * *(end - 1);
 			FastRealGenerator dist;
 			auto r = dist(rg) * *(end - 1);
-			size_t K = std::distance(begin, end);
-			size_t z = 0;
-#ifdef __AVX__
-			__m256 mr = _mm256_set1_ps(r), mz;
-			int mask;
-			for (; z < (K >> 5) << 5; z += 32)
-			{
-				mz = _mm256_load_ps(&begin[z]);
-				mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, mz, _CMP_LT_OQ));
-				if (mask) return z + 8 - popcnt(mask);
-				mz = _mm256_load_ps(&begin[z + 8]);
-				mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, mz, _CMP_LT_OQ));
-				if (mask) return z + 16 - popcnt(mask);
-				mz = _mm256_load_ps(&begin[z + 16]);
-				mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, mz, _CMP_LT_OQ));
-				if (mask) return z + 24 - popcnt(mask);
-				mz = _mm256_load_ps(&begin[z + 24]);
-				mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, mz, _CMP_LT_OQ));
-				if (mask) return z + 32 - popcnt(mask);
-			}
-			for (; z < (K >> 3) << 3; z += 8)
-			{
-				__m256 mz = _mm256_load_ps(&begin[z]);
-				int mask = _mm256_movemask_ps(_mm256_cmp_ps(mr, mz, _CMP_LT_OQ));
-				if (mask) return z + 8 - popcnt(mask);
-			}
-#elif defined(__SSE2__)
-			__m128 mr = _mm_set1_ps(r);
-			for (; z < (K >> 2) << 2; z += 4)
-			{
-				__m128 mz = _mm_load_ps(&begin[z]);
-				int mask = _mm_movemask_ps(_mm_cmplt_ps(mr, mz));
-				if (mask) return z + 4 - popcnt(mask);
+			return searchAcc(&*begin, std::distance(begin, end), r);
+		}
+
+		/*
+		terms of the collapsed Gibbs weight of each topic, (docCnt + alpha) * (wordCnt + eta) / (topicCnt + etaSum).
+		eta and etaSum point to a single value shared by all topics unless _vecEta.
+		*/
+		template<typename _Ty, bool _vecEta>
+		struct LikelihoodTerms
+		{
+			const _Ty* docCnt;
+			const float* alpha;
+			const _Ty* wordCnt;
+			const float* eta;
+			const _Ty* topicCnt;
+			const float* etaSum;
+
+			float operator()(size_t k) const
+			{
+				return ((float)docCnt[k] + alpha[k]) * ((float)wordCnt[k] + eta[_vecEta ? k : 0])
+					/ ((float)topicCnt[k] + etaSum[_vecEta ? k : 0]);
 			}
-#else
-			for (; z < (K >> 3) << 3; z += 8)
+		};
+
+		/*
+		kernels writing the prefix sum of weights into acc in a single pass, with the same order of additions as prefixSum().
+		counts are cast to float as they are loaded.
+		*/
+		namespace detail
+		{
+			template<typename _Ty, bool _vecEta>
+			inline void accLikelihoodsNone(float* acc, const LikelihoodTerms<_Ty, _vecEta>& t, size_t K)
 			{
-				if (r < begin[z]) return z;
-				if (r < begin[z + 1]) return z + 1;
-				if (r < begin[z + 2]) return z + 2;
-				if (r < begin[z + 3]) return z + 3;
-				if (r < begin[z + 4]) return z + 4;
-				if (r < begin[z + 5]) return z + 5;
-				if (r < begin[z + 6]) return z + 6;
-				if (r < begin[z + 7]) return z + 7;
+				float sum = 0;
+				for (size_t k = 0; k < K; ++k)
+				{
+					acc[k] = sum = k ? t(k) + sum : t(k);
+				}
 			}
-#endif
-			for (; z < K; ++z)
+
+#ifdef TMT_X86
+			template<typename _Ty, bool _vecEta>
+			TMT_TARGET_SSE2 inline __m128 likelihoodsSSE2(const LikelihoodTerms<_Ty, _vecEta>& t, size_t k)
+			{
+				__m128 eta = _vecEta ? _mm_loadu_ps(t.eta + k) : _mm_set1_ps(*t.eta);
+				__m128 etaSum = _vecEta ? _mm_loadu_ps(t.etaSum + k) : _mm_set1_ps(*t.etaSum);
+				return _mm_div_ps(
+					_mm_mul_ps(_mm_add_ps(simd::load4(t.docCnt + k), _mm_loadu_ps(t.alpha + k)), _mm_add_ps(simd::load4(t.wordCnt + k), eta)),
+					_mm_add_ps(simd::load4(t.topicCnt + k), etaSum));
+			}
+
+			template<typename _Ty, bool _vecEta>
+			TMT_TARGET_SSE2 inline void accLikelihoodsSSE2(float* acc, const LikelihoodTerms<_Ty, _vecEta>& t, size_t K)
+			{
+				const size_t Kf = (K >> 2) << 2;
+				__m128 offset = _mm_setzero_ps();
+				for (size_t k = 0; k < Kf; k += 4)
+				{
+					__m128 out = _mm_add_ps(scanSSE2(likelihoodsSSE2(t, k)), offset);
+					_mm_storeu_ps(&acc[k], out);
+					offset = _mm_shuffle_ps(out, out, _MM_SHUFFLE(3, 3, 3, 3));
+				}
+				for (size_t k = Kf; k < K; ++k)
+				{
+					acc[k] = k ? t(k) + acc[k - 1] : t(k);
+				}
+			}
+
+			template<typename _Ty, bool _vecEta>
+			TMT_TARGET_AVX2 inline __m256 likelihoodsAVX2(const LikelihoodTerms<_Ty, _vecEta>& t, size_t k)
+			{
+				__m256 eta = _vecEta ? _mm256_loadu_ps(t.eta + k) : _mm256_set1_ps(*t.eta);
+				__m256 etaSum = _vecEta ? _mm256_loadu_ps(t.etaSum + k) : _mm256_set1_ps(*t.etaSum);
+				return _mm256_div_ps(
+					_mm256_mul_ps(_mm256_add_ps(simd::load8(t.docCnt + k), _mm256_loadu_ps(t.alpha + k)), _mm256_add_ps(simd::load8(t.wordCnt + k), eta)),
+					_mm256_add_ps(simd::load8(t.topicCnt + k), etaSum));
+			}
+
+			template<typename _Ty, bool _vecEta>
+			TMT_TARGET_AVX2 inline void accLikelihoodsAVX2(float* acc, const LikelihoodTerms<_Ty, _vecEta>& t, size_t K)
+			{
+				const size_t Kf = (K >> 3) << 3;
+				__m256 offset = _mm256_setzero_ps();
+				for (size_t k = 0; k < Kf; k += 8)
+				{
+					__m256 out = _mm256_add_ps(scanAVX2(likelihoodsAVX2(t, k)), offset);
+					_mm256_storeu_ps(&acc[k], out);
+					__m256 t0 = _mm256_permute2f128_ps(out, out, 0x11);
+					offset = _mm256_permute_ps(t0, 0xff);
+				}
+				_mm256_zeroupper();
+				for (size_t k = Kf; k < K; ++k)
+				{
+					acc[k] = k ? t(k) + acc[k - 1] : t(k);
+				}
+			}
+
+			template<typename _Ty, bool _vecEta>
+			TMT_TARGET_AVX512 inline void accLikelihoodsAVX512(float* acc, const LikelihoodTerms<_Ty, _vecEta>& t, size_t K)
 			{
-				if (r < begin[z]) return z;
+				const size_t Kf = (K >> 4) << 4;
+				const __m512i last = _mm512_set1_epi32(15);
+				__m512 offset = _mm512_setzero_ps();
+				for (size_t k = 0; k < Kf; k += 16)
+				{
+					__m512 eta = _vecEta ? _mm512_loadu_ps(t.eta + k) : _mm512_set1_ps(*t.eta);
+					__m512 etaSum = _vecEta ? _mm512_loadu_ps(t.etaSum + k) : _mm512_set1_ps(*t.etaSum);
+					__m512 x = _mm512_div_ps(
+						_mm512_mul_ps(_mm512_add_ps(simd::load16(t.docCnt + k), _mm512_loadu_ps(t.alpha + k)), _mm512_add_ps(simd::load16(t.wordCnt + k), eta)),
+						_mm512_add_ps(simd::load16(t.topicCnt + k), etaSum));
+					x = _mm512_add_ps(x, shiftUpAVX512<1>(x));
+					x = _mm512_add_ps(x, shiftUpAVX512<2>(x));
+					x = _mm512_add_ps(x, shiftUpAVX512<4>(x));
+					x = _mm512_add_ps(x, shiftUpAVX512<8>(x));
+					x = _mm512_add_ps(x, offset);
+					_mm512_storeu_ps(&acc[k], x);
+					offset = _mm512_mask_permutexvar_ps(_mm512_setzero_ps(), (__mmask16)-1, last, x);
+				}
+				_mm256_zeroupper();
+				// the rest is summed as prefixSumAVX512() does
+				if (Kf < K)
+				{
+					for (size_t k = Kf; k < K; ++k) acc[k] = t(k);
+					if (Kf) acc[Kf] += acc[Kf - 1];
+					prefixSumAVX2(acc + Kf, K - Kf);
+				}
 			}
-			return K - 1;
+#endif
+		}
+
+		// writes the prefix sum of the weights of t into acc
+		template<typename _Ty, bool _vecEta>
+		inline void accLikelihoods(float* acc, const LikelihoodTerms<_Ty, _vecEta>& t, size_t K)
+		{
+			static const KernelTable<void(*)(float*, const LikelihoodTerms<_Ty, _vecEta>&, size_t)> fns{
+				{ &detail::accLikelihoodsNone<_Ty, _vecEta>, 0 },
+				{ TMT_X86_KERNEL((&detail::accLikelihoodsSSE2<_Ty, _vecEta>)), 0 },
+				{ TMT_X86_KERNEL((&detail::accLikelihoodsAVX2<_Ty, _vecEta>)), 64 },
+				{ TMT_X86_KERNEL((&detail::accLikelihoodsAVX512<_Ty, _vecEta>)), 96 },
+			};
+			fns(K)(acc, t, K);
+		}
+
+		/*
+		draws a topic by the weights of t, the same as accLikelihoods() followed by sampleFromDiscreteAcc().
+		the weights, the casts of counts and the prefix sum take one pass over K, and the search stops at the drawn topic.
+		acc is the buffer of K floats.
+		*/
+		template<typename _Ty, bool _vecEta, class Random>
+		inline size_t sampleFromLikelihoods(float* acc, const LikelihoodTerms<_Ty, _vecEta>& t, size_t K, Random& rg)
+		{
+			accLikelihoods(acc, t, K);
+			return sampleFromDiscreteAcc(acc, acc + K, rg);
 		}
 	}
 }
@@ -71,6 +71,96 @@ namespace tomoto
 			readMany(istr, std::forward<_RestTy>(rest)...);
 		}
 
+		/*
+		streambuf over a memory range, which lets readers of the mapped container use arrays in place
+		*/
+		class imstreambuf : public std::streambuf
+		{
+		public:
+			imstreambuf(const char* first, const char* last)
+			{
+				setg((char*)first, (char*)first, (char*)last);
+			}
+
+			const char* current() const { return gptr(); }
+
+			void skip(size_t n)
+			{
+				if (n > (size_t)(egptr() - gptr())) throw std::ios_base::failure("skipping out of the range");
+				setg(eback(), gptr() + n, egptr());
+			}
+
+		protected:
+			pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+			{
+				char* p = dir == std::ios_base::beg ? eback() : (dir == std::ios_base::cur ? gptr() : egptr());
+				p += off;
+				if (p < eback() || p > egptr()) return pos_type(off_type(-1));
+				setg(eback(), p, egptr());
+				return pos_type(p - eback());
+			}
+
+			pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+			{
+				return seekoff(off_type(pos), std::ios_base::beg, which);
+			}
+		};
+
+		namespace detail
+		{
+			inline int alignedModeIndex()
+			{
+				static const int i = std::ios_base::xalloc();
+				return i;
+			}
+		}
+
+		/*
+		in aligned mode, arrays are padded to start at a multiple of their alignment, counted from base.
+		used by the mapped container only, other streams have no padding.
+		*/
+		inline void setAlignedMode(std::ios_base& s, std::streamoff base)
+		{
+			s.iword(detail::alignedModeIndex()) = base + 1;
+		}
+
+		inline void unsetAlignedMode(std::ios_base& s)
+		{
+			s.iword(detail::alignedModeIndex()) = 0;
+		}
+
+		inline bool isAlignedMode(std::ios_base& s)
+		{
+			return s.iword(detail::alignedModeIndex());
+		}
+
+		inline void writePadding(std::ostream& ostr, size_t align)
+		{
+			const long base = ostr.iword(detail::alignedModeIndex());
+			if (!base) return;
+			static const char zeros[64] = { 0, };
+			size_t pad = (align - (size_t)((long)ostr.tellp() - (base - 1)) % align) % align;
+			if (!ostr.write(zeros, pad)) throw std::ios_base::failure("writing padding is failed");
+		}
+
+		inline void skipPadding(std::istream& istr, size_t align)
+		{
+			const long base = istr.iword(detail::alignedModeIndex());
+			if (!base) return;
+			size_t pad = (align - (size_t)((long)istr.tellg() - (base - 1)) % align) % align;
+			if (!istr.ignore(pad)) throw std::ios_base::failure("reading padding is failed");
+		}
+
+		// returns the next n bytes in place and consumes them if istr reads memory, otherwise returns nullptr
+		inline const char* mapBytes(std::istream& istr, size_t n)
+		{
+			auto* buf = dynamic_cast<imstreambuf*>(istr.rdbuf());
+			if (!buf) return nullptr;
+			const char* ret = buf->current();
+			buf->skip(n);
+			return ret;
+		}
+
 		namespace detail
 		{
 			template<typename> struct sfinae_true : std::true_type {};
@@ -156,11 +246,44 @@ namespace tomoto
 				throw std::ios_base::failure( std::string("reading type '") + typeid(_Ty).name() + std::string("' is failed") );
 		}
 
+		namespace detail
+		{
+			template<class _Ty>
+			using isRawBlock = std::integral_constant<bool, std::is_fundamental<_Ty>::value && !std::is_same<_Ty, bool>::value>;
+
+			template<class _Ty>
+			inline void writeElements(std::ostream& ostr, const std::vector<_Ty>& v, std::true_type)
+			{
+				if (!ostr.write((const char*)v.data(), sizeof(_Ty) * v.size()))
+					throw std::ios_base::failure(std::string("writing type '") + typeid(_Ty).name() + std::string("' is failed"));
+			}
+
+			template<class _Ty>
+			inline void writeElements(std::ostream& ostr, const std::vector<_Ty>& v, std::false_type)
+			{
+				for (auto& e : v) writeToStream(ostr, e);
+			}
+
+			template<class _Ty>
+			inline void readElements(std::istream& istr, std::vector<_Ty>& v, std::true_type)
+			{
+				if (!istr.read((char*)v.data(), sizeof(_Ty) * v.size()))
+					throw std::ios_base::failure(std::string("reading type '") + typeid(_Ty).name() + std::string("' is failed"));
+			}
+
+			template<class _Ty>
+			inline void readElements(std::istream& istr, std::vector<_Ty>& v, std::false_type)
+			{
+				for (auto& e : v) readFromStream(istr, e);
+			}
+		}
+
+		// vectors of fundamental types are written in one block, which has the same bytes as writing their elements one by one
 		template<class _Ty>
 		inline void writeToBinStreamImpl(std::ostream& ostr, const std::vector<_Ty>& v)
 		{
 			writeToStream<uint32_t>(ostr, v.size());
-			for (auto& e : v) writeToStream(ostr, e);
+			detail::writeElements(ostr, v, detail::isRawBlock<_Ty>{});
 		}
 
 		template<class _Ty>
@@ -168,7 +291,7 @@ namespace tomoto
 		{
 			uint32_t size = readFromStream<uint32_t>(istr);
 			v.resize(size);
-			for (auto& e : v) readFromStream(istr, e);
+			detail::readElements(istr, v, detail::isRawBlock<_Ty>{});
 		}
 
 		template<class _Ty, size_t _N>
@@ -190,13 +313,34 @@ namespace tomoto
 		inline void writeToBinStreamImpl(std::ostream& ostr, const tvector<_Ty>& v)
 		{
 			writeToStream<uint32_t>(ostr, (uint32_t)v.size());
+			if (std::is_fundamental<_Ty>::value)
+			{
+				writePadding(ostr, alignof(_Ty));
+				if (!ostr.write((const char*)v.data(), sizeof(_Ty) * v.size()))
+					throw std::ios_base::failure(std::string("writing type '") + typeid(_Ty).name() + std::string("' is failed"));
+				return;
+			}
 			for (auto& e : v) writeToStream(ostr, e);
 		}
 
+		// fundamental arrays read from memory become non-owning views of it
 		template<class _Ty>
 		inline void readFromBinStreamImpl(std::istream& istr, tvector<_Ty>& v)
 		{
 			uint32_t size = readFromStream<uint32_t>(istr);
+			if (std::is_fundamental<_Ty>::value)
+			{
+				skipPadding(istr, alignof(_Ty));
+				if (const char* p = mapBytes(istr, sizeof(_Ty) * size))
+				{
+					v = tvector<_Ty>{ (_Ty*)p, size };
+					return;
+				}
+				v = tvector<_Ty>(size);
+				if (!istr.read((char*)v.data(), sizeof(_Ty) * size))
+					throw std::ios_base::failure(std::string("reading type '") + typeid(_Ty).name() + std::string("' is failed"));
+				return;
+			}
 			v.resize(size);
 			for (auto& e : v) readFromStream(istr, e);
 		}
@@ -6,6 +6,14 @@
 #include <iterator>
 #include <algorithm>
 #include <cstdio>
+#include <cstdint>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <intrin.h>
+#endif
 
 namespace tomoto
 {
@@ -45,5 +53,77 @@ namespace tomoto
 			} while (pos < str.length() && prev < str.length());
 			return tokens;
 		}
+	
+		// same set of whitespaces as isspace() in the "C" locale, which splits words of istream
+		inline bool isSpace(char c)
+		{
+			return c == ' ' || (uint8_t)(c - '\t') <= '\r' - '\t';
+		}
+
+		namespace detail
+		{
+#ifdef _WIN32
+			inline uint32_t countTrailingZeros(uint32_t i)
+			{
+				unsigned long ret;
+				_BitScanForward(&ret, i);
+				return ret;
+			}
+#else
+			inline uint32_t countTrailingZeros(uint32_t i)
+			{
+				return __builtin_ctz(i);
+			}
+#endif
+
+#ifdef __SSE2__
+			// bit i is set if p[i] is a whitespace
+			inline uint32_t spaceMask(const char* p)
+			{
+				const __m128i v = _mm_loadu_si128((const __m128i*)p);
+				const __m128i ctrl = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+				const __m128i isCtrl = _mm_cmpeq_epi8(_mm_min_epu8(ctrl, _mm_set1_epi8('\r' - '\t')), ctrl);
+				return _mm_movemask_epi8(_mm_or_si128(isCtrl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))));
+			}
+#endif
+		}
+
+		// the first whitespace in [first, last), or last
+		inline const char* findSpace(const char* first, const char* last)
+		{
+#ifdef __SSE2__
+			for (; last - first >= 16; first += 16)
+			{
+				if (uint32_t m = detail::spaceMask(first)) return first + detail::countTrailingZeros(m);
+			}
+#endif
+			while (first != last && !isSpace(*first)) ++first;
+			return first;
+		}
+
+		// the first non-whitespace in [first, last), or last
+		inline const char* findNonSpace(const char* first, const char* last)
+		{
+#ifdef __SSE2__
+			for (; last - first >= 16; first += 16)
+			{
+				if (uint32_t m = ~detail::spaceMask(first) & 0xFFFF) return first + detail::countTrailingZeros(m);
+			}
+#endif
+			while (first != last && isSpace(*first)) ++first;
+			return first;
+		}
+
+		// calls fn(tokenFirst, tokenLast) for each whitespace-separated token until fn returns false
+		template<typename _Fn>
+		inline void forEachToken(const char* first, const char* last, _Fn fn)
+		{
+			while ((first = findNonSpace(first, last)) != last)
+			{
+				const char* end = findSpace(first, last);
+				if (!fn(first, end)) return;
+				first = end;
+			}
+		}
 	}
-}
\ No newline at end of file
+}
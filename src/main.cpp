@@ -75,6 +75,8 @@ int main(int argc, char* argv[])
 				return a + (a.empty() ? "" : ", ") + p.first;
 				}
 			))
+			("sampler", "Sampling Method", cxxopts::value<std::string>(), "dense, sparse; (default = dense)")
+			("sparsetw", "Store topic-word counts sparsely", cxxopts::value<int>()->implicit_value("1"), "memory scales with non-zero counts rather than K * V, useful for large vocabularies")
 			("tw", "Term Weighting", cxxopts::value<std::string>()->default_value("one"), "one, idf, pmi, idf_one; (default = one)")
 			("i,input", "Input File", cxxopts::value<std::vector<std::string>>(), "Input file pathes that contains documents per line")
 			("maxline", "Number of Lines to be read ", cxxopts::value<int>())
@@ -84,6 +86,7 @@ int main(int argc, char* argv[])
 			("tsave", "Save Topic Assignment into file", cxxopts::value<std::string>())
 			("btsave", "Save Best Topic Assignment into file", cxxopts::value<std::string>())
 			("fullmodel", "Full Model Save", cxxopts::value<int>()->implicit_value("1"))
+			("mapped", "Save and load models in the memory-mapped format", cxxopts::value<int>()->implicit_value("1"))
 			("bsave", "Save Best-Fitted Model File", cxxopts::value<std::string>(), "If this parameter is declared, the best fitted model would be save in this path.")
 			("wsave", "Save Word Distribution into file", cxxopts::value<std::string>())
 			("psave", "Save Paramters into file", cxxopts::value<std::string>())
@@ -94,6 +97,11 @@ int main(int argc, char* argv[])
 			("mc", "Minimum Count of Words", cxxopts::value<int>())
 			("rm", "Remove Top N Words", cxxopts::value<int>())
 			("stopword", "Stopword File", cxxopts::value<std::string>())
+			("csave", "Save Compiled Corpus into file", cxxopts::value<std::string>(), "Docs read from the input files are saved in a binary form, which can be loaded by --cload")
+			("cload", "Load Compiled Corpus", cxxopts::value<std::string>(), "Corpus file saved by --csave, which is read instead of the input files")
+			("online", "Online Training", cxxopts::value<int>(), "Docs are streamed from the input files in batches of this size, and only the global state is kept in memory. -I is the number of passes over the inputs (default = 1)")
+			("otau", "Delay of the step size of online training", cxxopts::value<double>(), "step size at the t-th batch is (otau + t)^-okappa; (default = 1)")
+			("okappa", "Decay of the step size of online training", cxxopts::value<double>(), "in (0.5, 1]; (default = 0.7)")
 			
 			("w,worker", "Number of Workes", cxxopts::value<int>(), "The number of workers(std::thread) for inferencing model, default value is 0 which means the number of cores in system")
 			("S,seed", "Seed of Random", cxxopts::value<int>(), "The seed value of random generator. Default value is 0 which means device_random, and other values generate fixed random numbers. Although the seed value is identical, the result could be different due to multithreading race if the number of workers is greater than 1.")
@@ -104,9 +112,17 @@ int main(int argc, char* argv[])
 			("ws", "Number of Top Words to be saved (with --wsave option)", cxxopts::value<int>())
 			("bi", "Burn-in Iteration", cxxopts::value<int>())
 			("oi", "Optimizing Interval", cxxopts::value<int>())
+			("ow", "Warm start of optimizing", cxxopts::value<int>()->implicit_value("1"), "lambda of DMR/g-DMR is optimized from its last optimum, and random restarts are tried only when the objective gets worse than that of the last optimum on the current counts")
+			("optim", "Optimizer of lambda (DMR/g-DMR)", cxxopts::value<std::string>(), "lbfgs, adam; adam estimates the objective from mini-batches of docs, whose cost doesn't depend on the number of docs (default = lbfgs)")
+			("ob", "Batch size of optimizing with --optim adam", cxxopts::value<int>(), "(default = 1024)")
+			("os", "Steps of optimizing with --optim adam", cxxopts::value<int>(), "batches per optimizing interval (default = 20)")
+			("olr", "Step size of optimizing with --optim adam", cxxopts::value<double>(), "step size at the t-th optimizing is olr * t^-odecay; (default = 0.05)")
+			("odecay", "Decay of the step size of optimizing with --optim adam", cxxopts::value<double>(), "(default = 0.5)")
+			("ost", "Staleness of optimizing", cxxopts::value<int>(), "hyperparameters are optimized in the background while sampling goes on for at most this many iterations with the previous ones, 0 for optimizing synchronously; not used with --cl (default = 0)")
 			("dei", "Dirichlet Estimation Iteration", cxxopts::value<int>())
 			("r,repeat", "Number of Repeats", cxxopts::value<int>())
 			("I,iteration", "Iterations", cxxopts::value<int>())
+			("nI", "Iterations on Appended Docs", cxxopts::value<int>(), "Docs of the input files given with -l are appended to the loaded model, and only they are sampled for this many iterations before -I iterations on all docs")
 			("update", "Interval of update", cxxopts::value<int>())
 			("mdm", "Metadata Minimum (g-DMR)", cxxopts::value<string>())
 			("mdM", "Metadata Maximum (g-DMR)", cxxopts::value<string>())
@@ -120,6 +136,7 @@ int main(int argc, char* argv[])
 			("f,inference", "Inference File", cxxopts::value<std::string>(), "File path that would be inferenced by fitted model")
 			("fa", "Inference all together", cxxopts::value<int>()->implicit_value("1"), "")
 			("fI", "Iteration for Inference", cxxopts::value<int>())
+			("fc", "Inference file is a compiled corpus", cxxopts::value<int>()->implicit_value("1"), "")
 
 #ifdef OPENCL
 			("cl", "OpenCL device name for GPU accelerating", cxxopts::value<int>())
@@ -180,9 +197,16 @@ int main(int argc, char* argv[])
 			READ_OPT(repeat, int);
 			READ_OPT2(oi, optimInterval, int);
 			READ_OPT2(or, optimRepeat, int);
+			READ_OPT2(ow, optimWarmStart, int);
+			READ_OPT2(ob, optimBatchSize, int);
+			READ_OPT2(os, optimSteps, int);
+			READ_OPT2(olr, optimLearningRate, double);
+			READ_OPT2(odecay, optimDecay, double);
+			READ_OPT2(ost, optimStaleness, int);
 			READ_OPT(bi, int);
 			READ_OPT2(dei, dirichletEstIteration, int);
 			READ_OPT(iteration, int);
+			READ_OPT2(nI, newIteration, int);
 			READ_OPT2(update, update, int);
 
 			READ_OPT(alpha, double);
@@ -203,9 +227,17 @@ int main(int argc, char* argv[])
 			READ_OPT2(btsave, bestSaveTopicAssign, string);
 			READ_OPT2(dsave, saveTopicDistByDoc, string);
 			READ_OPT2(fullmodel, saveFullModel, int);
+			READ_OPT2(mapped, mappedModel, int);
+			READ_OPT2(sparsetw, sparseTopicWord, int);
 			READ_OPT2(wsave, saveWordDist, string);
 			READ_OPT2(psave, saveParameters, string);
 			READ_OPT(stopword, string);
+			READ_OPT2(csave, saveCorpus, string);
+			READ_OPT2(cload, loadCorpus, string);
+			READ_OPT2(fc, inferenceCorpus, int);
+			READ_OPT(online, int);
+			READ_OPT2(otau, onlineTau, double);
+			READ_OPT2(okappa, onlineKappa, double);
 
 			READ_OPT2(cl, clDevice, int);
 			READ_OPT(clGroup, int);
@@ -218,6 +250,36 @@ int main(int argc, char* argv[])
 			{
 				if (!result.count("iteration")) args.iteration = 0;
 			}
+			if (args.online)
+			{
+				if (!args.load.empty() || !args.loadCorpus.empty() || !args.saveCorpus.empty())
+					throw cxxopts::OptionException("--online streams the input files, and can't be used with -l, --cload or --csave");
+				if (!result.count("iteration")) args.iteration = 1;
+			}
+
+			if (result.count("sampler"))
+			{
+				string sampler = result["sampler"].as<string>();
+				size_t i = 0;
+				for (; i < (size_t)tomoto::Sampler::size; ++i)
+				{
+					if (sampler == tomoto::toString((tomoto::Sampler)i)) break;
+				}
+				if (i == (size_t)tomoto::Sampler::size) throw cxxopts::OptionException("Unknown sampler: " + sampler);
+				args.sampler = (tomoto::Sampler)i;
+			}
+
+			if (result.count("optim"))
+			{
+				string optim = result["optim"].as<string>();
+				size_t i = 0;
+				for (; i < (size_t)tomoto::LambdaOptimizer::size; ++i)
+				{
+					if (optim == tomoto::toString((tomoto::LambdaOptimizer)i)) break;
+				}
+				if (i == (size_t)tomoto::LambdaOptimizer::size) throw cxxopts::OptionException("Unknown optimizer: " + optim);
+				args.lambdaOptimizer = (tomoto::LambdaOptimizer)i;
+			}
 
 			if (result.count("degree"))
 			{